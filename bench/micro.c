@@ -0,0 +1,481 @@
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+// Microbenchmarks of the request parsing and response formatting paths,
+// run without a server. Linked against the objects of an nginx build with
+// the module, see micro.sh.
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <ubus_utility.h>
+
+#include <errno.h>
+#include <time.h>
+
+#define BENCH_MIN_NSEC 200000000ULL
+
+typedef struct {
+  const char *name;
+  void (*run)(void *arg);
+  void *arg;
+} bench_t;
+
+typedef struct {
+  const u_char *data;
+  size_t len;
+  struct blob_attr *parsed;
+  u_char *msgpack;
+  size_t msgpack_len;
+} bench_corpus_t;
+
+static ngx_log_t bench_log;
+
+static size_t bench_allocs;
+static size_t bench_bytes;
+
+// Every allocation of the process is counted, including the ones of
+// libubox and json-c. Relies on the glibc internal entry points.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+void *malloc(size_t size) {
+  bench_allocs++;
+  bench_bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  bench_allocs++;
+  bench_bytes += n * size;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  bench_allocs++;
+  bench_bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+  bench_allocs++;
+  bench_bytes += size;
+  *ptr = __libc_memalign(align, size);
+  return *ptr ? 0 : ENOMEM;
+}
+
+// Defined by nginx.c, which can't be linked in as it has main()
+ngx_module_t ngx_core_module;
+
+char **ngx_set_environment(ngx_cycle_t *cycle, ngx_uint_t *last) {
+  return NULL;
+}
+
+ngx_pid_t ngx_exec_new_binary(ngx_cycle_t *cycle, char *const *argv) {
+  return NGX_INVALID_PID;
+}
+
+ngx_cpuset_t *ngx_get_cpu_affinity(ngx_uint_t n) { return NULL; }
+
+static uint64_t bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_report(bench_t *b) {
+  uint64_t start, elapsed;
+  size_t i, n, allocs, bytes;
+
+  // Grow the iteration count until a run is long enough to be timed
+  for (n = 1;; n *= 2) {
+    start = bench_now();
+    for (i = 0; i < n; i++)
+      b->run(b->arg);
+    elapsed = bench_now() - start;
+
+    if (elapsed >= BENCH_MIN_NSEC)
+      break;
+  }
+
+  allocs = bench_allocs;
+  bytes = bench_bytes;
+
+  start = bench_now();
+  for (i = 0; i < n; i++)
+    b->run(b->arg);
+  elapsed = bench_now() - start;
+
+  allocs = bench_allocs - allocs;
+  bytes = bench_bytes - bytes;
+
+  printf("%-28s %10zu %12.1f %10.2f %12.1f\n", b->name, n,
+         (double)elapsed / n, (double)allocs / n, (double)bytes / n);
+}
+
+// Corpora
+
+static const char *bench_call_fmt =
+    "{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"call\",\"params\":["
+    "\"0123456789abcdef0123456789abcdef\",\"network.interface.lan\","
+    "\"status\",{}]}";
+
+static u_char *bench_single(void) {
+  char *s = __libc_malloc(256);
+
+  sprintf(s, bench_call_fmt, 1);
+
+  return (u_char *)s;
+}
+
+static u_char *bench_batch(int len) {
+  int i;
+  char *p, *s;
+
+  s = p = __libc_malloc(len * 256 + 16);
+
+  *p++ = '[';
+  for (i = 0; i < len; i++) {
+    if (i)
+      *p++ = ',';
+    p += sprintf(p, bench_call_fmt, i);
+  }
+  *p++ = ']';
+  *p = '\0';
+
+  return (u_char *)s;
+}
+
+// A call carrying a big argument table with every value type and escapes
+static u_char *bench_large_args(void) {
+  int i;
+  char *p, *s;
+
+  s = p = __libc_malloc(64 * 1024);
+
+  p += sprintf(p, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"call\","
+                  "\"params\":[\"0123456789abcdef0123456789abcdef\","
+                  "\"uci\",\"set\",{\"config\":\"network\",\"values\":{");
+  for (i = 0; i < 200; i++)
+    p += sprintf(p,
+                 "%s\"key%d\":%s", i ? "," : "", i,
+                 i % 4 == 0   ? "\"a \\\"quoted\\\" value\\n\\u00e9\""
+                 : i % 4 == 1 ? "1234567"
+                 : i % 4 == 2 ? "true"
+                              : "[1,2,3,{\"nested\":\"x\"}]");
+  p += sprintf(p, "}}]}");
+
+  return (u_char *)s;
+}
+
+// Output of a typical dump method, used as the blob to serialize
+static u_char *bench_result(void) {
+  int i;
+  char *p, *s;
+
+  s = p = __libc_malloc(256 * 1024);
+
+  p += sprintf(p, "{\"interface\":[");
+  for (i = 0; i < 100; i++)
+    p += sprintf(p,
+                 "%s{\"interface\":\"if%d\",\"up\":true,\"pending\":false,"
+                 "\"uptime\":%d,\"l3_device\":\"eth%d\",\"proto\":\"static\","
+                 "\"ipv4-address\":[{\"address\":\"192.168.%d.1\","
+                 "\"mask\":24}],\"dns-server\":[\"8.8.8.8\",\"1.1.1.1\"],"
+                 "\"data\":{\"hostname\":\"router \\\"main\\\"\"}}",
+                 i ? "," : "", i, i * 1000, i, i);
+  // Widest double %lf can print
+  p += sprintf(p, "],\"limit\":-1.7976931348623157e308}");
+
+  return (u_char *)s;
+}
+
+static struct blob_attr *bench_parse(bench_corpus_t *c) {
+  ubus_parser_t p;
+  struct blob_attr *attr, *copy;
+
+  ubus_parser_init(&p);
+
+  if (ubus_parser_feed(&p, c->data, c->len) != NGX_OK ||
+      !(attr = ubus_parser_finish(&p))) {
+    fprintf(stderr, "Failed to parse corpus\n");
+    exit(1);
+  }
+
+  copy = __libc_malloc(blob_pad_len(attr));
+  memcpy(copy, attr, blob_pad_len(attr));
+
+  ubus_parser_free(&p);
+
+  return copy;
+}
+
+// The same document in MessagePack, written by the module itself
+static void bench_msgpack(bench_corpus_t *c) {
+  u_char *p;
+  ngx_pool_t *pool;
+  ngx_chain_t *cl;
+  ubus_writer_t w;
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &bench_log);
+
+  ubus_writer_init(&w, pool);
+  w.format = UBUS_FORMAT_MSGPACK;
+  ubus_writer_value(&w, NULL, c->parsed);
+
+  p = c->msgpack = __libc_malloc(w.len);
+  c->msgpack_len = w.len;
+
+  for (cl = w.first; cl; cl = cl->next)
+    p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+
+  ngx_destroy_pool(pool);
+}
+
+static void bench_corpus(bench_corpus_t *c, u_char *data) {
+  c->data = data;
+  c->len = ngx_strlen(data);
+  c->parsed = bench_parse(c);
+  bench_msgpack(c);
+}
+
+// Benchmarks
+
+static void bench_parse_format(const u_char *data, size_t len,
+                               ngx_uint_t format) {
+  ubus_parser_t p;
+
+  ubus_parser_init(&p);
+  p.format = format;
+  ubus_parser_feed(&p, data, len);
+  ubus_parser_finish(&p);
+  ubus_parser_free(&p);
+}
+
+static void run_parse(void *arg) {
+  bench_corpus_t *c = arg;
+
+  bench_parse_format(c->data, c->len, UBUS_FORMAT_JSON);
+}
+
+static void run_parse_msgpack(void *arg) {
+  bench_corpus_t *c = arg;
+
+  bench_parse_format(c->msgpack, c->msgpack_len, UBUS_FORMAT_MSGPACK);
+}
+
+static void run_parse_blobmsg(void *arg) {
+  bench_corpus_t *c = arg;
+
+  bench_parse_format((u_char *)c->parsed, blob_pad_len(c->parsed),
+                     UBUS_FORMAT_BLOBMSG);
+}
+
+static void run_parse_json_rpc(void *arg) {
+  int rem;
+  struct rpc_data data;
+  struct blob_attr *cur;
+  bench_corpus_t *c = arg;
+
+  if (blobmsg_type(c->parsed) == BLOBMSG_TYPE_TABLE) {
+    memset(&data, 0, sizeof(data));
+    parse_json_rpc(&data, c->parsed);
+    return;
+  }
+
+  blobmsg_for_each_attr(cur, c->parsed, rem) {
+    memset(&data, 0, sizeof(data));
+    parse_json_rpc(&data, cur);
+  }
+}
+
+static void run_init_response(void *arg) {
+  struct rpc_data data = {0};
+  struct blob_buf buf = {0};
+  bench_corpus_t *c = arg;
+
+  parse_json_rpc(&data, c->parsed);
+
+  ubus_init_response(&buf, data.id);
+  blob_buf_free(&buf);
+}
+
+typedef struct {
+  struct ubus_object_data *objs;
+  int len;
+  bool verbose;
+} bench_list_t;
+
+static void bench_list_init(bench_list_t *l, int objects, int methods,
+                            int args, bool verbose) {
+  int i, j, k;
+  void *t;
+  char name[32];
+  struct blob_buf sig = {0};
+  static const int types[] = {BLOBMSG_TYPE_STRING, BLOBMSG_TYPE_INT32,
+                              BLOBMSG_TYPE_INT8, BLOBMSG_TYPE_TABLE,
+                              BLOBMSG_TYPE_ARRAY};
+
+  l->objs = __libc_calloc(objects, sizeof(*l->objs));
+  l->len = objects;
+  l->verbose = verbose;
+
+  for (i = 0; i < objects; i++) {
+    blob_buf_init(&sig, 0);
+
+    for (j = 0; j < methods; j++) {
+      snprintf(name, sizeof(name), "method%d", j);
+      t = blobmsg_open_table(&sig, name);
+      for (k = 0; k < args; k++) {
+        snprintf(name, sizeof(name), "argument%d", k);
+        blobmsg_add_u32(&sig, name, types[k % ARRAY_SIZE(types)]);
+      }
+      blobmsg_close_table(&sig, t);
+    }
+
+    snprintf(name, sizeof(name), "bench.object%d", i);
+    l->objs[i].path = strdup(name);
+    l->objs[i].signature = __libc_malloc(blob_pad_len(sig.head));
+    memcpy(l->objs[i].signature, sig.head, blob_pad_len(sig.head));
+  }
+
+  blob_buf_free(&sig);
+}
+
+static void run_list_cb(void *arg) {
+  int i;
+  void *r;
+  bench_list_t *l = arg;
+  struct blob_buf buf = {0};
+  struct list_data data = {.verbose = l->verbose, .buf = &buf};
+
+  blob_buf_init(&buf, 0);
+
+  r = l->verbose ? blobmsg_open_table(&buf, "result")
+                 : blobmsg_open_array(&buf, "result");
+  for (i = 0; i < l->len; i++)
+    ubus_list_cb(NULL, &l->objs[i], &data);
+  blobmsg_close_table(&buf, r);
+
+  blob_buf_free(&buf);
+}
+
+static void bench_write(bench_corpus_t *c, ngx_uint_t format) {
+  ngx_pool_t *pool;
+  ubus_writer_t w;
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &bench_log);
+
+  ubus_writer_init(&w, pool);
+  w.format = format;
+  ubus_writer_value(&w, NULL, c->parsed);
+
+  ngx_destroy_pool(pool);
+}
+
+static void run_write(void *arg) { bench_write(arg, UBUS_FORMAT_JSON); }
+
+static void run_write_msgpack(void *arg) {
+  bench_write(arg, UBUS_FORMAT_MSGPACK);
+}
+
+static void run_write_blobmsg(void *arg) {
+  bench_write(arg, UBUS_FORMAT_BLOBMSG);
+}
+
+// What a batch costs in nginx, apart from the ubus calls themselves:
+// parse, dispatch every element and write a response per element
+static void run_roundtrip(void *arg) {
+  int rem;
+  ubus_parser_t p;
+  ngx_pool_t *pool;
+  ubus_writer_t w;
+  struct rpc_data data;
+  struct blob_buf buf = {0};
+  struct blob_attr *body, *cur;
+  bench_corpus_t *c = arg;
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &bench_log);
+
+  ubus_parser_init(&p);
+  ubus_parser_feed(&p, c->data, c->len);
+  body = ubus_parser_finish(&p);
+
+  ubus_writer_init(&w, pool);
+  ubus_writer_write(&w, "[", 1);
+
+  blobmsg_for_each_attr(cur, body, rem) {
+    memset(&data, 0, sizeof(data));
+    parse_json_rpc(&data, cur);
+
+    ubus_init_response(&buf, data.id);
+    blobmsg_add_field(&buf, BLOBMSG_TYPE_ARRAY, "result", NULL, 0);
+
+    if (w.len > 1)
+      ubus_writer_write(&w, ",", 1);
+    ubus_writer_object(&w, buf.head);
+  }
+
+  ubus_writer_write(&w, "]", 1);
+
+  blob_buf_free(&buf);
+  ubus_parser_free(&p);
+  ngx_destroy_pool(pool);
+}
+
+int main(int argc, char **argv) {
+  size_t i;
+  bench_corpus_t single, batch10, batch100, large, result;
+  bench_list_t list_plain, list_verbose;
+
+  ngx_pagesize = getpagesize();
+  bench_log.log_level = NGX_LOG_ERR;
+
+  bench_corpus(&single, bench_single());
+  bench_corpus(&batch10, bench_batch(10));
+  bench_corpus(&batch100, bench_batch(100));
+  bench_corpus(&large, bench_large_args());
+  bench_corpus(&result, bench_result());
+
+  bench_list_init(&list_plain, 200, 0, 0, false);
+  bench_list_init(&list_verbose, 50, 20, 8, true);
+
+  bench_t benches[] = {
+      {"parse/single", run_parse, &single},
+      {"parse/batch10", run_parse, &batch10},
+      {"parse/batch100", run_parse, &batch100},
+      {"parse/large_args", run_parse, &large},
+      {"parse_msgpack/batch100", run_parse_msgpack, &batch100},
+      {"parse_msgpack/large_args", run_parse_msgpack, &large},
+      {"parse_blobmsg/batch100", run_parse_blobmsg, &batch100},
+      {"parse_blobmsg/large_args", run_parse_blobmsg, &large},
+      {"parse_json_rpc/single", run_parse_json_rpc, &single},
+      {"parse_json_rpc/batch100", run_parse_json_rpc, &batch100},
+      {"init_response", run_init_response, &single},
+      {"list_cb/plain200", run_list_cb, &list_plain},
+      {"list_cb/verbose50x20x8", run_list_cb, &list_verbose},
+      {"write/large_args", run_write, &large},
+      {"write/result", run_write, &result},
+      {"write_msgpack/result", run_write_msgpack, &result},
+      {"write_blobmsg/result", run_write_blobmsg, &result},
+      {"roundtrip/batch10", run_roundtrip, &batch10},
+      {"roundtrip/batch100", run_roundtrip, &batch100},
+  };
+
+  printf("%-28s %10s %12s %10s %12s\n", "benchmark", "iterations", "ns/op",
+         "allocs/op", "bytes/op");
+
+  for (i = 0; i < ARRAY_SIZE(benches); i++)
+    if (argc < 2 || strstr(benches[i].name, argv[1]))
+      bench_report(&benches[i]);
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Build and run the microbenchmarks, see bench/README.md
+#
+# NGX_DIR   nginx source tree configured and built with the module
+#           with --add-module, dynamic modules are not supported
+# CC        compiler (default: cc)
+#
+# Extra arguments are passed to micro, a substring selecting benchmarks.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+SRC_DIR=$(dirname "$BENCH_DIR")/src
+
+if [ -z "$NGX_DIR" ] || ! [ -f "$NGX_DIR/objs/Makefile" ]; then
+  echo "NGX_DIR must point to a built nginx source tree" >&2
+  exit 1
+fi
+
+CC=${CC:-cc}
+OUT=${OUT:-$BENCH_DIR/micro}
+
+# Everything nginx was linked with except nginx.o and its main(), the few
+# symbols it defines for other objects are stubbed in micro.c
+OBJS=$(find "$NGX_DIR/objs" -name '*.o' ! -name nginx.o)
+LIBS=$(sed -n '/^objs\/nginx:/,/^$/p' "$NGX_DIR/objs/Makefile" |
+  grep -o -e '-[lL][^ \\]*' -e '-Wl,[^ \\]*' | tr '\n' ' ')
+
+"$CC" -O2 -o "$OUT" \
+  -I "$NGX_DIR/src/core" -I "$NGX_DIR/src/event" \
+  -I "$NGX_DIR/src/event/modules" -I "$NGX_DIR/src/os/unix" \
+  -I "$NGX_DIR/src/http" -I "$NGX_DIR/src/http/modules" \
+  -I "$NGX_DIR/objs" -I "$SRC_DIR" \
+  "$BENCH_DIR/micro.c" $OBJS $LIBS
+
+"$OUT" "$@"
@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+# End-to-end benchmark of the ubus location, see bench/README.md
+#
+# NGINX        nginx binary built with the module (default: nginx)
+# UBUSD        ubusd binary (default: ubusd)
+# WRK          wrk binary (default: wrk)
+# CC           compiler for ubus_mock (default: cc)
+# PORT         port nginx listens on (default: 8089)
+# DURATION     length of every run (default: 10s)
+# CONNECTIONS  concurrent connections (default: 16)
+# THREADS      wrk threads (default: 2)
+# OBJECTS      objects registered by ubus_mock (default: 10)
+# METHODS      methods per object (default: 4)
+# DELAY        reply delay of ubus_mock in ms (default: 0)
+# SIZE         reply payload size in bytes (default: 64)
+# BATCHES      batch sizes to run (default: "1 10 100")
+# UBUS_CONF    extra directives for the ubus location, e.g. "ubus_async on;"
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+NGINX=${NGINX:-nginx}
+UBUSD=${UBUSD:-ubusd}
+WRK=${WRK:-wrk}
+CC=${CC:-cc}
+PORT=${PORT:-8089}
+DURATION=${DURATION:-10s}
+CONNECTIONS=${CONNECTIONS:-16}
+THREADS=${THREADS:-2}
+OBJECTS=${OBJECTS:-10}
+METHODS=${METHODS:-4}
+DELAY=${DELAY:-0}
+SIZE=${SIZE:-64}
+BATCHES=${BATCHES:-1 10 100}
+UBUS_CONF=${UBUS_CONF:-}
+
+WORK=$(mktemp -d)
+SOCKET=$WORK/ubus.sock
+PIDS=
+
+cleanup() {
+  for pid in $PIDS; do
+    kill "$pid" 2>/dev/null || true
+  done
+  wait 2>/dev/null || true
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+wait_for() {
+  i=0
+  while ! [ -e "$1" ]; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+      echo "Timed out waiting for $1" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+}
+
+$CC -O2 -o "$WORK/ubus_mock" "$BENCH_DIR/ubus_mock.c" -lubus -lubox
+
+"$UBUSD" -s "$SOCKET" &
+PIDS="$PIDS $!"
+wait_for "$SOCKET"
+
+"$WORK/ubus_mock" -s "$SOCKET" -n "$OBJECTS" -m "$METHODS" -d "$DELAY" \
+  -r "$SIZE" &
+PIDS="$PIDS $!"
+
+mkdir -p "$WORK/logs"
+sed -e "s|@PORT@|$PORT|" -e "s|@SOCKET@|$SOCKET|" \
+  -e "s|@UBUS_CONF@|$UBUS_CONF|" "$BENCH_DIR/nginx.conf" >"$WORK/nginx.conf"
+
+"$NGINX" -p "$WORK" -c "$WORK/nginx.conf" &
+PIDS="$PIDS $!"
+wait_for "$WORK/logs/nginx.pid"
+
+run() {
+  BENCH_MODE=$1 BENCH_BATCH=$2 BENCH_OBJECTS=$OBJECTS BENCH_SIZE=$SIZE \
+    "$WRK" -t "$THREADS" -c "$CONNECTIONS" -d "$DURATION" \
+    -s "$BENCH_DIR/ubus.lua" "http://127.0.0.1:$PORT/ubus" |
+    tail -n 1
+}
+
+printf "%-14s %6s %10s %10s %10s %10s %8s\n" mode batch req/s calls/s \
+  p50_ms p99_ms errors
+
+run single 1
+for n in $BATCHES; do
+  run batch "$n"
+done
+run list 1
+run list_verbose 1
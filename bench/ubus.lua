@@ -0,0 +1,68 @@
+-- wrk script sending JSON-RPC requests to the ubus location
+--
+-- BENCH_MODE     single, batch, list or list_verbose
+-- BENCH_BATCH    elements per batch (default 10)
+-- BENCH_OBJECTS  objects registered by ubus_mock (default 10)
+-- BENCH_SIZE     reply payload size asked to ubus_mock (default 64)
+
+local mode = os.getenv("BENCH_MODE") or "single"
+local batch = tonumber(os.getenv("BENCH_BATCH") or "10")
+local objects = tonumber(os.getenv("BENCH_OBJECTS") or "10")
+local size = tonumber(os.getenv("BENCH_SIZE") or "64")
+
+local sid = "00000000000000000000000000000000"
+
+local function call(id)
+   return string.format(
+      '{"jsonrpc":"2.0","id":%d,"method":"call","params":["%s","bench.%d","m0",{"size":%d}]}',
+      id, sid, id % objects, size)
+end
+
+local bodies = {}
+
+local function build()
+   if mode == "single" then
+      for i = 0, objects - 1 do
+         bodies[#bodies + 1] = call(i)
+      end
+   elseif mode == "batch" then
+      local elements = {}
+      for i = 0, batch - 1 do
+         elements[#elements + 1] = call(i)
+      end
+      bodies[1] = "[" .. table.concat(elements, ",") .. "]"
+   elseif mode == "list" then
+      bodies[1] = '{"jsonrpc":"2.0","id":1,"method":"list"}'
+   elseif mode == "list_verbose" then
+      bodies[1] = '{"jsonrpc":"2.0","id":1,"method":"list","params":["bench.*"]}'
+   else
+      error("unknown BENCH_MODE " .. mode)
+   end
+end
+
+build()
+
+wrk.method = "POST"
+wrk.path = "/ubus"
+wrk.headers["Content-Type"] = "application/json"
+
+local n = 0
+
+request = function()
+   n = n + 1
+   return wrk.format(nil, nil, nil, bodies[n % #bodies + 1])
+end
+
+done = function(summary, latency, requests)
+   local seconds = summary.duration / 1e6
+   local errors = summary.errors.connect + summary.errors.read +
+      summary.errors.write + summary.errors.status + summary.errors.timeout
+
+   io.write(string.format("%-14s %6d %10.1f %10.1f %10.3f %10.3f %8d\n",
+                          mode, mode == "batch" and batch or 1,
+                          summary.requests / seconds,
+                          summary.requests / seconds *
+                             (mode == "batch" and batch or 1),
+                          latency:percentile(50) / 1000,
+                          latency:percentile(99) / 1000, errors))
+end
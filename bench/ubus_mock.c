@@ -0,0 +1,220 @@
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+// Registers synthetic objects on ubusd for the benchmarks. Every object
+// bench.<n> has methods m0..m<n>, each answering with a payload of the
+// requested size after the requested delay.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+#include <libubus.h>
+
+#define BENCH_CHUNK 64
+
+enum {
+  BENCH_SIZE,
+  BENCH_DELAY,
+  BENCH_NAME,
+  BENCH_FLAG,
+  __BENCH_MAX,
+};
+
+// Only size and delay are used, the others make verbose lists realistic
+static const struct blobmsg_policy bench_policy[__BENCH_MAX] = {
+    [BENCH_SIZE] = {.name = "size", .type = BLOBMSG_TYPE_INT32},
+    [BENCH_DELAY] = {.name = "delay", .type = BLOBMSG_TYPE_INT32},
+    [BENCH_NAME] = {.name = "name", .type = BLOBMSG_TYPE_STRING},
+    [BENCH_FLAG] = {.name = "flag", .type = BLOBMSG_TYPE_BOOL},
+};
+
+struct bench_deferred {
+  struct uloop_timeout timeout;
+  struct ubus_request_data req;
+  struct ubus_context *ctx;
+  int size;
+};
+
+static struct blob_buf buf;
+static int default_delay;
+static int default_size = BENCH_CHUNK;
+
+static void bench_payload(int size) {
+  int len;
+  void *a;
+  char chunk[BENCH_CHUNK + 1];
+
+  memset(chunk, 'x', BENCH_CHUNK);
+
+  blob_buf_init(&buf, 0);
+
+  // Split in strings like the entries of the usual dump methods
+  a = blobmsg_open_array(&buf, "data");
+  for (; size > 0; size -= len) {
+    len = size < BENCH_CHUNK ? size : BENCH_CHUNK;
+    chunk[len] = '\0';
+    blobmsg_add_string(&buf, NULL, chunk);
+    chunk[len] = 'x';
+  }
+  blobmsg_close_array(&buf, a);
+}
+
+static void bench_deferred_reply(struct uloop_timeout *t) {
+  struct bench_deferred *d = container_of(t, struct bench_deferred, timeout);
+
+  bench_payload(d->size);
+  ubus_send_reply(d->ctx, &d->req, buf.head);
+  ubus_complete_deferred_request(d->ctx, &d->req, UBUS_STATUS_OK);
+
+  free(d);
+}
+
+static int bench_call(struct ubus_context *ctx, struct ubus_object *obj,
+                      struct ubus_request_data *req, const char *method,
+                      struct blob_attr *msg) {
+  struct bench_deferred *d;
+  struct blob_attr *tb[__BENCH_MAX];
+  int size = default_size, delay = default_delay;
+
+  blobmsg_parse(bench_policy, __BENCH_MAX, tb, blob_data(msg), blob_len(msg));
+
+  if (tb[BENCH_SIZE])
+    size = blobmsg_get_u32(tb[BENCH_SIZE]);
+  if (tb[BENCH_DELAY])
+    delay = blobmsg_get_u32(tb[BENCH_DELAY]);
+
+  if (delay <= 0) {
+    bench_payload(size);
+    ubus_send_reply(ctx, req, buf.head);
+    return UBUS_STATUS_OK;
+  }
+
+  d = calloc(1, sizeof(*d));
+  if (!d)
+    return UBUS_STATUS_UNKNOWN_ERROR;
+
+  d->ctx = ctx;
+  d->size = size;
+  d->timeout.cb = bench_deferred_reply;
+
+  ubus_defer_request(ctx, req, &d->req);
+  uloop_timeout_set(&d->timeout, delay);
+
+  return UBUS_STATUS_OK;
+}
+
+static int bench_register(struct ubus_context *ctx, int objects, int methods) {
+  int i, ret;
+  char name[32];
+  struct ubus_method *m;
+  struct ubus_object *obj;
+  struct ubus_object_type *type;
+
+  m = calloc(methods, sizeof(*m));
+  type = calloc(1, sizeof(*type));
+  obj = calloc(objects, sizeof(*obj));
+  if (!m || !type || !obj)
+    return -1;
+
+  for (i = 0; i < methods; i++) {
+    snprintf(name, sizeof(name), "m%d", i);
+    m[i].name = strdup(name);
+    m[i].handler = bench_call;
+    m[i].policy = bench_policy;
+    m[i].n_policy = __BENCH_MAX;
+  }
+
+  type->name = "bench";
+  type->methods = m;
+  type->n_methods = methods;
+
+  for (i = 0; i < objects; i++) {
+    snprintf(name, sizeof(name), "bench.%d", i);
+    obj[i].name = strdup(name);
+    obj[i].type = type;
+    obj[i].methods = m;
+    obj[i].n_methods = methods;
+
+    ret = ubus_add_object(ctx, &obj[i]);
+    if (ret) {
+      fprintf(stderr, "Failed to add %s: %s\n", name, ubus_strerror(ret));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -s <path>   ubus socket\n"
+          "  -n <count>  number of objects (default 10)\n"
+          "  -m <count>  methods per object (default 4)\n"
+          "  -d <ms>     default reply delay (default 0)\n"
+          "  -r <bytes>  default reply payload size (default %d)\n",
+          prog, BENCH_CHUNK);
+}
+
+int main(int argc, char **argv) {
+  int ch;
+  const char *socket = NULL;
+  int objects = 10, methods = 4;
+  struct ubus_context *ctx;
+
+  while ((ch = getopt(argc, argv, "s:n:m:d:r:h")) != -1) {
+    switch (ch) {
+    case 's':
+      socket = optarg;
+      break;
+    case 'n':
+      objects = atoi(optarg);
+      break;
+    case 'm':
+      methods = atoi(optarg);
+      break;
+    case 'd':
+      default_delay = atoi(optarg);
+      break;
+    case 'r':
+      default_size = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (objects < 1 || methods < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  uloop_init();
+
+  ctx = ubus_connect(socket);
+  if (!ctx) {
+    fprintf(stderr, "Failed to connect to ubus\n");
+    return 1;
+  }
+
+  ubus_add_uloop(ctx);
+
+  if (bench_register(ctx, objects, methods))
+    return 1;
+
+  uloop_run();
+
+  ubus_free(ctx);
+  uloop_done();
+
+  return 0;
+}
@@ -12,6 +12,8 @@
 
 #include <ubus_utility.h>
 
+static void *ngx_http_ubus_create_main_conf(ngx_conf_t *cf);
+
 static void *ngx_http_ubus_create_loc_conf(ngx_conf_t *cf);
 
 static char *ngx_http_ubus_merge_loc_conf(ngx_conf_t *cf, void *parent,
@@ -19,15 +21,126 @@ static char *ngx_http_ubus_merge_loc_conf(ngx_conf_t *cf, void *parent,
 
 static char *ngx_http_ubus(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
+static char *ngx_http_ubus_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf);
+
+static char *ngx_http_ubus_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf);
+
+static char *ngx_http_ubus_access(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf);
+
+static char *ngx_http_ubus_coalesce(ngx_conf_t *cf, ngx_command_t *cmd,
+                                    void *conf);
+
+static char *ngx_http_ubus_get(ngx_conf_t *cf, ngx_command_t *cmd,
+                               void *conf);
+
+static char *ngx_http_ubus_timeout(ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf);
+
+static char *ngx_http_ubus_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf);
+
+static char *ngx_http_ubus_limit(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf);
+
+static char *ngx_http_ubus_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf);
+
+static char *ngx_http_ubus_status(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf);
+
+static char *ngx_http_ubus_events(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf);
+
+#if (NGX_THREADS)
+static char *ngx_http_ubus_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+                                       void *conf);
+#endif
+
+static ngx_int_t ngx_http_ubus_add_variables(ngx_conf_t *cf);
+
+static ngx_int_t ngx_http_ubus_variable(ngx_http_request_t *r,
+                                        ngx_http_variable_value_t *v,
+                                        uintptr_t data);
+
+static ngx_int_t ngx_http_ubus_init_process(ngx_cycle_t *cycle);
+
+static void ngx_http_ubus_exit_process(ngx_cycle_t *cycle);
+
+typedef struct {
+  ngx_array_t pools;
+} ngx_http_ubus_main_conf_t;
+
 typedef struct {
   ngx_str_t socket_path;
   ngx_flag_t cors;
   ngx_uint_t script_timeout;
+  ubus_rules_t *timeout_rules;
+  ngx_msec_t deadline;
   ngx_flag_t noauth;
   ngx_flag_t enable;
   ngx_uint_t parallel_req;
+  ngx_uint_t pool_size;
+  size_t max_body_size;
+  ngx_flag_t async;
+  ngx_uint_t stream;
+  ngx_uint_t max_inflight;
+  ngx_flag_t object_cache;
+  ngx_flag_t list_cache;
+  ngx_flag_t acl_cache;
+  ngx_msec_t acl_cache_ttl;
+  ngx_shm_zone_t *cache_zone;
+  ubus_rules_t *cache_rules;
+  ubus_rules_t *access_rules;
+  ubus_rules_t *coalesce_rules;
+  ngx_flag_t coalesce_shared;
+  ubus_rules_t *get_rules;
+  ngx_shm_zone_t *limit_zone;
+  ubus_limits_t limits;
+  ngx_uint_t limit_queue;
+  ngx_msec_t limit_queue_timeout;
+  ngx_shm_zone_t *stats_zone;
+  ngx_shm_zone_t *status_zone;
+  ngx_flag_t server_timing;
+  ngx_flag_t events;
+  ngx_flag_t binary;
+#if (NGX_THREADS)
+  ngx_thread_pool_t *thread_pool;
+#endif
+  ubus_pool_t *pool;
 } ngx_http_ubus_loc_conf_t;
 
+// Request details kept past the end of the request for the log phase
+typedef struct {
+  ngx_str_t method;
+  ngx_str_t object;
+  ngx_str_t function;
+  ngx_str_t batch_size;
+  ngx_str_t status;
+  ngx_str_t upstream_time;
+} ngx_http_ubus_log_ctx_t;
+
+// Client of the ubus_events location. It is the module context of the
+// request, where the $ubus_* variables expect their log context: one is
+// kept first and left empty, streams have no calls to log.
+typedef struct {
+  ngx_http_ubus_log_ctx_t log;
+  ubus_subscriber_t sub;
+  ngx_http_request_t *r;
+  ngx_chain_t *free;
+  ngx_chain_t *busy;
+  ngx_event_t ping;
+} ngx_http_ubus_events_t;
+
+static ngx_conf_enum_t ngx_http_ubus_stream_modes[] = {
+    {ngx_string("off"), UBUS_STREAM_OFF},
+    {ngx_string("on"), UBUS_STREAM_ORDERED},
+    {ngx_string("ordered"), UBUS_STREAM_ORDERED},
+    {ngx_string("unordered"), UBUS_STREAM_UNORDERED},
+    {ngx_null_string, 0}};
+
 static ngx_command_t ngx_http_ubus_commands[] = {
     {ngx_string("ubus_interpreter"), NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
      ngx_http_ubus, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
@@ -44,22 +157,151 @@ static ngx_command_t ngx_http_ubus_commands[] = {
      ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
      offsetof(ngx_http_ubus_loc_conf_t, script_timeout), NULL},
 
+    {ngx_string("ubus_timeout"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE3,
+     ngx_http_ubus_timeout, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_deadline"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, deadline), NULL},
+
     {ngx_string("ubus_noauth"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
      offsetof(ngx_http_ubus_loc_conf_t, noauth), NULL},
 
+    {ngx_string("ubus_allow"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_ubus_access, NGX_HTTP_LOC_CONF_OFFSET, 0,
+     (void *)UBUS_RULE_ALLOW},
+
+    {ngx_string("ubus_deny"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_ubus_access, NGX_HTTP_LOC_CONF_OFFSET, 0,
+     (void *)UBUS_RULE_DENY},
+
     {ngx_string("ubus_parallel_req"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
      ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
      offsetof(ngx_http_ubus_loc_conf_t, parallel_req), NULL},
 
+    {ngx_string("ubus_max_body_size"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, max_body_size), NULL},
+
+    {ngx_string("ubus_pool_size"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, pool_size), NULL},
+
+    {ngx_string("ubus_max_inflight"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, max_inflight), NULL},
+
+    {ngx_string("ubus_async"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, async), NULL},
+
+    {ngx_string("ubus_stream"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_enum_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, stream), &ngx_http_ubus_stream_modes},
+
+#if (NGX_THREADS)
+    {ngx_string("ubus_thread_pool"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_http_ubus_thread_pool, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+#endif
+
+    {ngx_string("ubus_object_cache"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, object_cache), NULL},
+
+    {ngx_string("ubus_list_cache"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, list_cache), NULL},
+
+    {ngx_string("ubus_acl_cache"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, acl_cache), NULL},
+
+    {ngx_string("ubus_acl_cache_ttl"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, acl_cache_ttl), NULL},
+
+    {ngx_string("ubus_cache_zone"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_http_ubus_cache_zone, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_cache"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE3 | NGX_CONF_TAKE4, ngx_http_ubus_cache,
+     NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_coalesce"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE23,
+     ngx_http_ubus_coalesce, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_coalesce_shared"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, coalesce_shared), NULL},
+
+    {ngx_string("ubus_get"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_http_ubus_get, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_limit_zone"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_http_ubus_limit_zone, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_limit"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_http_ubus_limit, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_limit_queue"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, limit_queue), NULL},
+
+    {ngx_string("ubus_limit_queue_timeout"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1, ngx_conf_set_msec_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, limit_queue_timeout), NULL},
+
+    {ngx_string("ubus_stats_zone"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_http_ubus_stats_zone, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_status"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_http_ubus_status, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_events"), NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+     ngx_http_ubus_events, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("ubus_server_timing"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, server_timing), NULL},
+
+    {ngx_string("ubus_binary"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_ubus_loc_conf_t, binary), NULL},
+
     ngx_null_command};
 
+static ngx_http_variable_t ngx_http_ubus_vars[] = {
+    {ngx_string("ubus_method"), NULL, ngx_http_ubus_variable,
+     offsetof(ngx_http_ubus_log_ctx_t, method), NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("ubus_object"), NULL, ngx_http_ubus_variable,
+     offsetof(ngx_http_ubus_log_ctx_t, object), NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("ubus_function"), NULL, ngx_http_ubus_variable,
+     offsetof(ngx_http_ubus_log_ctx_t, function), NGX_HTTP_VAR_NOCACHEABLE,
+     0},
+
+    {ngx_string("ubus_batch_size"), NULL, ngx_http_ubus_variable,
+     offsetof(ngx_http_ubus_log_ctx_t, batch_size), NGX_HTTP_VAR_NOCACHEABLE,
+     0},
+
+    {ngx_string("ubus_status"), NULL, ngx_http_ubus_variable,
+     offsetof(ngx_http_ubus_log_ctx_t, status), NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    {ngx_string("ubus_upstream_time"), NULL, ngx_http_ubus_variable,
+     offsetof(ngx_http_ubus_log_ctx_t, upstream_time),
+     NGX_HTTP_VAR_NOCACHEABLE, 0},
+
+    ngx_http_null_variable};
+
 static ngx_http_module_t ngx_http_ubus_module_ctx = {
-    NULL, /* preconfiguration */
-    NULL, /* postconfiguration */
+    ngx_http_ubus_add_variables, /* preconfiguration */
+    NULL,                        /* postconfiguration */
 
-    NULL, /* create main configuration */
-    NULL, /* init main configuration */
+    ngx_http_ubus_create_main_conf, /* create main configuration */
+    NULL,                           /* init main configuration */
 
     NULL, /* create server configuration */
     NULL, /* merge server configuration */
@@ -75,10 +317,10 @@ ngx_module_t ngx_http_ubus_module = {
     NGX_HTTP_MODULE,           /* module type */
     NULL,                      /* init master */
     NULL,                      /* init module */
-    NULL,                      /* init process */
-    NULL,                      /* init thread */
-    NULL,                      /* exit thread */
-    NULL,                      /* exit process */
+    ngx_http_ubus_init_process, /* init process */
+    NULL,                       /* init thread */
+    NULL,                       /* exit thread */
+    ngx_http_ubus_exit_process, /* exit process */
     NULL,                      /* exit master */
     NGX_MODULE_V1_PADDING};
 
@@ -90,12 +332,9 @@ struct cors_data {
 
 static void ubus_single_error(request_ctx_t *request, enum rpc_status type);
 static ngx_int_t ngx_http_ubus_send_body(request_ctx_t *request);
-static ngx_int_t append_to_output_chain(request_ctx_t *request,
-                                        const char *str);
-static void setup_ubus_ctx_t(ubus_ctx_t *ctx, request_ctx_t *request,
-                             json_object *obj);
-static void free_ubus_ctx_t(ubus_ctx_t *ctx, ngx_http_request_t *r);
-static void free_output_chain(ngx_http_request_t *r, ngx_chain_t *chain);
+static void setup_ubus_ctx_t(ubus_ctx_t *ctx, ngx_pool_t *pool,
+                             request_ctx_t *request, struct blob_attr *obj);
+static void free_ubus_ctx_t(ubus_ctx_t *ctx);
 
 static ngx_int_t set_custom_headers_out(ngx_http_request_t *r,
                                         const char *key_str,
@@ -172,7 +411,14 @@ static void parse_cors_from_header(ngx_http_request_t *r,
 }
 
 static void ubus_add_cors_headers(ngx_http_request_t *r) {
+  bool get;
   struct cors_data *cors;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  // GET is served for ubus_get calls and by the event stream
+  get = cglcf->get_rules || cglcf->events;
 
   cors = ngx_pcalloc(r->pool, sizeof(struct cors_data));
   parse_cors_from_header(r, cors);
@@ -184,7 +430,8 @@ static void ubus_add_cors_headers(ngx_http_request_t *r) {
 
   if (cors->ACCESS_CONTROL_REQUEST_METHOD) {
     char *req = cors->ACCESS_CONTROL_REQUEST_METHOD;
-    if (strcmp(req, "POST") && strcmp(req, "OPTIONS"))
+    if (strcmp(req, "POST") && strcmp(req, "OPTIONS") &&
+        (!get || strcmp(req, "GET")))
       return;
   }
 
@@ -194,19 +441,109 @@ static void ubus_add_cors_headers(ngx_http_request_t *r) {
     set_custom_headers_out(r, "Access-Control-Allow-Headers",
                            cors->ACCESS_CONTROL_REQUEST_HEADERS);
 
-  set_custom_headers_out(r, "Access-Control-Allow-Methods", "POST, OPTIONS");
+  set_custom_headers_out(r, "Access-Control-Allow-Methods",
+                         get ? "GET, POST, OPTIONS" : "POST, OPTIONS");
   set_custom_headers_out(r, "Access-Control-Allow-Credentials", "true");
 
   ngx_pfree(r->pool, cors);
 }
 
+typedef struct {
+  ngx_str_t type;
+  ngx_uint_t format;
+} ngx_http_ubus_format_t;
+
+// Responses are sent with the first type of their format
+static ngx_http_ubus_format_t ngx_http_ubus_formats[] = {
+    {ngx_string("application/json"), UBUS_FORMAT_JSON},
+    {ngx_string("application/x-blobmsg"), UBUS_FORMAT_BLOBMSG},
+    {ngx_string("application/msgpack"), UBUS_FORMAT_MSGPACK},
+    {ngx_string("application/x-msgpack"), UBUS_FORMAT_MSGPACK},
+    {ngx_string("application/vnd.msgpack"), UBUS_FORMAT_MSGPACK},
+    {ngx_null_string, 0}};
+
+// Format of a media type, its parameters are ignored
+static ngx_int_t ngx_http_ubus_format(u_char *p, u_char *last) {
+  u_char *end;
+  ngx_http_ubus_format_t *f;
+
+  while (p < last && *p == ' ')
+    p++;
+
+  for (end = p; end < last && *end != ';' && *end != ' '; end++)
+    ;
+
+  for (f = ngx_http_ubus_formats; f->type.len; f++)
+    if ((size_t)(end - p) == f->type.len &&
+        ngx_strncasecmp(p, f->type.data, f->type.len) == 0)
+      return f->format;
+
+  return NGX_DECLINED;
+}
+
+// The body is decoded as its Content-Type says. The response takes the
+// first known type listed in Accept, the format of the body otherwise.
+static void ngx_http_ubus_negotiate(request_ctx_t *request) {
+  ngx_uint_t i;
+  ngx_int_t format;
+  u_char *p, *next, *last;
+  ngx_table_elt_t *h;
+  ngx_list_part_t *part;
+  ngx_http_request_t *r = request->r;
+
+  h = r->headers_in.content_type;
+  if (h && r->method == NGX_HTTP_POST) {
+    format = ngx_http_ubus_format(h->value.data, h->value.data + h->value.len);
+    if (format != NGX_DECLINED)
+      request->format = request->parser.format = format;
+  }
+
+  part = &r->headers_in.headers.part;
+  h = part->elts;
+
+  for (i = 0; /* void */; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL)
+        return;
+
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+
+    if (h[i].key.len != sizeof("Accept") - 1 ||
+        ngx_strncasecmp(h[i].key.data, (u_char *)"Accept",
+                        sizeof("Accept") - 1))
+      continue;
+
+    last = h[i].value.data + h[i].value.len;
+
+    for (p = h[i].value.data; p < last; p = next + 1) {
+      next = ngx_strlchr(p, last, ',');
+      if (!next)
+        next = last;
+
+      format = ngx_http_ubus_format(p, next);
+      if (format != NGX_DECLINED) {
+        request->format = format;
+        return;
+      }
+    }
+  }
+}
+
 static ngx_int_t ngx_http_ubus_send_header(ngx_http_request_t *r,
                                            ngx_http_ubus_loc_conf_t *cglcf,
+                                           ngx_uint_t format,
                                            ngx_int_t status,
                                            ngx_int_t post_len) {
+  ngx_http_ubus_format_t *f;
+
+  for (f = ngx_http_ubus_formats; f->format != format; f++)
+    ;
+
   r->headers_out.status = status;
-  r->headers_out.content_type.len = sizeof("application/json") - 1;
-  r->headers_out.content_type.data = (u_char *)"application/json";
+  r->headers_out.content_type = f->type;
   r->headers_out.content_length_n = post_len;
 
   if (cglcf->cors)
@@ -215,647 +552,3289 @@ static ngx_int_t ngx_http_ubus_send_header(ngx_http_request_t *r,
   return ngx_http_send_header(r);
 }
 
-static char *ubus_gen_error(request_ctx_t *request, enum rpc_status type) {
-  void *c;
-  char *str;
-  struct blob_buf *buf = ngx_pcalloc(request->r->pool, sizeof(struct blob_buf));
-  struct dispatch_ubus *du =
-      ngx_pcalloc(request->r->pool, sizeof(struct dispatch_ubus));
+static const char *ubus_timing_names[__UBUS_TIMING_MAX] = {
+    [UBUS_TIMING_READ] = "read",         [UBUS_TIMING_PARSE] = "parse",
+    [UBUS_TIMING_CONNECT] = "connect",   [UBUS_TIMING_LOOKUP] = "lookup",
+    [UBUS_TIMING_ACL] = "acl",           [UBUS_TIMING_INVOKE] = "invoke",
+    [UBUS_TIMING_SERIALIZE] = "serialize", [UBUS_TIMING_OUTPUT] = "output",
+};
+
+static uint64_t ubus_timing_start(request_ctx_t *request) {
+  return request->timed ? ubus_stats_now() : 0;
+}
+
+static void ubus_timing_add(request_ctx_t *request, int phase,
+                            uint64_t start) {
+  if (request->timed)
+    request->timing[phase] += ubus_stats_now() - start;
+}
+
+// Call phases are summed over the elements of a batch
+static void ubus_timing_total(request_ctx_t *request, uint64_t *total) {
+  int i, j, n;
+
+  ngx_memcpy(total, request->timing, sizeof(request->timing));
+
+  if (!request->calls)
+    return;
+
+  n = request->array ? request->array_len : 1;
 
-  blob_buf_init(buf, 0);
+  for (i = 0; i < n; i++)
+    if (request->calls[i].done)
+      for (j = 0; j < __UBUS_TIMING_MAX; j++)
+        total[j] += request->calls[i].timing[j];
+}
+
+// Output is still to come when the header is sent, it only goes to the log
+static void ngx_http_ubus_server_timing(request_ctx_t *request) {
+  int i;
+  u_char *p;
+  uint64_t total[__UBUS_TIMING_MAX];
+  u_char value[UBUS_TIMING_OUTPUT *
+               (sizeof("serialize;dur=.000, ") + NGX_INT64_LEN)];
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  if (!cglcf->server_timing)
+    return;
+
+  ubus_timing_total(request, total);
 
-  ubus_init_response(buf, du);
+  for (i = 0, p = value; i < UBUS_TIMING_OUTPUT; i++)
+    p = ngx_sprintf(p, "%s%s;dur=%uL.%03uL", i ? ", " : "",
+                    ubus_timing_names[i], total[i] / 1000, total[i] % 1000);
+
+  *p = '\0';
+
+  set_custom_headers_out(request->r, "Server-Timing", (char *)value);
+}
+
+static void ubus_gen_error(request_ctx_t *request, ubus_writer_t *w,
+                           enum rpc_status type) {
+  void *c;
+  struct blob_buf *buf = ngx_pcalloc(w->pool, sizeof(struct blob_buf));
+
+  ubus_init_response(buf, NULL);
 
   c = blobmsg_open_table(buf, "error");
   blobmsg_add_u32(buf, "code", json_errors[type].code);
   blobmsg_add_string(buf, "message", json_errors[type].msg);
   blobmsg_close_table(buf, c);
 
-  free_output_chain(request->r, request->out_chain_start);
+  ubus_writer_object(w, buf->head);
 
-  str = blobmsg_format_json(buf->head, true);
-
-  ngx_pfree(request->r->pool, du);
   free(buf->buf);
-  ngx_pfree(request->r->pool, buf);
-
-  return str;
+  ngx_pfree(w->pool, buf);
 }
 
 static void ubus_single_error(request_ctx_t *request, enum rpc_status type) {
-  char *str;
   ngx_http_ubus_loc_conf_t *cglcf =
       ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
 
   ngx_log_error(NGX_LOG_ERR, request->r->connection->log, 0,
                 "Request generated error: %s", json_errors[type].msg);
 
-  request->res_len = 0;
+  request->status = type;
 
-  if (request->ubus_ctx)
-    ubus_close_fds(request->ubus_ctx);
+  // Anything already written for the request is dropped
+  ubus_writer_init(&request->out, request->r->pool);
+  request->out.format = request->format;
+  ubus_gen_error(request, &request->out, type);
 
-  str = ubus_gen_error(request, type);
-  append_to_output_chain(request, str);
-  free(str);
-
-  ngx_http_ubus_send_header(request->r, cglcf, NGX_HTTP_OK, request->res_len);
+  ngx_http_ubus_server_timing(request);
+  ngx_http_ubus_send_header(request->r, cglcf, request->format, NGX_HTTP_OK,
+                            request->out.len);
   ngx_http_ubus_send_body(request);
 }
 
-static ngx_int_t append_to_output_chain(request_ctx_t *request,
-                                        const char *str) {
-  ngx_buf_t *b;
-  ngx_int_t len = strlen(str);
-
-  char *data = ngx_pcalloc(request->r->pool, len);
-  ngx_memcpy(data, str, len);
-
-  b = ngx_pcalloc(request->r->pool, sizeof(ngx_buf_t));
-  b->pos = data;
-  b->last = data + len;
-  b->memory = 1;
-  request->res_len += len;
-
-  if (!request->out_chain) {
-    request->out_chain = ngx_pcalloc(request->r->pool, sizeof(ngx_chain_t));
-    request->out_chain->buf = b;
-    request->out_chain->next = NULL;
-    request->out_chain_start = request->out_chain;
-  } else {
-    ngx_chain_t *out_aux = ngx_pcalloc(request->r->pool, sizeof(ngx_chain_t));
-    out_aux->buf = b;
-    out_aux->next = NULL;
-    request->out_chain->next = out_aux;
-    request->out_chain = out_aux;
-  }
-}
-
-static void setup_ubus_ctx_t(ubus_ctx_t *ctx, request_ctx_t *request,
-                             struct json_object *obj) {
-  ctx->ubus = ngx_pcalloc(request->r->pool, sizeof(struct dispatch_ubus));
-  ctx->buf = ngx_pcalloc(request->r->pool, sizeof(struct blob_buf));
+// Everything an element allocates comes from pool, the request's own one
+// on the event loop or a private one for each thread
+static void setup_ubus_ctx_t(ubus_ctx_t *ctx, ngx_pool_t *pool,
+                             request_ctx_t *request, struct blob_attr *obj) {
+  ctx->pool = pool;
+  ctx->ubus = ngx_pcalloc(pool, sizeof(struct dispatch_ubus));
+  ctx->buf = ngx_pcalloc(pool, sizeof(struct blob_buf));
   ctx->request = request;
   ctx->obj = obj;
-  ctx->ubus->jsobj = NULL;
-  ctx->ubus->jstok = json_tokener_new();
 }
 
-static void free_ubus_ctx_t(ubus_ctx_t *ctx, ngx_http_request_t *r) {
-  if (ctx->ubus->jsobj)
-    json_object_put(ctx->ubus->jsobj);
-  if (ctx->ubus->jstok)
-    json_tokener_free(ctx->ubus->jstok);
-  if (ctx->buf->buf)
-    blob_buf_free(ctx->buf);
-  ngx_pfree(r->pool, ctx->ubus);
-  ngx_pfree(r->pool, ctx->buf);
-  ngx_pfree(r->pool, ctx);
+static ubus_conn_t *ubus_ctx_conn(ubus_ctx_t *ctx) {
+  return ctx->shard ? ctx->shard->conn : ctx->request->conn;
 }
 
-static void free_output_chain(ngx_http_request_t *r, ngx_chain_t *chain) {
-  ngx_chain_t *chain_tmp;
-
-  while (chain) {
-    ngx_pfree(r->pool, chain->buf->pos);
-    ngx_pfree(r->pool, chain->buf);
-    chain_tmp = chain;
-    chain = chain->next;
-    ngx_pfree(r->pool, chain_tmp);
-  }
+static void ubus_ctx_start(ubus_ctx_t *ctx) {
+  ctx->start = ubus_stats_now();
+  ctx->mark = ctx->start;
 }
 
-static ngx_int_t ngx_http_ubus_send_body(request_ctx_t *request) {
-  ngx_int_t rc;
-
-  request->out_chain->buf->last_buf = 1;
+// Time since the previous phase of the call ended goes to phase
+static void ubus_ctx_phase(ubus_ctx_t *ctx, int phase) {
+  uint64_t now;
 
-  rc = ngx_http_output_filter(request->r, request->out_chain_start);
-  free_output_chain(request->r, request->out_chain_start);
+  if (!ctx->request->timed)
+    return;
 
-  return rc;
+  now = ubus_stats_now();
+  ctx->timing[phase] += now - ctx->mark;
+  ctx->mark = now;
 }
 
-static bool ubus_allowed(ubus_ctx_t *ctx, ngx_int_t script_timeout,
-                         const char *sid, const char *obj, const char *fun) {
-  uint32_t id;
-  bool allow = false;
-  struct blob_buf *req =
-      ngx_pcalloc(ctx->request->r->pool, sizeof(struct blob_buf));
-
-  if (ubus_lookup_id(ctx->request->ubus_ctx, "session", &id))
-    return false;
+static void ubus_ctx_mark(ubus_ctx_t *ctx) {
+  if (ctx->request->timed)
+    ctx->mark = ubus_stats_now();
+}
 
-  blob_buf_init(req, 0);
-  blobmsg_add_string(req, "ubus_rpc_session", sid);
-  blobmsg_add_string(req, "object", obj);
-  blobmsg_add_string(req, "function", fun);
+static void ubus_ctx_finish(ubus_ctx_t *ctx, enum rpc_status rc) {
+  bool call;
+  uint64_t usec;
+  ubus_call_log_t *log;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  struct rpc_data *data = &ctx->data;
+  request_ctx_t *request = ctx->request;
 
-  ubus_invoke(ctx->request->ubus_ctx, id, "access", req->head, ubus_allowed_cb,
-              &allow, script_timeout * 500);
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
 
-  free(req->buf);
-  ngx_pfree(ctx->request->r->pool, req);
+  usec = ubus_stats_now() - ctx->start;
+  call = data->method && !strcmp(data->method, "call");
+
+  // Every element owns its slot, threads don't need a lock here
+  if (request->calls) {
+    log = &request->calls[ctx->index];
+    log->method = data->method;
+    log->object = data->object;
+    log->function = data->function;
+    log->status = rc;
+    log->usec = usec;
+    ngx_memcpy(log->timing, ctx->timing, sizeof(log->timing));
+    log->done = true;
+  }
 
-  return allow;
+  if (cglcf->stats_zone)
+    ubus_stats_call(cglcf->stats_zone, call ? data->object : NULL,
+                    data->function, rc, ctx->ret, usec);
 }
 
-static enum rpc_status ubus_send_request(request_ctx_t *request,
-                                         ubus_ctx_t *ctx, const char *sid,
-                                         struct blob_attr *args) {
-  void *r;
-  char *str;
-  int ret, rem;
-  struct blob_attr *cur;
-  enum rpc_status rc = REQUEST_OK;
+// Timeout of a session check or of the call itself, from ubus_timeout
+// or ubus_script_timeout, cut to what is left of the ubus_deadline of the
+// request. 0 once the deadline is over.
+static ngx_msec_t ubus_ctx_timeout(ubus_ctx_t *ctx, bool acl) {
+  uint64_t now;
+  ubus_rule_t *rule;
+  ngx_msec_t timeout;
   ngx_http_ubus_loc_conf_t *cglcf;
-  struct dispatch_ubus *du = ctx->ubus;
-  struct blob_buf *req = ngx_pcalloc(request->r->pool, sizeof(struct blob_buf));
+  struct rpc_data *data = &ctx->data;
+  request_ctx_t *request = ctx->request;
 
   cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
-  du->buf = ngx_pcalloc(request->r->pool, sizeof(struct blob_buf));
 
-  blob_buf_init(req, 0);
+  if (acl) {
+    timeout = cglcf->script_timeout * 500;
+  } else {
+    rule = data->object && data->function
+               ? ubus_rule_match(cglcf->timeout_rules, data->object,
+                                 data->function)
+               : NULL;
+    timeout = rule ? rule->value : cglcf->script_timeout * 1000;
+  }
 
-  ubus_init_response(ctx->buf, du);
+  if (!request->deadline)
+    return timeout;
 
-  blobmsg_for_each_attr(cur, args, rem) {
-    if (!strcmp(blobmsg_name(cur), "ubus_rpc_session")) {
-      rc = ERROR_PARAMS;
-      goto out;
-    }
-    blobmsg_add_blob(req, cur);
-  }
+  now = ubus_stats_now();
+  if (now >= request->deadline)
+    return 0;
 
-  blobmsg_add_string(req, "ubus_rpc_session", sid);
+  return ngx_min(timeout, (request->deadline - now + 999) / 1000);
+}
 
-  blob_buf_init(du->buf, 0);
+static bool ubus_ctx_expired(ubus_ctx_t *ctx) {
+  return ctx->request->deadline && ubus_stats_now() >= ctx->request->deadline;
+}
 
-  if (ctx->array)
-    sem_wait(request->sem);
+static void free_ubus_ctx_t(ubus_ctx_t *ctx) {
+  ngx_pool_t *pool = ctx->pool;
+
+  if (ctx->buf->buf)
+    blob_buf_free(ctx->buf);
+  ngx_pfree(pool, ctx->ubus);
+  ngx_pfree(pool, ctx->buf);
+  ngx_pfree(pool, ctx);
+}
+
+static ngx_int_t ngx_http_ubus_send_body(request_ctx_t *request) {
+  if (request->out.error || !request->out.buf)
+    return NGX_ERROR;
+
+  request->out.buf->last_buf = 1;
 
-  ret = ubus_invoke(request->ubus_ctx, du->obj, du->func, req->head,
-                    ubus_request_cb, ctx, cglcf->script_timeout * 1000);
+  return ngx_http_output_filter(request->r, request->out.first);
+}
 
+static ubus_writer_t *ubus_ctx_output(ubus_ctx_t *ctx) {
   if (ctx->array)
-    sem_post(request->sem);
+    return &ctx->request->array_res[ctx->index];
+
+  return &ctx->request->out;
+}
 
-  r = blobmsg_open_array(ctx->buf, "result");
-  blobmsg_add_u32(ctx->buf, "", ret);
+static void ubus_array_init(request_ctx_t *request, struct blob_attr *array) {
+  int i, len = 0, rem;
+  struct blob_attr *cur;
+  ngx_http_ubus_loc_conf_t *cglcf;
 
-  if (ret == 0)
-    blob_for_each_attr(cur, du->buf->head, rem) blobmsg_add_blob(ctx->buf, cur);
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
 
-  blobmsg_close_array(ctx->buf, r);
+  blobmsg_for_each_attr(cur, array, rem) len++;
 
-  str = blobmsg_format_json(ctx->buf->head, true);
+  if (cglcf->stats_zone)
+    ubus_stats_batch(cglcf->stats_zone, len);
 
-  if (ctx->array) {
-    ctx->request->array_res[ctx->index] = str;
-  } else {
-    append_to_output_chain(request, str);
-    free(str);
+  request->array = true;
+  request->array_len = len;
+  request->array_cur = blobmsg_data(array);
+  request->array_rem = blobmsg_data_len(array);
+  request->array_res =
+      ngx_pcalloc(request->r->pool, len * sizeof(ubus_writer_t));
+  request->calls =
+      ngx_pcalloc(request->r->pool, len * sizeof(ubus_call_log_t));
+
+  for (i = 0; i < len; i++) {
+    ubus_writer_init(&request->array_res[i], request->r->pool);
+    request->array_res[i].format = request->format;
   }
+}
 
-out:
-  free(req->buf);
-  ngx_pfree(request->r->pool, req);
+static ngx_int_t ngx_http_ubus_stream_start(request_ctx_t *request,
+                                            bool recycle) {
+  int i;
+  ngx_int_t rc;
+  ngx_http_ubus_loc_conf_t *cglcf;
 
-  free(du->buf->buf);
-  ngx_pfree(request->r->pool, du->buf);
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
 
-  return rc;
+  // blobmsg arrays carry their length in the header, the whole response
+  // has to be written first
+  if (cglcf->stream == UBUS_STREAM_OFF || !request->array ||
+      request->format == UBUS_FORMAT_BLOBMSG)
+    return NGX_OK;
+
+  request->streaming = 1;
+
+  // Without a length the response goes out chunked
+  ngx_http_ubus_server_timing(request);
+  rc = ngx_http_ubus_send_header(request->r, cglcf, request->format,
+                                 NGX_HTTP_OK, -1);
+  if (rc == NGX_ERROR || rc > NGX_OK) {
+    request->stream_rc = rc;
+    return rc;
+  }
+
+  // Blocks already sent are reused for the next elements, only when the
+  // element writers are not filled from other threads
+  request->out.free = &request->free;
+  if (recycle)
+    for (i = 0; i < request->array_len; i++)
+      request->array_res[i].free = &request->free;
+
+  ubus_writer_array(&request->out, NULL, request->array_len);
+
+  return NGX_OK;
 }
 
-static enum rpc_status ubus_send_list(request_ctx_t *request, ubus_ctx_t *ctx,
-                                      struct blob_attr *params) {
+static ngx_int_t ngx_http_ubus_stream_flush(request_ctx_t *request,
+                                            bool last) {
+  ngx_http_request_t *r = request->r;
+  ubus_writer_t *out = &request->out;
 
-  void *r;
-  int rem;
-  char *str;
-  struct list_data data = {0};
-  struct blob_attr *cur, *dup;
-  struct dispatch_ubus *du = ctx->ubus;
+  if (request->stream_rc == NGX_ERROR || request->stream_rc > NGX_OK)
+    return request->stream_rc;
 
-  du->buf = ngx_pcalloc(request->r->pool, sizeof(struct blob_buf));
-  data.buf = du->buf;
+  if (out->error) {
+    request->stream_rc = NGX_ERROR;
+    return NGX_ERROR;
+  }
 
-  blob_buf_init(data.buf, 0);
+  if (!out->buf)
+    return NGX_OK;
 
-  ubus_init_response(ctx->buf, du);
+  if (last)
+    out->buf->last_buf = 1;
+  else
+    out->buf->flush = 1;
 
-  if (ctx->array)
-    sem_wait(request->sem);
+  request->stream_rc = ngx_http_output_filter(r, out->first);
 
-  if (!params || blob_id(params) != BLOBMSG_TYPE_ARRAY) {
-    r = blobmsg_open_array(data.buf, "result");
-    ubus_lookup(request->ubus_ctx, NULL, ubus_list_cb, &data);
-    blobmsg_close_array(data.buf, r);
-  } else {
-    r = blobmsg_open_table(data.buf, "result");
-    dup = blob_memdup(params);
-    if (dup) {
-      rem = blobmsg_data_len(dup);
-      data.verbose = true;
+  ngx_chain_update_chains(r->pool, &request->free, &request->busy, &out->first,
+                          (ngx_buf_tag_t)&ngx_http_ubus_module);
 
-      __blob_for_each_attr(cur, blobmsg_data(dup), rem) ubus_lookup(
-          request->ubus_ctx, blobmsg_data(cur), ubus_list_cb, &data);
+  ubus_writer_reset(out);
 
-      free(dup);
-    }
-    blobmsg_close_table(data.buf, r);
-  }
+  return request->stream_rc;
+}
 
-  if (ctx->array)
-    sem_post(request->sem);
+static void ngx_http_ubus_stream_element(request_ctx_t *request, int index) {
+  ubus_writer_t *w = &request->array_res[index];
 
-  blobmsg_add_blob(ctx->buf, blob_data(data.buf->head));
+  if (!w->first)
+    ubus_gen_error(request, w, ERROR_INTERNAL);
 
-  str = blobmsg_format_json(ctx->buf->head, true);
+  request->array_flushed++;
 
-  free(du->buf->buf);
-  ngx_pfree(request->r->pool, du->buf);
+  ubus_writer_append(&request->out, w);
+}
 
-  if (ctx->array) {
-    ctx->request->array_res[ctx->index] = str;
+static void ngx_http_ubus_stream(request_ctx_t *request, int index) {
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  if (cglcf->stream == UBUS_STREAM_UNORDERED) {
+    ngx_http_ubus_stream_element(request, index);
   } else {
-    append_to_output_chain(request, str);
-    free(str);
+    // Completed elements are held back until the ones before them are out
+    while (request->array_flushed < request->array_len &&
+           request->array_res[request->array_flushed].first)
+      ngx_http_ubus_stream_element(request, request->array_flushed);
   }
 
-  return REQUEST_OK;
+  ngx_http_ubus_stream_flush(request, false);
 }
 
-static enum rpc_status ubus_post_object(ubus_ctx_t *ctx) {
-  bool array = ctx->array;
-  struct rpc_data data = {};
+// Batch elements are spread over extra pooled connections so calls to
+// different objects overlap, each one carrying up to ubus_max_inflight
+// calls. The request's own connection is always the first shard.
+static ngx_int_t ubus_shards_init(request_ctx_t *request,
+                                  ngx_uint_t workers) {
+  ngx_uint_t i, n = 1;
   ngx_http_ubus_loc_conf_t *cglcf;
-  enum rpc_status rc = REQUEST_OK;
-  enum rpc_status err = ERROR_PARSE;
-  struct dispatch_ubus *du = ctx->ubus;
-  request_ctx_t *request = ctx->request;
-
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                 "Start processing json object");
 
   cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
 
-  if (json_object_get_type(ctx->obj) != json_type_object)
-    goto error;
+  if (cglcf->max_inflight)
+    n = ngx_max(1, (workers + cglcf->max_inflight - 1) / cglcf->max_inflight);
 
-  du->jsobj_cur = ctx->obj;
-  blob_buf_init(ctx->buf, 0);
-  if (!blobmsg_add_object(ctx->buf, ctx->obj))
-    goto error;
+  request->shards = ngx_pcalloc(request->r->pool, n * sizeof(ubus_shard_t));
+  if (request->shards == NULL)
+    return NGX_ERROR;
 
-  if (!parse_json_rpc(&data, ctx->buf->head))
-    goto error;
+  request->shards[0].conn = request->conn;
 
-  if (!strcmp(data.method, "call")) {
-    if (!data.sid || !data.object || !data.function || !data.data)
-      goto error;
+  // Only idle pooled connections are taken, never private ones
+  for (i = 1; i < n; i++) {
+    request->shards[i].conn = ubus_pool_get(cglcf->pool, false);
+    if (!request->shards[i].conn)
+      break;
+  }
 
-    du->func = data.function;
+  request->nshards = i;
 
-    if (ctx->array)
-      sem_wait(ctx->request->sem);
+  for (i = 0; i < request->nshards; i++)
+    sem_init(&request->shards[i].sem, 0, 1);
 
-    if (ubus_lookup_id(ctx->request->ubus_ctx, data.object, &du->obj)) {
-      err = ERROR_OBJECT;
-      goto error;
+  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Batch spread over %ui of %ui connections", request->nshards,
+                 n);
+
+  return NGX_OK;
+}
+
+static void ubus_shards_free(request_ctx_t *request) {
+  ngx_uint_t i;
+
+  for (i = 0; i < request->nshards; i++) {
+    sem_destroy(&request->shards[i].sem);
+    if (i > 0)
+      ubus_pool_release(request->shards[i].conn);
+  }
+
+  request->shards = NULL;
+  request->nshards = 0;
+}
+
+// Stop the event loop from dispatching the connections while threads run
+// blocking calls on them
+static void ubus_shards_suspend(request_ctx_t *request) {
+  ngx_uint_t i;
+
+  ubus_pool_suspend(request->conn);
+
+  for (i = 1; i < request->nshards; i++)
+    ubus_pool_suspend(request->shards[i].conn);
+}
+
+static void ubus_shards_resume(request_ctx_t *request) {
+  ngx_uint_t i;
+
+  ubus_pool_resume(request->conn);
+
+  for (i = 1; i < request->nshards; i++)
+    ubus_pool_resume(request->shards[i].conn);
+}
+
+static void ubus_private_pool_cleanup(void *data) { ngx_destroy_pool(data); }
+
+// Pools aren't thread safe, every thread allocates from one of its own.
+// It is created on the event loop and lives as long as the request.
+static ngx_pool_t *ubus_private_pool(request_ctx_t *request) {
+  ngx_pool_t *pool;
+  ngx_pool_cleanup_t *cln;
+  ngx_http_request_t *r = request->r;
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+  if (pool == NULL)
+    return NULL;
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (cln == NULL) {
+    ngx_destroy_pool(pool);
+    return NULL;
+  }
+
+  cln->handler = ubus_private_pool_cleanup;
+  cln->data = pool;
+
+  return pool;
+}
+
+static ubus_shard_t *ubus_shard_get(request_ctx_t *request) {
+  ngx_uint_t i;
+  ubus_shard_t *shard = NULL;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  if (!request->nshards)
+    return NULL;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  // Least loaded connection with room for another call
+  for (i = 0; i < request->nshards; i++) {
+    if (cglcf->max_inflight &&
+        request->shards[i].inflight >= cglcf->max_inflight)
+      continue;
+
+    if (!shard || request->shards[i].inflight < shard->inflight)
+      shard = &request->shards[i];
+  }
+
+  return shard;
+}
+
+static struct blob_attr *ubus_array_next(request_ctx_t *request) {
+  struct blob_attr *cur = request->array_cur;
+
+  request->array_rem -= blob_pad_len(cur);
+  request->array_cur = blob_next(cur);
+
+  return cur;
+}
+
+static void ubus_acl_list_cb(struct ubus_request *req, int type,
+                             struct blob_attr *msg) {
+  ubus_ctx_t *ctx = req->priv;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  if (msg)
+    ubus_pool_acl_set(ubus_ctx_conn(ctx)->pool, ctx->data.sid, msg,
+                      cglcf->acl_cache_ttl);
+}
+
+static bool ubus_allowed(ubus_ctx_t *ctx, const char *sid, const char *obj,
+                         const char *fun) {
+  int ret;
+  uint32_t id;
+  bool allow = false;
+  ngx_int_t rc = NGX_ERROR;
+  ngx_msec_t timeout;
+  struct blob_buf *req;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  ubus_conn_t *conn = ubus_ctx_conn(ctx);
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  if (cglcf->acl_cache)
+    rc = ubus_pool_acl_check(conn->pool, sid, obj, fun);
+
+  if (rc == NGX_OK || rc == NGX_DECLINED)
+    return rc == NGX_OK;
+
+  timeout = ubus_ctx_timeout(ctx, true);
+  if (!timeout)
+    return false;
+
+  if (ubus_pool_lookup_id(conn->pool, &conn->ctx, "session", &id,
+                          cglcf->object_cache))
+    return false;
+
+  req = ngx_pcalloc(ctx->pool, sizeof(struct blob_buf));
+
+  blob_buf_init(req, 0);
+  blobmsg_add_string(req, "ubus_rpc_session", sid);
+
+  // Every grant of the session is fetched at once, further calls with the
+  // same sid are checked locally
+  if (rc == NGX_AGAIN) {
+    ret = ubus_invoke(&conn->ctx, id, "list", req->head, ubus_acl_list_cb, ctx,
+                      timeout);
+    if (ret == UBUS_STATUS_NOT_FOUND)
+      ubus_pool_acl_set(conn->pool, sid, NULL, cglcf->acl_cache_ttl);
+
+    rc = ubus_pool_acl_check(conn->pool, sid, obj, fun);
+    if (rc == NGX_OK || rc == NGX_DECLINED) {
+      allow = rc == NGX_OK;
+      goto out;
     }
+  }
 
-    if (ctx->array)
-      sem_post(ctx->request->sem);
+  blobmsg_add_string(req, "object", obj);
+  blobmsg_add_string(req, "function", fun);
 
-    if (ctx->array)
-      sem_wait(ctx->request->sem);
+  ubus_invoke(&conn->ctx, id, "access", req->head, ubus_allowed_cb, &allow,
+              timeout);
 
-    if (!cglcf->noauth && !ubus_allowed(ctx, cglcf->script_timeout, data.sid,
-                                        data.object, data.function)) {
-      err = ERROR_ACCESS;
-      goto error;
+out:
+  free(req->buf);
+  ngx_pfree(ctx->pool, req);
+
+  return allow;
+}
+
+static void ubus_lock(ubus_ctx_t *ctx) {
+  if (ctx->shard)
+    sem_wait(&ctx->shard->sem);
+}
+
+static void ubus_unlock(ubus_ctx_t *ctx) {
+  if (ctx->shard)
+    sem_post(&ctx->shard->sem);
+}
+
+static enum rpc_status ubus_request_init(request_ctx_t *request,
+                                         ubus_ctx_t *ctx, const char *sid,
+                                         struct blob_attr *args) {
+  int rem;
+  struct blob_attr *cur;
+  struct dispatch_ubus *du = ctx->ubus;
+
+  du->req_buf = ngx_pcalloc(ctx->pool, sizeof(struct blob_buf));
+  du->buf = ngx_pcalloc(ctx->pool, sizeof(struct blob_buf));
+
+  blob_buf_init(du->req_buf, 0);
+  blob_buf_init(du->buf, 0);
+
+  ubus_init_response(ctx->buf, ctx->data.id);
+
+  blobmsg_for_each_attr(cur, args, rem) {
+    if (!strcmp(blobmsg_name(cur), "ubus_rpc_session"))
+      return ERROR_PARAMS;
+    blobmsg_add_blob(du->req_buf, cur);
+  }
+
+  blobmsg_add_string(du->req_buf, "ubus_rpc_session", sid);
+
+  return REQUEST_OK;
+}
+
+static void ubus_request_done(request_ctx_t *request, ubus_ctx_t *ctx,
+                              int ret) {
+  int rem;
+  struct blob_attr *cur;
+  struct dispatch_ubus *du = ctx->ubus;
+  ubus_writer_t *w = ubus_ctx_output(ctx);
+
+  ctx->ret = ret;
+
+  ubus_writer_open(w, ctx->buf->head);
+  ubus_writer_array(w, "result", -1);
+  ubus_writer_int(w, NULL, ret);
+
+  if (ret == 0)
+    blob_for_each_attr(cur, du->buf->head, rem)
+        ubus_writer_value(w, NULL, cur);
+
+  ubus_writer_close(w);
+  ubus_writer_close(w);
+}
+
+static bool ubus_cache_fetch(request_ctx_t *request, ubus_ctx_t *ctx,
+                             struct rpc_data *data) {
+  ubus_rule_t *rule;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  rule = ubus_rule_match(cglcf->cache_rules, data->object, data->function);
+  if (!rule)
+    return false;
+
+  // Entries are kept per session unless the rule shares them with every
+  // session passing the ACL check
+  if (ubus_cache_key(ctx->pool, &ctx->cache_key, data->object,
+                     data->function,
+                     rule->flags & UBUS_RULE_SHARED ? "" : data->sid,
+                     data->data) != NGX_OK) {
+    ngx_str_null(&ctx->cache_key);
+    return false;
+  }
+
+  ctx->cache_ttl = rule->value;
+
+  return ubus_cache_get(cglcf->cache_zone, &ctx->cache_key, ctx->ubus->buf) ==
+         NGX_OK;
+}
+
+static void ubus_cache_store(request_ctx_t *request, ubus_ctx_t *ctx,
+                             int ret) {
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  if (ret != 0 || !ctx->cache_key.len)
+    return;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  ubus_cache_put(cglcf->cache_zone, &ctx->cache_key, ctx->ubus->buf->head,
+                 ctx->cache_ttl);
+}
+
+static void ubus_request_free(request_ctx_t *request, ubus_ctx_t *ctx) {
+  struct dispatch_ubus *du = ctx->ubus;
+
+  free(du->req_buf->buf);
+  ngx_pfree(ctx->pool, du->req_buf);
+  du->req_buf = NULL;
+
+  free(du->buf->buf);
+  ngx_pfree(ctx->pool, du->buf);
+  du->buf = NULL;
+}
+
+// How long a call may wait in the ubus_limit_queue, cut to what is left
+// of the ubus_deadline of the request
+static ngx_msec_t ubus_limit_timeout(ubus_ctx_t *ctx) {
+  uint64_t now;
+  request_ctx_t *request = ctx->request;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  if (!request->deadline)
+    return cglcf->limit_queue_timeout;
+
+  now = ubus_stats_now();
+  if (now >= request->deadline)
+    return 0;
+
+  return ngx_min(cglcf->limit_queue_timeout, (request->deadline - now) / 1000);
+}
+
+// Wait for a place within the ubus_limit limits. Only threads of the
+// thread pool can sleep for it, ubus_limit_queue is refused in sync mode.
+static enum rpc_status ubus_limit_wait(request_ctx_t *request,
+                                       ubus_ctx_t *ctx) {
+  bool wait = false;
+  ngx_uint_t tries = 0;
+  ngx_msec_t timeout = 0;
+  enum rpc_status rc = ERROR_BUSY;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  struct rpc_data *data = &ctx->data;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  if (!cglcf->limit_zone)
+    return REQUEST_OK;
+
+#if (NGX_THREADS)
+  wait = cglcf->thread_pool != NULL;
+#endif
+
+  if (wait)
+    timeout = ubus_limit_timeout(ctx);
+
+  for (;;) {
+    if (ubus_limit_acquire(cglcf->limit_zone, &cglcf->limits, data->sid,
+                           data->object, &ctx->limit_held) == NGX_OK) {
+      rc = REQUEST_OK;
+      break;
     }
 
-    if (ctx->array)
-      sem_post(ctx->request->sem);
+    if (!wait)
+      break;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                   "Start processing call request");
+    if (!ctx->limit_queued) {
+      if (ubus_limit_enqueue(cglcf->limit_zone, cglcf->limit_queue) !=
+          NGX_OK)
+        break;
+      ctx->limit_queued = true;
+    }
+
+    if (tries++ * UBUS_LIMIT_POLL >= timeout) {
+      if (ubus_ctx_expired(ctx))
+        rc = ERROR_TIMEOUT;
+      break;
+    }
 
-    rc = ubus_send_request(request, ctx, data.sid, data.data);
+    ngx_msleep(UBUS_LIMIT_POLL);
+  }
+
+  if (ctx->limit_queued) {
+    ubus_limit_dequeue(cglcf->limit_zone);
+    ctx->limit_queued = false;
+  }
+
+  return rc;
+}
+
+static void ubus_limit_leave(ubus_ctx_t *ctx) {
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  if (!ctx->limit_held)
+    return;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  ubus_limit_release(cglcf->limit_zone, ctx->data.sid, ctx->data.object,
+                     ctx->limit_held);
+  ctx->limit_held = 0;
+}
+
+static enum rpc_status ubus_send_request(request_ctx_t *request,
+                                         ubus_ctx_t *ctx,
+                                         struct rpc_data *data) {
+  int ret;
+  enum rpc_status rc;
+  ngx_msec_t timeout;
+  struct dispatch_ubus *du = ctx->ubus;
+
+  rc = ubus_request_init(request, ctx, data->sid, data->data);
+  if (rc != REQUEST_OK)
     goto out;
-  } else if (!strcmp(data.method, "list")) {
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                   "Start processing list request");
 
-    rc = ubus_send_list(request, ctx, data.params);
+  if (ubus_cache_fetch(request, ctx, data)) {
+    ubus_ctx_phase(ctx, UBUS_TIMING_INVOKE);
+    ubus_request_done(request, ctx, 0);
+    ubus_ctx_phase(ctx, UBUS_TIMING_SERIALIZE);
     goto out;
-  } else {
-    err = ERROR_METHOD;
-    goto error;
   }
 
-error:
-  if (ctx->array)
-    sem_post(ctx->request->sem);
-  rc = err;
+  rc = ubus_limit_wait(request, ctx);
+  if (rc != REQUEST_OK)
+    goto out;
+
+  timeout = ubus_ctx_timeout(ctx, false);
+  if (!timeout) {
+    ubus_limit_leave(ctx);
+    rc = ERROR_TIMEOUT;
+    goto out;
+  }
+
+  ubus_lock(ctx);
+
+  ret = ubus_invoke(&ubus_ctx_conn(ctx)->ctx, du->obj, du->func,
+                    du->req_buf->head, ubus_request_cb, ctx, timeout);
+
+  ubus_unlock(ctx);
+
+  ubus_limit_leave(ctx);
+
+  ubus_ctx_phase(ctx, UBUS_TIMING_INVOKE);
+
+  ubus_cache_store(request, ctx, ret);
+  ubus_request_done(request, ctx, ret);
+
+  ubus_ctx_phase(ctx, UBUS_TIMING_SERIALIZE);
+
 out:
-  if (data.params)
-    free(data.params);
+  ubus_request_free(request, ctx);
 
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                 "Json object processed correctly");
+  return rc;
+}
+
+static char *ubus_list_key(ngx_pool_t *pool, struct blob_attr *params) {
+  int rem;
+  size_t len = 1;
+  char *path;
+  u_char *key, *p;
+  struct blob_attr *cur;
 
-  free_ubus_ctx_t(ctx, request->r);
+  // The plain list is stored with an empty key, verbose lists with "v:"
+  // and their patterns separated by newlines, an empty pattern array
+  // included
+  if (!params || blob_id(params) != BLOBMSG_TYPE_ARRAY)
+    return "";
 
-  if (array) {
-    if (rc != REQUEST_OK) {
-      ctx->request->array_res[ctx->index] = ubus_gen_error(ctx->request, rc);
-    }
+  len += sizeof("v:") - 1;
 
-    pthread_exit(NULL);
+  blobmsg_for_each_attr(cur, params, rem) {
+    if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+      return NULL;
+
+    len += blobmsg_data_len(cur);
   }
 
-  return rc;
+  key = ngx_pnalloc(pool, len);
+  if (!key)
+    return NULL;
+
+  p = ngx_cpymem(key, "v:", sizeof("v:") - 1);
+  blobmsg_for_each_attr(cur, params, rem) {
+    if (p != key + sizeof("v:") - 1)
+      *p++ = '\n';
+    path = blobmsg_get_string(cur);
+    p = ngx_cpymem(p, path, strlen(path));
+  }
+  *p = '\0';
+
+  return (char *)key;
 }
 
-static ngx_int_t ubus_process_array(request_ctx_t *request,
-                                    struct json_object *obj) {
-  ubus_ctx_t *ctx;
-  pthread_t *threads;
-  ngx_int_t rc = NGX_OK;
+static enum rpc_status ubus_send_list(request_ctx_t *request, ubus_ctx_t *ctx,
+                                      struct blob_attr *params) {
+
+  void *r;
+  int rem;
+  ubus_conn_t *conn;
+  char *json, *key = NULL;
+  struct list_data data = {0};
+  struct blob_attr *cur;
+  struct dispatch_ubus *du = ctx->ubus;
+  ubus_writer_t *w = ubus_ctx_output(ctx);
   ngx_http_ubus_loc_conf_t *cglcf;
-  int len = json_object_array_length(obj);
-  sem_t *sem = ngx_pcalloc(request->r->pool, sizeof(sem_t));
-  int obj_done = 0, concurrent, concurrent_thread, threads_spawned;
 
   cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                 "Start processing array json object");
 
-  concurrent_thread = cglcf->parallel_req;
+  ubus_init_response(ctx->buf, ctx->data.id);
+
+  // The cache holds JSON, other encodings are written from the lookup
+  if (cglcf->list_cache && w->format == UBUS_FORMAT_JSON) {
+    key = ubus_list_key(ctx->pool, params);
+    if (key && ubus_pool_list_get(cglcf->pool, key, ctx->buf->head, w))
+      return REQUEST_OK;
+  }
+
+  // Asynchronous calls of the request may be in flight on its connection
+  conn = cglcf->async ? ubus_pool_lookup_conn(cglcf->pool) : ubus_ctx_conn(ctx);
+  if (!conn)
+    return ERROR_INTERNAL;
+
+  du->buf = ngx_pcalloc(ctx->pool, sizeof(struct blob_buf));
+  data.buf = du->buf;
+
+  blob_buf_init(data.buf, 0);
+
+  ubus_lock(ctx);
+
+  if (!params || blob_id(params) != BLOBMSG_TYPE_ARRAY) {
+    r = blobmsg_open_array(data.buf, "result");
+    ubus_lookup(&conn->ctx, NULL, ubus_list_cb, &data);
+    blobmsg_close_array(data.buf, r);
+  } else {
+    r = blobmsg_open_table(data.buf, "result");
+    data.verbose = true;
+
+    blobmsg_for_each_attr(cur, params, rem)
+        ubus_lookup(&conn->ctx, blobmsg_data(cur), ubus_list_cb, &data);
+
+    blobmsg_close_table(data.buf, r);
+  }
+
+  ubus_unlock(ctx);
+
+  if (key) {
+    json = blobmsg_format_json_value(blob_data(data.buf->head));
+    if (json) {
+      ubus_pool_list_set(cglcf->pool, key, json);
+      free(json);
+    }
+  }
+
+  ubus_writer_open(w, ctx->buf->head);
+  ubus_writer_value(w, "result", blob_data(data.buf->head));
+  ubus_writer_close(w);
+
+  free(du->buf->buf);
+  ngx_pfree(ctx->pool, du->buf);
+  du->buf = NULL;
+
+  return REQUEST_OK;
+}
+
+static enum rpc_status ubus_parse_object(ubus_ctx_t *ctx,
+                                         struct rpc_data *data) {
+  if (blobmsg_type(ctx->obj) != BLOBMSG_TYPE_TABLE)
+    return ERROR_PARSE;
+
+  if (!parse_json_rpc(data, ctx->obj))
+    return ERROR_PARSE;
+
+  return REQUEST_OK;
+}
+
+// ubus_allow/ubus_deny rules are checked in order. Calls matching none of
+// them are denied once there is an ubus_allow rule, and left to the
+// session check otherwise.
+static bool ubus_access_denied(ubus_rules_t *rules, const char *object,
+                               const char *method) {
+  ubus_rule_t *rule;
+
+  if (!rules)
+    return false;
+
+  rule = ubus_rule_match(rules, object, method);
+  if (!rule)
+    return rules->flags & UBUS_RULE_ALLOW;
+
+  return rule->flags & UBUS_RULE_DENY;
+}
+
+static enum rpc_status ubus_post_object(ubus_ctx_t *ctx) {
+  int ret;
+  bool array = ctx->array;
+  struct rpc_data *data = &ctx->data;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  enum rpc_status rc = REQUEST_OK;
+  enum rpc_status err = ERROR_PARSE;
+  struct dispatch_ubus *du = ctx->ubus;
+  request_ctx_t *request = ctx->request;
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Start processing json object");
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  ubus_ctx_start(ctx);
+
+  err = ubus_parse_object(ctx, data);
+  if (err != REQUEST_OK)
+    goto error;
+
+  if (!strcmp(data->method, "call")) {
+    if (!data->sid || !data->object || !data->function || !data->data) {
+      err = ERROR_PARSE;
+      goto error;
+    }
+
+    if (ubus_access_denied(cglcf->access_rules, data->object,
+                           data->function)) {
+      err = ERROR_ACCESS;
+      goto error;
+    }
+
+    du->func = data->function;
+
+    // Elements left when the deadline is over fail without a call
+    if (ubus_ctx_expired(ctx)) {
+      err = ERROR_TIMEOUT;
+      goto error;
+    }
+
+    ubus_ctx_mark(ctx);
+
+    ubus_lock(ctx);
+    ret = ubus_pool_lookup_id(request->conn->pool, &ubus_ctx_conn(ctx)->ctx,
+                              data->object, &du->obj, cglcf->object_cache);
+    ubus_unlock(ctx);
+
+    ubus_ctx_phase(ctx, UBUS_TIMING_LOOKUP);
+
+    if (ret) {
+      err = ERROR_OBJECT;
+      goto error;
+    }
+
+    ubus_lock(ctx);
+    ret = cglcf->noauth ||
+          ubus_allowed(ctx, data->sid, data->object, data->function);
+    ubus_unlock(ctx);
+
+    ubus_ctx_phase(ctx, UBUS_TIMING_ACL);
+
+    if (!ret) {
+      err = ubus_ctx_expired(ctx) ? ERROR_TIMEOUT : ERROR_ACCESS;
+      goto error;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                   "Start processing call request");
+
+    rc = ubus_send_request(request, ctx, data);
+    goto out;
+  } else if (!strcmp(data->method, "list")) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                   "Start processing list request");
+
+    ubus_ctx_mark(ctx);
+    rc = ubus_send_list(request, ctx, data->params);
+    ubus_ctx_phase(ctx, UBUS_TIMING_INVOKE);
+    goto out;
+  } else {
+    err = ERROR_METHOD;
+    goto error;
+  }
+
+error:
+  rc = err;
+out:
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Json object processed correctly");
+
+  if (array && rc != REQUEST_OK)
+    ubus_gen_error(request, &request->array_res[ctx->index], rc);
+
+  ubus_ctx_finish(ctx, rc);
+
+  free_ubus_ctx_t(ctx);
+
+  return rc;
+}
+
+static void *ubus_thread_post_object(void *data) {
+  ubus_post_object(data);
+  return NULL;
+}
+
+static void ubus_write_array(request_ctx_t *request) {
+  int i;
+  ubus_writer_t *out = &request->out;
+
+  ubus_writer_array(out, NULL, request->array_len);
+
+  for (i = 0; i < request->array_len; i++) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                   "Writing output of index %d to body", i);
+    if (!request->array_res[i].first)
+      ubus_gen_error(request, &request->array_res[i], ERROR_INTERNAL);
+    // Separators go into the free space of the previous element's blocks
+    ubus_writer_append(out, &request->array_res[i]);
+  }
+
+  ubus_writer_close(out);
+
+  ngx_pfree(request->r->pool, request->array_res);
+}
+
+static ngx_int_t ubus_process_array(request_ctx_t *request,
+                                    struct blob_attr *obj) {
+  int i, len;
+  ubus_ctx_t *ctx;
+  pthread_t *threads;
+  ngx_pool_t **pools;
+  ngx_int_t rc = NGX_OK;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  int obj_done = 0, concurrent, concurrent_thread, threads_spawned;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Start processing array json object");
+
+  concurrent_thread = cglcf->parallel_req;
+
+  threads =
+      ngx_pcalloc(request->r->pool, concurrent_thread * sizeof(pthread_t));
+  pools =
+      ngx_pcalloc(request->r->pool, concurrent_thread * sizeof(ngx_pool_t *));
+  if (threads == NULL || pools == NULL) {
+    ubus_single_error(request, ERROR_INTERNAL);
+    return NGX_ERROR;
+  }
+
+  for (i = 0; i < concurrent_thread; i++) {
+    pools[i] = ubus_private_pool(request);
+    if (pools[i] == NULL)
+      break;
+  }
+
+  if (i == 0) {
+    ubus_single_error(request, ERROR_INTERNAL);
+    return NGX_ERROR;
+  }
+
+  concurrent_thread = i;
+
+  ubus_array_init(request, obj);
+  len = request->array_len;
+
+  // Threads can't share a connection without its lock
+  if (ubus_shards_init(request,
+                       ngx_min((ngx_uint_t)len, cglcf->parallel_req)) != NGX_OK)
+    concurrent_thread = 1;
+
+  ngx_http_ubus_stream_start(request, false);
+
+  ubus_shards_suspend(request);
+
+  while (obj_done < len) {
+    threads_spawned = 0;
+
+    for (concurrent = 0; concurrent < concurrent_thread; concurrent++) {
+      struct blob_attr *obj_tmp;
+
+      if (obj_done >= len)
+        break;
+
+      obj_tmp = ubus_array_next(request);
+
+      ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                     "Spawning thread %d to process request %d", concurrent,
+                     obj_done);
+
+      ctx = ngx_pcalloc(pools[concurrent], sizeof(ubus_ctx_t));
+
+      setup_ubus_ctx_t(ctx, pools[concurrent], request, obj_tmp);
+      request->array_res[obj_done].pool = pools[concurrent];
+
+      ctx->array = true;
+      ctx->index = obj_done;
+      if (request->nshards)
+        ctx->shard = &request->shards[concurrent % request->nshards];
+
+      pthread_create(&threads[concurrent], NULL, ubus_thread_post_object, ctx);
+      threads_spawned++;
+      obj_done++;
+    }
+
+    for (concurrent = 0; concurrent < threads_spawned; concurrent++) {
+      ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                     "Waiting thread %d to finish", concurrent);
+
+      pthread_join(threads[concurrent], NULL);
+    }
+
+    // Threads may finish in any order, flush the whole wave in order
+    if (request->streaming)
+      for (i = obj_done - threads_spawned; i < obj_done; i++)
+        ngx_http_ubus_stream_element(request, i);
+
+    if (request->streaming)
+      ngx_http_ubus_stream_flush(request, false);
+  }
+
+  ubus_shards_resume(request);
+
+  ngx_pfree(request->r->pool, threads);
+
+  if (!request->streaming)
+    ubus_write_array(request);
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Request processed correctly");
+
+  return rc;
+}
+
+static ngx_int_t ubus_process_object(request_ctx_t *request,
+                                     struct blob_attr *obj) {
+  ubus_ctx_t *ctx;
+  enum rpc_status rc;
+
+  ctx = ngx_pcalloc(request->r->pool, sizeof(ubus_ctx_t));
+
+  setup_ubus_ctx_t(ctx, request->r->pool, request, obj);
+
+  rc = ubus_post_object(ctx);
+
+  if (rc != REQUEST_OK) {
+    ubus_single_error(request, rc);
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_http_ubus_elaborate_req(request_ctx_t *request,
+                                             struct blob_attr *obj) {
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Analyzing json object");
+
+  switch (obj ? blobmsg_type(obj) : BLOBMSG_TYPE_UNSPEC) {
+  case BLOBMSG_TYPE_TABLE:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                   "Json object detected");
+
+    return ubus_process_object(request, obj);
+  case BLOBMSG_TYPE_ARRAY:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                   "Json array detected");
+
+    return ubus_process_array(request, obj);
+  default:
+    ubus_single_error(request, ERROR_PARSE);
+    return NGX_ERROR;
+  }
+}
+
+// Strong ETag from the serialized response, GET responses can then be
+// revalidated by clients and caches
+static ngx_int_t ngx_http_ubus_etag(request_ctx_t *request) {
+  u_char *p;
+  ngx_md5_t md5;
+  ngx_chain_t *cl;
+  ngx_table_elt_t *h;
+  u_char hash[16];
+  ngx_http_request_t *r = request->r;
+
+  ngx_md5_init(&md5);
+  for (cl = request->out.first; cl; cl = cl->next)
+    ngx_md5_update(&md5, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  ngx_md5_final(hash, &md5);
+
+  p = ngx_pnalloc(r->pool, 2 * sizeof(hash) + 2);
+  if (!p)
+    return NGX_ERROR;
+
+  h = ngx_list_push(&r->headers_out.headers);
+  if (!h)
+    return NGX_ERROR;
+
+  h->hash = 1;
+  h->next = NULL;
+  ngx_str_set(&h->key, "ETag");
+  h->value.data = p;
+
+  *p++ = '"';
+  p = ngx_hex_dump(p, hash, sizeof(hash));
+  *p++ = '"';
+
+  h->value.len = p - h->value.data;
+  r->headers_out.etag = h;
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_http_ubus_send_response(request_ctx_t *request) {
+  ngx_int_t rc;
+  ngx_http_request_t *r = request->r;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  if (request->streaming) {
+    ubus_writer_close(&request->out);
+    return ngx_http_ubus_stream_flush(request, true);
+  }
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Sending header");
+
+  if (request->out.error)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  if (r->method == NGX_HTTP_GET && ngx_http_ubus_etag(request) != NGX_OK)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  // Responses have no Last-Modified, the not modified filter would take
+  // any If-Modified-Since as changed. If-None-Match wins anyway.
+  if (r->method == NGX_HTTP_GET && r->headers_in.if_none_match)
+    r->headers_in.if_modified_since = NULL;
+
+  // The encoding of the response depends on Accept
+  if (r->method == NGX_HTTP_GET && cglcf->binary)
+    set_custom_headers_out(r, "Vary", "Accept");
+
+  ngx_http_ubus_server_timing(request);
+  rc = ngx_http_ubus_send_header(r, cglcf, request->format, NGX_HTTP_OK,
+                                 request->out.len);
+
+  // A matching If-None-Match is answered by the not modified filter
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    return rc;
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Sending body");
+
+  rc = ngx_http_ubus_send_body(request);
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Request complete");
+
+  return rc;
+}
+
+static const char *ubus_log_name(ubus_call_log_t *call, size_t offset) {
+  return *(const char **)((u_char *)call + offset);
+}
+
+// Single requests give the value of their call, batches a comma separated
+// list with one value per element in request order
+static ngx_int_t ngx_http_ubus_log_names(request_ctx_t *request,
+                                         ngx_str_t *s, size_t offset) {
+  int i;
+  u_char *p;
+  size_t len = 0;
+  const char *name;
+
+  if (!request->array) {
+    name = ubus_log_name(request->calls, offset);
+    if (!name)
+      return NGX_OK;
+
+    s->len = ngx_strlen(name);
+    s->data = ngx_pnalloc(request->r->pool, s->len);
+    if (!s->data)
+      return NGX_ERROR;
+
+    ngx_memcpy(s->data, name, s->len);
+    return NGX_OK;
+  }
+
+  for (i = 0; i < request->array_len; i++) {
+    name = ubus_log_name(&request->calls[i], offset);
+    len += (name ? ngx_strlen(name) : 1) + 2;
+  }
+
+  if (!len)
+    return NGX_OK;
+
+  p = ngx_pnalloc(request->r->pool, len);
+  if (!p)
+    return NGX_ERROR;
+
+  s->data = p;
+
+  for (i = 0; i < request->array_len; i++) {
+    if (i)
+      p = ngx_cpymem(p, ", ", 2);
+
+    name = ubus_log_name(&request->calls[i], offset);
+    if (name)
+      p = ngx_cpymem(p, name, ngx_strlen(name));
+    else
+      *p++ = '-';
+  }
+
+  s->len = p - s->data;
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_http_ubus_log_calls(request_ctx_t *request,
+                                         ngx_http_ubus_log_ctx_t *lctx) {
+  int i, n;
+  u_char *status, *time;
+  ubus_call_log_t *call;
+  ngx_pool_t *pool = request->r->pool;
+
+  // Requests failing as a whole only have the status of the error
+  n = request->array && request->status == REQUEST_OK ? request->array_len : 1;
+
+  status = ngx_pnalloc(pool, n * (NGX_INT_T_LEN + 2));
+  time = ngx_pnalloc(pool, n * (NGX_TIME_T_LEN + 6));
+  if (!status || !time)
+    return NGX_ERROR;
+
+  lctx->status.data = status;
+  lctx->upstream_time.data = time;
+
+  for (i = 0; i < n; i++) {
+    call = &request->calls[i];
+
+    if (i) {
+      status = ngx_cpymem(status, ", ", 2);
+      time = ngx_cpymem(time, ", ", 2);
+    }
+
+    if (!request->array || request->status != REQUEST_OK)
+      status = ngx_sprintf(status, "%d", json_errors[request->status].code);
+    else
+      status = ngx_sprintf(status, "%d", json_errors[call->status].code);
+
+    if (call->done)
+      time = ngx_sprintf(time, "%uL.%03uL", call->usec / 1000000,
+                         call->usec / 1000 % 1000);
+    else
+      *time++ = '-';
+  }
+
+  lctx->status.len = status - lctx->status.data;
+  lctx->upstream_time.len = time - lctx->upstream_time.data;
+
+  return NGX_OK;
+}
+
+// Everything is copied out before the parser owning the strings is freed
+static void ngx_http_ubus_log(request_ctx_t *request) {
+  ngx_http_ubus_log_ctx_t *lctx;
+  ngx_http_request_t *r = request->r;
+
+  if (!request->calls)
+    return;
+
+  lctx = ngx_pcalloc(r->pool, sizeof(ngx_http_ubus_log_ctx_t));
+  if (!lctx)
+    return;
+
+  if (ngx_http_ubus_log_names(request, &lctx->method,
+                              offsetof(ubus_call_log_t, method)) != NGX_OK ||
+      ngx_http_ubus_log_names(request, &lctx->object,
+                              offsetof(ubus_call_log_t, object)) != NGX_OK ||
+      ngx_http_ubus_log_names(request, &lctx->function,
+                              offsetof(ubus_call_log_t, function)) != NGX_OK ||
+      ngx_http_ubus_log_calls(request, lctx) != NGX_OK)
+    return;
+
+  if (request->array) {
+    lctx->batch_size.data = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (!lctx->batch_size.data)
+      return;
+
+    lctx->batch_size.len =
+        ngx_sprintf(lctx->batch_size.data, "%d", request->array_len) -
+        lctx->batch_size.data;
+  }
+
+  ngx_http_set_ctx(r, lctx, ngx_http_ubus_module);
+}
+
+static void ngx_http_ubus_timing_log(request_ctx_t *request) {
+#if (NGX_DEBUG)
+  uint64_t t[__UBUS_TIMING_MAX];
+
+  if (!request->timed)
+    return;
+
+  ubus_timing_total(request, t);
+
+  ngx_log_debug8(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "ubus timing us: read %uL parse %uL connect %uL lookup %uL "
+                 "acl %uL invoke %uL serialize %uL output %uL",
+                 t[UBUS_TIMING_READ], t[UBUS_TIMING_PARSE],
+                 t[UBUS_TIMING_CONNECT], t[UBUS_TIMING_LOOKUP],
+                 t[UBUS_TIMING_ACL], t[UBUS_TIMING_INVOKE],
+                 t[UBUS_TIMING_SERIALIZE], t[UBUS_TIMING_OUTPUT]);
+#endif
+}
+
+static void ngx_http_ubus_request_free(request_ctx_t *request) {
+  ngx_http_ubus_timing_log(request);
+  ngx_http_ubus_log(request);
+
+  ubus_parser_free(&request->parser);
+  request->body = NULL;
+
+  ubus_shards_free(request);
+
+  if (request->conn) {
+    ubus_pool_release(request->conn);
+    request->conn = NULL;
+  }
+}
+
+static void ubus_async_done(ubus_ctx_t *ctx, enum rpc_status rc);
+
+static void ubus_async_timeout_handler(ngx_event_t *ev) {
+  ubus_ctx_t *ctx = ev->data;
+  struct ubus_request *req = &ctx->ubus->req;
+  ubus_complete_handler_t cb = req->complete_cb;
+
+  ngx_log_error(NGX_LOG_WARN, ev->log, 0, "ubus request for %s timed out",
+                ctx->data.object);
+
+  ubus_abort_request(&ubus_ctx_conn(ctx)->ctx, req);
+
+  req->complete_cb = NULL;
+  if (cb)
+    cb(req, UBUS_STATUS_TIMEOUT);
+}
+
+static void ubus_async_wait(ubus_ctx_t *ctx, ngx_msec_t timeout) {
+  struct dispatch_ubus *du = ctx->ubus;
+
+  ctx->timeout.handler = ubus_async_timeout_handler;
+  ctx->timeout.data = ctx;
+  ctx->timeout.log = ctx->request->r->connection->log;
+
+  ngx_add_timer(&ctx->timeout, timeout);
+
+  ubus_complete_request_async(&ubus_ctx_conn(ctx)->ctx, &du->req);
+}
+
+static void ubus_coalesce_done(ubus_ctx_t *ctx, int ret);
+
+static void ubus_async_result(ubus_ctx_t *ctx, int ret) {
+  request_ctx_t *request = ctx->request;
+
+  if (ctx->timeout.timer_set)
+    ngx_del_timer(&ctx->timeout);
+
+  ubus_limit_leave(ctx);
+
+  ubus_ctx_phase(ctx, UBUS_TIMING_INVOKE);
+
+  ubus_cache_store(request, ctx, ret);
+  ubus_request_done(request, ctx, ret);
+  ubus_coalesce_done(ctx, ret);
+  ubus_request_free(request, ctx);
+
+  ubus_ctx_phase(ctx, UBUS_TIMING_SERIALIZE);
+
+  ubus_async_done(ctx, REQUEST_OK);
+}
+
+static void ubus_async_call_complete(struct ubus_request *req, int ret) {
+  ubus_async_result(req->priv, ret);
+}
+
+static void ubus_async_fail(ubus_ctx_t *ctx, enum rpc_status rc);
+static void ubus_async_invoke(ubus_ctx_t *ctx);
+
+static void ubus_limit_poll(ngx_event_t *ev) { ubus_async_invoke(ev->data); }
+
+// NGX_AGAIN while the call waits in the queue for a place within the
+// ubus_limit limits, NGX_BUSY when the queue is full or the wait is over
+static ngx_int_t ubus_limit_enter(ubus_ctx_t *ctx) {
+  ngx_int_t rc;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  struct rpc_data *data = &ctx->data;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  if (!cglcf->limit_zone)
+    return NGX_OK;
+
+  rc = ubus_limit_acquire(cglcf->limit_zone, &cglcf->limits, data->sid,
+                          data->object, &ctx->limit_held);
+
+  if (rc == NGX_OK) {
+    if (ctx->limit_queued)
+      ubus_limit_dequeue(cglcf->limit_zone);
+    ctx->limit_queued = false;
+    return NGX_OK;
+  }
+
+  if (!ctx->limit_queued) {
+    if (ubus_limit_enqueue(cglcf->limit_zone, cglcf->limit_queue) != NGX_OK)
+      return NGX_BUSY;
+
+    ctx->limit_queued = true;
+    ctx->limit_deadline = ngx_current_msec + ubus_limit_timeout(ctx);
+
+  } else if ((ngx_msec_int_t)(ctx->limit_deadline - ngx_current_msec) <= 0) {
+    ubus_limit_dequeue(cglcf->limit_zone);
+    ctx->limit_queued = false;
+    return NGX_BUSY;
+  }
+
+  ctx->timeout.handler = ubus_limit_poll;
+  ctx->timeout.data = ctx;
+  ctx->timeout.log = ctx->request->r->connection->log;
+
+  ngx_add_timer(&ctx->timeout, UBUS_LIMIT_POLL);
+
+  return NGX_AGAIN;
+}
+
+static void ubus_async_invoke(ubus_ctx_t *ctx) {
+  int ret;
+  ngx_msec_t timeout;
+  struct dispatch_ubus *du = ctx->ubus;
+
+  switch (ubus_limit_enter(ctx)) {
+  case NGX_AGAIN:
+    return;
+  case NGX_BUSY:
+    ubus_async_fail(ctx, ubus_ctx_expired(ctx) ? ERROR_TIMEOUT : ERROR_BUSY);
+    return;
+  }
+
+  timeout = ubus_ctx_timeout(ctx, false);
+  if (!timeout) {
+    ubus_limit_leave(ctx);
+    ubus_async_fail(ctx, ERROR_TIMEOUT);
+    return;
+  }
+
+  ret = ubus_invoke_async(&ubus_ctx_conn(ctx)->ctx, du->obj, du->func,
+                          du->req_buf->head, &du->req);
+  du->req.priv = ctx;
+
+  if (ret) {
+    ubus_async_call_complete(&du->req, ret);
+    return;
+  }
+
+  du->req.data_cb = ubus_request_cb;
+  du->req.complete_cb = ubus_async_call_complete;
+
+  ubus_async_wait(ctx, timeout);
+}
+
+// Identical calls to methods set with ubus_coalesce share one invoke,
+// scoped per session unless the rule is shared
+static bool ubus_coalesce_key(ubus_ctx_t *ctx) {
+  u_char *scope;
+  ubus_rule_t *rule;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  struct rpc_data *data = &ctx->data;
+  ngx_pool_t *pool = ctx->request->r->pool;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  rule = ubus_rule_match(cglcf->coalesce_rules, data->object, data->function);
+  if (!rule)
+    return false;
+
+  // Kept apart from the ubus_cache keys, which live in the same zone
+  if (rule->flags & UBUS_RULE_SHARED) {
+    scope = (u_char *)"coalesce";
+  } else {
+    scope = ngx_pnalloc(pool, sizeof("coalesce:") + ngx_strlen(data->sid));
+    if (!scope)
+      return false;
+    ngx_sprintf(scope, "coalesce:%s%Z", data->sid);
+  }
+
+  if (ubus_cache_key(pool, &ctx->flight_key, data->object, data->function,
+                     (char *)scope, data->data) != NGX_OK) {
+    ngx_str_null(&ctx->flight_key);
+    return false;
+  }
+
+  return true;
+}
+
+static void ubus_coalesce_poll(ngx_event_t *ev) {
+  ngx_int_t rc;
+  ubus_ctx_t *ctx = ev->data;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  rc = ubus_cache_get(cglcf->cache_zone, &ctx->flight_key, ctx->ubus->buf);
+
+  if (rc == NGX_OK) {
+    ubus_async_result(ctx, 0);
+    return;
+  }
+
+  if ((ngx_msec_int_t)(ctx->flight_deadline - ngx_current_msec) <= 0) {
+    ubus_async_result(ctx, UBUS_STATUS_TIMEOUT);
+    return;
+  }
+
+  // The worker fetching it gave up, someone has to do the call
+  if (rc == NGX_DECLINED) {
+    rc = ubus_cache_claim(cglcf->cache_zone, &ctx->flight_key,
+                          ctx->flight_deadline - ngx_current_msec);
+    if (rc != NGX_BUSY) {
+      ctx->flight_claimed = rc == NGX_OK;
+      ubus_async_invoke(ctx);
+      return;
+    }
+  }
+
+  ngx_add_timer(&ctx->timeout, UBUS_COALESCE_POLL);
+}
+
+// NGX_OK when the call has to be sent, NGX_AGAIN when it waits for the
+// result of another one and NGX_DONE when the result is already there
+static ngx_int_t ubus_coalesce_join(ubus_ctx_t *ctx) {
+  uint32_t hash;
+  ngx_int_t rc;
+  ngx_str_node_t *sn;
+  ubus_flight_t *flight;
+  ngx_msec_t timeout;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  request_ctx_t *request = ctx->request;
+  ubus_pool_t *pool = request->conn->pool;
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  if (!cglcf->coalesce_rules || !ubus_coalesce_key(ctx))
+    return NGX_OK;
+
+  hash = ngx_crc32_short(ctx->flight_key.data, ctx->flight_key.len);
+
+  sn = ngx_str_rbtree_lookup(&pool->flights, &ctx->flight_key, hash);
+  if (sn) {
+    flight = (ubus_flight_t *)sn;
+    ngx_queue_insert_tail(&flight->waiters, &ctx->flight_queue);
+    return NGX_AGAIN;
+  }
+
+  flight = ngx_alloc(sizeof(ubus_flight_t) + ctx->flight_key.len,
+                     request->r->connection->log);
+  if (!flight)
+    return NGX_OK;
+
+  ngx_memcpy(flight->key, ctx->flight_key.data, ctx->flight_key.len);
+  flight->sn.node.key = hash;
+  flight->sn.str.data = flight->key;
+  flight->sn.str.len = ctx->flight_key.len;
+  ngx_queue_init(&flight->waiters);
+
+  ngx_rbtree_insert(&pool->flights, &flight->sn.node);
+  ctx->flight = flight;
+
+  if (!cglcf->coalesce_shared)
+    return NGX_OK;
+
+  // Across workers the call is claimed in the cache zone, the others poll
+  // it for the result
+  rc = ubus_cache_get(cglcf->cache_zone, &ctx->flight_key, ctx->ubus->buf);
+  if (rc == NGX_OK)
+    return NGX_DONE;
+
+  timeout = ubus_ctx_timeout(ctx, false);
+
+  if (rc == NGX_DECLINED) {
+    rc = ubus_cache_claim(cglcf->cache_zone, &ctx->flight_key, timeout);
+    if (rc != NGX_BUSY) {
+      ctx->flight_claimed = rc == NGX_OK;
+      return NGX_OK;
+    }
+  }
+
+  ctx->flight_deadline = ngx_current_msec + timeout;
+
+  ctx->timeout.handler = ubus_coalesce_poll;
+  ctx->timeout.data = ctx;
+  ctx->timeout.log = request->r->connection->log;
+
+  ngx_add_timer(&ctx->timeout, UBUS_COALESCE_POLL);
+
+  return NGX_AGAIN;
+}
+
+static void ubus_coalesce_done(ubus_ctx_t *ctx, int ret) {
+  ngx_queue_t *q;
+  ubus_ctx_t *waiter;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  ubus_flight_t *flight = ctx->flight;
+  struct blob_attr *head = ctx->ubus->buf->head;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  // Results only linger long enough for the workers polling for them
+  if (ctx->flight_claimed) {
+    if (ret == 0)
+      ubus_cache_put(cglcf->cache_zone, &ctx->flight_key, head,
+                     UBUS_COALESCE_LINGER);
+    else
+      ubus_cache_release(cglcf->cache_zone, &ctx->flight_key);
+  }
+
+  if (!flight)
+    return;
+
+  ctx->flight = NULL;
+  ngx_rbtree_delete(&ctx->request->conn->pool->flights, &flight->sn.node);
+
+  // Waiters may belong to this very request, which stays alive until
+  // this call is done with
+  while (!ngx_queue_empty(&flight->waiters)) {
+    q = ngx_queue_head(&flight->waiters);
+    ngx_queue_remove(q);
+
+    waiter = ngx_queue_data(q, ubus_ctx_t, flight_queue);
+
+    if (ret == 0)
+      blob_put_raw(waiter->ubus->buf, blob_data(head), blob_len(head));
+
+    ubus_async_result(waiter, ret);
+  }
+
+  ngx_free(flight);
+}
+
+// The call is not sent, neither are the identical ones waiting for it
+static void ubus_async_fail(ubus_ctx_t *ctx, enum rpc_status rc) {
+  ngx_queue_t *q;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  ubus_flight_t *flight = ctx->flight;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  if (ctx->flight_claimed)
+    ubus_cache_release(cglcf->cache_zone, &ctx->flight_key);
+
+  if (flight) {
+    ctx->flight = NULL;
+    ngx_rbtree_delete(&ctx->request->conn->pool->flights, &flight->sn.node);
+
+    while (!ngx_queue_empty(&flight->waiters)) {
+      q = ngx_queue_head(&flight->waiters);
+      ngx_queue_remove(q);
+      ubus_async_fail(ngx_queue_data(q, ubus_ctx_t, flight_queue), rc);
+    }
+
+    ngx_free(flight);
+  }
+
+  ubus_request_free(ctx->request, ctx);
+  ubus_async_done(ctx, rc);
+}
+
+static void ubus_async_call(ubus_ctx_t *ctx) {
+  enum rpc_status rc;
+  struct dispatch_ubus *du = ctx->ubus;
+  request_ctx_t *request = ctx->request;
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Start processing call request");
+
+  // Whatever happened since the lookup was the session check
+  ubus_ctx_phase(ctx, UBUS_TIMING_ACL);
+
+  rc = ubus_request_init(request, ctx, ctx->data.sid, ctx->data.data);
+  if (rc != REQUEST_OK) {
+    ubus_request_free(request, ctx);
+    ubus_async_done(ctx, rc);
+    return;
+  }
+
+  if (ubus_cache_fetch(request, ctx, &ctx->data)) {
+    ubus_ctx_phase(ctx, UBUS_TIMING_INVOKE);
+    ubus_request_done(request, ctx, 0);
+    ubus_request_free(request, ctx);
+    ubus_ctx_phase(ctx, UBUS_TIMING_SERIALIZE);
+    ubus_async_done(ctx, REQUEST_OK);
+    return;
+  }
+
+  du->req.priv = ctx;
+
+  switch (ubus_coalesce_join(ctx)) {
+  case NGX_AGAIN:
+    return;
+  case NGX_DONE:
+    ubus_async_result(ctx, 0);
+    return;
+  default:
+    ubus_async_invoke(ctx);
+  }
+}
+
+// Lookups block, they go to a connection without asynchronous calls in
+// flight whose callbacks they would run
+static int ubus_async_lookup_id(ubus_ctx_t *ctx, const char *path,
+                                uint32_t *id) {
+  ngx_http_ubus_loc_conf_t *cglcf;
+  ubus_pool_t *pool = ctx->request->conn->pool;
+  ubus_conn_t *conn = ubus_pool_lookup_conn(pool);
+
+  if (!conn)
+    return UBUS_STATUS_CONNECTION_FAILED;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  return ubus_pool_lookup_id(pool, &conn->ctx, path, id, cglcf->object_cache);
+}
+
+static void ubus_async_allowed_cb(struct ubus_request *req, int type,
+                                  struct blob_attr *msg) {
+  ubus_ctx_t *ctx = req->priv;
+
+  if (msg)
+    ctx->allow = ubus_parse_allowed(msg);
+}
+
+static void ubus_async_allowed_complete(struct ubus_request *req, int ret) {
+  ubus_ctx_t *ctx = req->priv;
+
+  if (ctx->timeout.timer_set)
+    ngx_del_timer(&ctx->timeout);
+
+  // A check cut short by its timeout or the deadline isn't a denial
+  if (!ctx->allow) {
+    ubus_async_done(ctx, ret == UBUS_STATUS_TIMEOUT || ubus_ctx_expired(ctx)
+                             ? ERROR_TIMEOUT
+                             : ERROR_ACCESS);
+    return;
+  }
+
+  ubus_async_call(ctx);
+}
+
+static void ubus_async_session(ubus_ctx_t *ctx, bool list);
+
+static void ubus_async_acl_complete(struct ubus_request *req, int ret) {
+  ngx_int_t rc;
+  ubus_ctx_t *ctx = req->priv;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  ubus_conn_t *conn = ubus_ctx_conn(ctx);
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  if (ctx->timeout.timer_set)
+    ngx_del_timer(&ctx->timeout);
+
+  if (ret == UBUS_STATUS_NOT_FOUND)
+    ubus_pool_acl_set(conn->pool, ctx->data.sid, NULL, cglcf->acl_cache_ttl);
+
+  rc = ubus_pool_acl_check(conn->pool, ctx->data.sid, ctx->data.object,
+                           ctx->data.function);
+
+  if (rc == NGX_OK)
+    ubus_async_call(ctx);
+  else if (rc == NGX_DECLINED)
+    ubus_async_done(ctx, ERROR_ACCESS);
+  else if (ret == UBUS_STATUS_TIMEOUT)
+    ubus_async_done(ctx, ERROR_TIMEOUT);
+  else
+    ubus_async_session(ctx, false);
+}
+
+static void ubus_async_allowed(ubus_ctx_t *ctx) {
+  ngx_int_t rc = NGX_ERROR;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(ctx->request->r, ngx_http_ubus_module);
+
+  if (cglcf->acl_cache)
+    rc = ubus_pool_acl_check(ubus_ctx_conn(ctx)->pool, ctx->data.sid,
+                             ctx->data.object, ctx->data.function);
+
+  switch (rc) {
+  case NGX_OK:
+    ubus_async_call(ctx);
+    break;
+  case NGX_DECLINED:
+    ubus_async_done(ctx, ERROR_ACCESS);
+    break;
+  default:
+    // Not cached yet, the whole grant set is fetched with "list"
+    ubus_async_session(ctx, rc == NGX_AGAIN);
+    break;
+  }
+}
+
+static void ubus_async_session(ubus_ctx_t *ctx, bool list) {
+  int ret;
+  uint32_t id;
+  ngx_msec_t timeout;
+  struct blob_buf *req;
+  struct dispatch_ubus *du = ctx->ubus;
+  request_ctx_t *request = ctx->request;
+  ubus_complete_handler_t complete =
+      list ? ubus_async_acl_complete : ubus_async_allowed_complete;
+
+  timeout = ubus_ctx_timeout(ctx, true);
+  if (!timeout) {
+    ubus_async_done(ctx, ERROR_TIMEOUT);
+    return;
+  }
+
+  if (ubus_async_lookup_id(ctx, "session", &id)) {
+    ubus_async_done(ctx, ERROR_ACCESS);
+    return;
+  }
+
+  req = ngx_pcalloc(request->r->pool, sizeof(struct blob_buf));
+
+  blob_buf_init(req, 0);
+  blobmsg_add_string(req, "ubus_rpc_session", ctx->data.sid);
+
+  if (!list) {
+    blobmsg_add_string(req, "object", ctx->data.object);
+    blobmsg_add_string(req, "function", ctx->data.function);
+  }
+
+  ctx->allow = false;
+
+  // The message is written out by ubus_invoke_async, no need to keep it
+  ret = ubus_invoke_async(&ubus_ctx_conn(ctx)->ctx, id,
+                          list ? "list" : "access", req->head, &du->req);
+  du->req.priv = ctx;
+
+  free(req->buf);
+  ngx_pfree(request->r->pool, req);
+
+  if (ret) {
+    complete(&du->req, ret);
+    return;
+  }
+
+  du->req.data_cb = list ? ubus_acl_list_cb : ubus_async_allowed_cb;
+  du->req.complete_cb = complete;
+
+  ubus_async_wait(ctx, timeout);
+}
+
+static void ubus_async_post_object(ubus_ctx_t *ctx) {
+  enum rpc_status rc;
+  ngx_http_ubus_loc_conf_t *cglcf;
+  struct rpc_data *data = &ctx->data;
+  request_ctx_t *request = ctx->request;
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Start processing json object %d", ctx->index);
+
+  cglcf = ngx_http_get_module_loc_conf(request->r, ngx_http_ubus_module);
+
+  ubus_ctx_start(ctx);
+
+  rc = ubus_parse_object(ctx, data);
+  if (rc != REQUEST_OK)
+    goto error;
+
+  if (!strcmp(data->method, "call")) {
+    if (!data->sid || !data->object || !data->function || !data->data) {
+      rc = ERROR_PARSE;
+      goto error;
+    }
+
+    if (ubus_access_denied(cglcf->access_rules, data->object,
+                           data->function)) {
+      rc = ERROR_ACCESS;
+      goto error;
+    }
+
+    ctx->ubus->func = data->function;
+
+    // Elements left when the deadline is over fail without a call
+    if (ubus_ctx_expired(ctx)) {
+      rc = ERROR_TIMEOUT;
+      goto error;
+    }
+
+    ubus_ctx_mark(ctx);
+
+    if (ubus_async_lookup_id(ctx, data->object, &ctx->ubus->obj)) {
+      rc = ERROR_OBJECT;
+      goto error;
+    }
+
+    ubus_ctx_phase(ctx, UBUS_TIMING_LOOKUP);
+
+    if (cglcf->noauth)
+      ubus_async_call(ctx);
+    else
+      ubus_async_allowed(ctx);
+
+    return;
+  } else if (!strcmp(data->method, "list")) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                   "Start processing list request");
+
+    ubus_ctx_mark(ctx);
+    rc = ubus_send_list(request, ctx, data->params);
+    ubus_ctx_phase(ctx, UBUS_TIMING_INVOKE);
+  } else {
+    rc = ERROR_METHOD;
+  }
+
+error:
+  ubus_async_done(ctx, rc);
+}
+
+static void ngx_http_ubus_async_finalize(request_ctx_t *request) {
+  uint64_t start;
+  ngx_int_t rc = NGX_HTTP_OK;
+  ngx_http_request_t *r = request->r;
+  ngx_connection_t *c = r->connection;
+  bool waiting = request->waiting;
+
+  if (request->array && !request->streaming)
+    ubus_write_array(request);
+
+  start = ubus_timing_start(request);
+
+  if (request->status != REQUEST_OK)
+    ubus_single_error(request, request->status);
+  else
+    rc = ngx_http_ubus_send_response(request);
+
+  ubus_timing_add(request, UBUS_TIMING_OUTPUT, start);
+
+  ngx_http_ubus_request_free(request);
+  ngx_pfree(r->pool, request);
+
+  ngx_http_finalize_request(r, rc);
+
+  if (waiting)
+    ngx_http_run_posted_requests(c);
+}
+
+static void ubus_async_run(request_ctx_t *request) {
+  int index;
+  ubus_ctx_t *ctx;
+  ubus_shard_t *shard;
+
+  request->running++;
+
+  // Every batch element is sent as soon as a connection has room for it,
+  // responses are collected in array_res as they complete
+  while (request->array_next < request->array_len) {
+    shard = ubus_shard_get(request);
+    if (request->nshards && !shard)
+      break;
+
+    index = request->array_next++;
+
+    ctx = ngx_pcalloc(request->r->pool, sizeof(ubus_ctx_t));
+
+    setup_ubus_ctx_t(ctx, request->r->pool, request,
+                     request->array ? ubus_array_next(request)
+                                    : request->body);
+
+    ctx->array = request->array;
+    ctx->index = index;
+    ctx->shard = shard;
+
+    if (shard)
+      shard->inflight++;
+
+    request->pending++;
+    ubus_async_post_object(ctx);
+  }
+
+  request->running--;
+
+  if (!request->running && !request->pending &&
+      request->array_next == request->array_len)
+    ngx_http_ubus_async_finalize(request);
+}
+
+static void ubus_async_done(ubus_ctx_t *ctx, enum rpc_status rc) {
+  request_ctx_t *request = ctx->request;
+
+  if (rc != REQUEST_OK) {
+    if (ctx->array)
+      ubus_gen_error(request, &request->array_res[ctx->index], rc);
+    else
+      request->status = rc;
+  }
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Json object %d processed", ctx->index);
+
+  if (request->streaming)
+    ngx_http_ubus_stream(request, ctx->index);
+
+  if (ctx->shard)
+    ctx->shard->inflight--;
+
+  ubus_ctx_finish(ctx, rc);
+
+  free_ubus_ctx_t(ctx);
+
+  request->pending--;
+
+  // Elements completing while the batch is still being sent are picked
+  // up by the running loop
+  if (!request->running)
+    ubus_async_run(request);
+}
+
+static void ngx_http_ubus_async_elaborate_req(request_ctx_t *request,
+                                              struct blob_attr *obj) {
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
+                 "Analyzing json object");
+
+  switch (obj ? blobmsg_type(obj) : BLOBMSG_TYPE_UNSPEC) {
+  case BLOBMSG_TYPE_TABLE:
+    request->array_len = 1;
+    break;
+  case BLOBMSG_TYPE_ARRAY:
+    ubus_array_init(request, obj);
+    ubus_shards_init(request, request->array_len);
+    ngx_http_ubus_stream_start(request, true);
+    break;
+  default:
+    request->status = ERROR_PARSE;
+    break;
+  }
+
+  request->running++;
+  ubus_async_run(request);
+  request->running--;
+
+  if (!request->pending && request->array_next == request->array_len) {
+    ngx_http_ubus_async_finalize(request);
+    return;
+  }
+
+  // From now on the request is completed from ubus events
+  request->waiting = 1;
+}
+
+#if (NGX_THREADS)
+typedef struct {
+  request_ctx_t *request;
+  ubus_shard_t *shard;
+  ngx_pool_t *pool;
+} ngx_http_ubus_task_ctx_t;
+
+static void ngx_http_ubus_thread_handler(void *data, ngx_log_t *log) {
+  int index;
+  ubus_ctx_t *ctx;
+  enum rpc_status rc;
+  struct blob_attr *obj;
+  ngx_http_ubus_task_ctx_t *tctx = data;
+  request_ctx_t *request = tctx->request;
+
+  // Every task of a batch keeps taking the next element until none is left
+  for (;;) {
+    if (request->sem)
+      sem_wait(request->sem);
+
+    if (request->array_next == request->array_len) {
+      if (request->sem)
+        sem_post(request->sem);
+      break;
+    }
+
+    index = request->array_next++;
+    obj = request->array ? ubus_array_next(request) : request->body;
+
+    if (request->sem)
+      sem_post(request->sem);
+
+    ctx = ngx_pcalloc(tctx->pool, sizeof(ubus_ctx_t));
+
+    setup_ubus_ctx_t(ctx, tctx->pool, request, obj);
+
+    ctx->array = request->array;
+    ctx->index = index;
+    ctx->shard = tctx->shard;
+
+    if (request->array)
+      request->array_res[index].pool = tctx->pool;
+    else
+      request->out.pool = tctx->pool;
+
+    rc = ubus_post_object(ctx);
+    if (!request->array)
+      request->status = rc;
+  }
+}
+
+static void ngx_http_ubus_thread_event_handler(ngx_event_t *ev) {
+  request_ctx_t *request = ev->data;
+  ngx_http_request_t *r = request->r;
+
+  if (--request->pending)
+    return;
+
+  r->main->blocked--;
+  r->aio = 0;
+
+  ubus_shards_resume(request);
+
+  if (request->sem) {
+    sem_destroy(request->sem);
+    ngx_pfree(r->pool, request->sem);
+    request->sem = NULL;
+  }
+
+  request->waiting = 1;
+  ngx_http_ubus_async_finalize(request);
+}
+
+static void ngx_http_ubus_thread_elaborate_req(request_ctx_t *request,
+                                               struct blob_attr *obj) {
+  ngx_uint_t i, tasks;
+  ngx_thread_task_t *task;
+  ngx_http_ubus_task_ctx_t *tctx;
+  ngx_http_request_t *r = request->r;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  switch (obj ? blobmsg_type(obj) : BLOBMSG_TYPE_UNSPEC) {
+  case BLOBMSG_TYPE_TABLE:
+    request->array_len = 1;
+    tasks = 1;
+    break;
+  case BLOBMSG_TYPE_ARRAY:
+    ubus_array_init(request, obj);
+    if (!request->array_len)
+      goto finalize;
+
+    tasks = ngx_min(cglcf->parallel_req, (ngx_uint_t)request->array_len);
+
+    request->sem = ngx_pcalloc(r->pool, sizeof(sem_t));
+    if (request->sem == NULL) {
+      request->status = ERROR_INTERNAL;
+      goto finalize;
+    }
+
+    sem_init(request->sem, 0, 1);
+
+    if (ubus_shards_init(request, tasks) != NGX_OK)
+      tasks = 1;
+    break;
+  default:
+    request->status = ERROR_PARSE;
+    goto finalize;
+  }
+
+  ubus_shards_suspend(request);
+
+  for (i = 0; i < tasks; i++) {
+    task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_ubus_task_ctx_t));
+    if (task == NULL)
+      break;
+
+    tctx = task->ctx;
+    tctx->pool = ubus_private_pool(request);
+    if (tctx->pool == NULL)
+      break;
+
+    tctx->request = request;
+    tctx->shard = request->nshards ? &request->shards[i % request->nshards]
+                                   : NULL;
+    task->handler = ngx_http_ubus_thread_handler;
+    task->event.data = request;
+    task->event.handler = ngx_http_ubus_thread_event_handler;
+
+    if (ngx_thread_task_post(cglcf->thread_pool, task) != NGX_OK)
+      break;
+
+    request->pending++;
+  }
+
+  // Tasks already running pick up the elements of the ones not posted
+  if (request->pending) {
+    r->main->blocked++;
+    r->aio = 1;
+    return;
+  }
+
+  ubus_shards_resume(request);
+
+  if (request->sem) {
+    sem_destroy(request->sem);
+    request->sem = NULL;
+  }
+
+  request->status = ERROR_INTERNAL;
+
+finalize:
+  ngx_http_ubus_async_finalize(request);
+}
+#endif
+
+static ngx_int_t ngx_http_ubus_read_body(request_ctx_t *request) {
+  ssize_t n;
+  off_t offset, size = 0;
+  u_char *block = NULL;
+  ngx_buf_t *b;
+  ngx_chain_t *in;
+  ngx_http_request_t *r = request->r;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  if (!r->request_body)
+    return NGX_ERROR;
+
+  // Every buffer is fed to the parser as it is, buffers spilled to the
+  // client body temp file are read back in blocks
+  for (in = r->request_body->bufs; in; in = in->next) {
+    b = in->buf;
+
+    size += ngx_buf_size(b);
+    if (size > (off_t)cglcf->max_body_size) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "Request body exceeds ubus_max_body_size %uz",
+                    cglcf->max_body_size);
+      return NGX_DECLINED;
+    }
+
+    if (ngx_buf_in_memory(b)) {
+      if (ubus_parser_feed(&request->parser, b->pos, b->last - b->pos) ==
+          NGX_ERROR)
+        return NGX_ERROR;
+      continue;
+    }
+
+    if (!b->in_file)
+      continue;
+
+    if (!block) {
+      block = ngx_palloc(r->pool, UBUS_BODY_BLOCK_SIZE);
+      if (!block)
+        return NGX_ERROR;
+    }
+
+    for (offset = b->file_pos; offset < b->file_last; offset += n) {
+      n = ngx_read_file(b->file, block,
+                        ngx_min(UBUS_BODY_BLOCK_SIZE, b->file_last - offset),
+                        offset);
+      if (n == NGX_ERROR || n == 0)
+        return NGX_ERROR;
+
+      if (ubus_parser_feed(&request->parser, block, n) == NGX_ERROR)
+        return NGX_ERROR;
+    }
+  }
+
+  if (block)
+    ngx_pfree(r->pool, block);
+
+  request->body = ubus_parser_finish(&request->parser);
+
+  return request->body ? NGX_OK : NGX_ERROR;
+}
+
+// GET requests are /.../<sid>/<object>/<method>?args=<json>, the last
+// segments of the path
+static ngx_int_t ngx_http_ubus_get_call(ngx_http_request_t *r, char **sid,
+                                        char **object, char **method) {
+  int i;
+  u_char *end, *p;
+  char **part[3] = {method, object, sid};
+
+  end = r->uri.data + r->uri.len;
+
+  for (i = 0; i < 3; i++) {
+    for (p = end; p > r->uri.data && p[-1] != '/'; p--)
+      ;
+
+    if (p == end || p == r->uri.data)
+      return NGX_DECLINED;
+
+    *part[i] = ngx_pnalloc(r->pool, end - p + 1);
+    if (!*part[i])
+      return NGX_ERROR;
+
+    ngx_cpystrn((u_char *)*part[i], p, end - p + 1);
+    end = p - 1;
+  }
+
+  return NGX_OK;
+}
+
+// The call is built as the JSON-RPC request a POST would carry, only the
+// arguments are parsed from JSON
+static ngx_int_t ngx_http_ubus_get_body(request_ctx_t *request) {
+  void *c, *params;
+  u_char *dst, *src;
+  ngx_str_t value;
+  struct blob_buf b;
+  struct blob_attr *args = NULL;
+  char *sid, *object, *method;
+  ngx_http_request_t *r = request->r;
+
+  if (ngx_http_ubus_get_call(r, &sid, &object, &method) != NGX_OK)
+    return NGX_ERROR;
+
+  if (ngx_http_arg(r, (u_char *)"args", sizeof("args") - 1, &value) ==
+          NGX_OK &&
+      value.len) {
+    dst = ngx_pnalloc(r->pool, value.len);
+    if (!dst)
+      return NGX_ERROR;
+
+    src = value.data;
+    value.data = dst;
+    ngx_unescape_uri(&dst, &src, value.len, NGX_UNESCAPE_URI);
+    value.len = dst - value.data;
+
+    if (ubus_parser_feed(&request->parser, value.data, value.len) ==
+        NGX_ERROR)
+      return NGX_DECLINED;
+
+    args = ubus_parser_finish(&request->parser);
+    if (!args || blobmsg_type(args) != BLOBMSG_TYPE_TABLE)
+      return NGX_DECLINED;
+  }
+
+  ngx_memzero(&b, sizeof(struct blob_buf));
+  blob_buf_init(&b, 0);
+
+  c = blobmsg_open_table(&b, NULL);
+  blobmsg_add_string(&b, "jsonrpc", "2.0");
+  blobmsg_add_string(&b, "method", "call");
+
+  params = blobmsg_open_array(&b, "params");
+  blobmsg_add_string(&b, NULL, sid);
+  blobmsg_add_string(&b, NULL, object);
+  blobmsg_add_string(&b, NULL, method);
+  if (args)
+    blobmsg_add_field(&b, BLOBMSG_TYPE_TABLE, NULL, blobmsg_data(args),
+                      blobmsg_data_len(args));
+  else
+    blobmsg_close_table(&b, blobmsg_open_table(&b, NULL));
+  blobmsg_close_array(&b, params);
+
+  blobmsg_close_table(&b, c);
+
+  // Owned by the parser from now on, freed with the request
+  blob_buf_free(&request->parser.buf);
+  request->parser.buf = b;
+  request->body = blob_data(b.head);
+
+  return NGX_OK;
+}
+
+static void ngx_http_ubus_req_handler(ngx_http_request_t *r) {
+  ngx_time_t *tp;
+  uint64_t start;
+  ngx_int_t body;
+  request_ctx_t *request;
+  ngx_int_t rc = NGX_HTTP_OK;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  request = ngx_pcalloc(r->pool, sizeof(request_ctx_t));
+  request->r = r;
+  ubus_writer_init(&request->out, r->pool);
+  ubus_parser_init(&request->parser);
+  request->calls = &request->call;
+
+  if (cglcf->binary) {
+    ngx_http_ubus_negotiate(request);
+    request->out.format = request->format;
+  }
+
+  if (cglcf->deadline)
+    request->deadline = ubus_stats_now() + (uint64_t)cglcf->deadline * 1000;
+
+  request->timed = cglcf->server_timing;
+#if (NGX_DEBUG)
+  request->timed |= !!(r->connection->log->log_level & NGX_LOG_DEBUG_HTTP);
+#endif
+
+  // Reading the body is done by nginx before the handler runs, only
+  // known with the millisecond resolution of the request start time
+  if (request->timed) {
+    tp = ngx_timeofday();
+    request->timing[UBUS_TIMING_READ] =
+        ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec)) * 1000;
+  }
+
+  start = ubus_timing_start(request);
+  request->conn = ubus_pool_get(cglcf->pool, true);
+  ubus_timing_add(request, UBUS_TIMING_CONNECT, start);
+
+  if (!request->conn) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "Unable to connect to ubus socket: %s",
+                  cglcf->socket_path.data);
+
+    if (cglcf->stats_zone)
+      ubus_stats_connect_failure(cglcf->stats_zone);
+
+    ubus_single_error(request, ERROR_INTERNAL);
+    goto free_request;
+  }
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "Reading request body");
+
+  // A body failing to parse is reported by elaborate_req
+  start = ubus_timing_start(request);
+  if (r->method == NGX_HTTP_GET)
+    body = ngx_http_ubus_get_body(request);
+  else
+    body = ngx_http_ubus_read_body(request);
+  ubus_timing_add(request, UBUS_TIMING_PARSE, start);
+
+  if (body == NGX_DECLINED) {
+    ubus_single_error(request, ERROR_PARSE);
+    goto free_request;
+  }
+
+  if (cglcf->async) {
+    ngx_http_ubus_async_elaborate_req(request, request->body);
+    return;
+  }
+
+#if (NGX_THREADS)
+  if (cglcf->thread_pool) {
+    ngx_http_ubus_thread_elaborate_req(request, request->body);
+    return;
+  }
+#endif
+
+  rc = ngx_http_ubus_elaborate_req(request, request->body);
+
+  if (rc == NGX_ERROR) {
+    // With ngx_error we are sending json error
+    // and we say that the request is ok
+    rc = NGX_HTTP_OK;
+    goto free_request;
+  }
+
+  start = ubus_timing_start(request);
+  rc = ngx_http_ubus_send_response(request);
+  ubus_timing_add(request, UBUS_TIMING_OUTPUT, start);
+
+free_request:
+  ngx_http_ubus_request_free(request);
+  ngx_pfree(r->pool, request);
+  ngx_http_finalize_request(r, rc);
+}
+
+static ngx_int_t ngx_http_ubus_status_handler(ngx_http_request_t *r) {
+  ngx_int_t rc;
+  ngx_str_t format;
+  ubus_writer_t out;
+  bool prometheus = false;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+    return NGX_HTTP_NOT_ALLOWED;
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK)
+    return rc;
+
+  if (ngx_http_arg(r, (u_char *)"format", sizeof("format") - 1, &format) ==
+          NGX_OK &&
+      format.len == sizeof("prometheus") - 1 &&
+      !ngx_strncmp(format.data, "prometheus", format.len))
+    prometheus = true;
+
+  ubus_writer_init(&out, r->pool);
+  ubus_stats_write(cglcf->status_zone, &out, prometheus);
+
+  if (out.error || !out.buf)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  out.buf->last_buf = 1;
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = out.len;
+
+  if (prometheus) {
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+  } else {
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+  }
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    return rc;
+
+  return ngx_http_output_filter(r, out.first);
+}
+
+static void ngx_http_ubus_events_close(ngx_http_ubus_events_t *ev,
+                                       ngx_int_t rc) {
+  ngx_http_request_t *r = ev->r;
+
+  if (rc == NGX_OK)
+    rc = ngx_http_send_special(r, NGX_HTTP_LAST);
+
+  ngx_http_finalize_request(r, rc);
+}
+
+static void ngx_http_ubus_events_flush(ngx_http_ubus_events_t *ev,
+                                       ngx_chain_t *out) {
+  ngx_int_t rc;
+  size_t backlog = 0;
+  ngx_chain_t *cl;
+  ngx_http_request_t *r = ev->r;
+  ngx_event_t *wev = r->connection->write;
+  ngx_http_core_loc_conf_t *clcf;
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+  rc = ngx_http_output_filter(r, out);
+
+  ngx_chain_update_chains(r->pool, &ev->free, &ev->busy, &out,
+                          (ngx_buf_tag_t)&ngx_http_ubus_module);
+
+  if (rc == NGX_ERROR) {
+    ngx_http_ubus_events_close(ev, NGX_ERROR);
+    return;
+  }
+
+  for (cl = ev->busy; cl; cl = cl->next)
+    backlog += ngx_buf_size(cl->buf);
+
+  // Events are not worth keeping around for a client not reading them
+  if (backlog > UBUS_EVENTS_BACKLOG) {
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "ubus events client too slow, closing the stream");
+    ngx_http_ubus_events_close(ev, NGX_ERROR);
+    return;
+  }
+
+  if (r->connection->buffered) {
+    ngx_add_timer(wev, clcf->send_timeout);
+  } else if (wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+
+  if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+    ngx_http_ubus_events_close(ev, NGX_ERROR);
+}
+
+static void ngx_http_ubus_events_write(ngx_http_ubus_events_t *ev,
+                                       const char *data, size_t len) {
+  ubus_writer_t out;
+
+  ubus_writer_init(&out, ev->r->pool);
+  out.free = &ev->free;
+
+  ubus_writer_write(&out, data, len);
+
+  if (out.error) {
+    ngx_http_ubus_events_close(ev, NGX_ERROR);
+    return;
+  }
+
+  out.buf->flush = 1;
+  ngx_http_ubus_events_flush(ev, out.first);
+}
+
+static void ngx_http_ubus_events_handler_cb(ubus_subscriber_t *s,
+                                            const char *type,
+                                            struct blob_attr *msg) {
+  ubus_writer_t out;
+  ngx_http_ubus_events_t *ev = s->data;
+
+  // The type goes out as is, it must not end the field
+  if (strpbrk(type, "\r\n"))
+    return;
+
+  ubus_writer_init(&out, ev->r->pool);
+  out.free = &ev->free;
+
+  ubus_writer_write(&out, "event: ", sizeof("event: ") - 1);
+  ubus_writer_write(&out, type, strlen(type));
+  ubus_writer_write(&out, "\ndata: ", sizeof("\ndata: ") - 1);
+  ubus_writer_object(&out, msg);
+  ubus_writer_write(&out, "\n\n", 2);
+
+  if (out.error) {
+    ngx_http_ubus_events_close(ev, NGX_ERROR);
+    return;
+  }
+
+  out.buf->flush = 1;
+  ngx_http_ubus_events_flush(ev, out.first);
+}
+
+static void ngx_http_ubus_events_write_handler(ngx_http_request_t *r) {
+  ngx_http_ubus_events_t *ev;
+
+  ev = ngx_http_get_module_ctx(r, ngx_http_ubus_module);
+
+  if (r->connection->write->timedout) {
+    r->connection->timedout = 1;
+    ngx_http_ubus_events_close(ev, NGX_HTTP_REQUEST_TIME_OUT);
+    return;
+  }
+
+  ngx_http_ubus_events_flush(ev, NULL);
+}
+
+// Keeps proxies from timing out idle streams, and ends them when the
+// worker is shutting down. The timer isn't cancelable so that a graceful
+// shutdown waits for it and streams get their last chunk.
+static void ngx_http_ubus_events_ping(ngx_event_t *e) {
+  ngx_http_ubus_events_t *ev = e->data;
+
+  if (ngx_exiting) {
+    ngx_http_ubus_events_close(ev, NGX_OK);
+    return;
+  }
+
+  ngx_add_timer(&ev->ping, UBUS_EVENTS_PING);
+
+  ngx_http_ubus_events_write(ev, ":\n\n", 2);
+}
+
+static void ngx_http_ubus_events_cleanup(void *data) {
+  ngx_http_ubus_events_t *ev = data;
+
+  ubus_pool_unsubscribe(&ev->sub);
+
+  if (ev->ping.timer_set)
+    ngx_del_timer(&ev->ping);
+}
+
+static u_char *ngx_http_ubus_events_arg(ngx_http_request_t *r,
+                                        const char *name, const char *def) {
+  u_char *dst, *src, *arg;
+  ngx_str_t value;
+
+  if (ngx_http_arg(r, (u_char *)name, strlen(name), &value) != NGX_OK ||
+      !value.len)
+    return (u_char *)def;
+
+  arg = ngx_pnalloc(r->pool, value.len + 1);
+  if (!arg)
+    return NULL;
+
+  dst = arg;
+  src = value.data;
+  ngx_unescape_uri(&dst, &src, value.len, NGX_UNESCAPE_URI);
+  *dst = '\0';
+
+  return arg;
+}
+
+// The session has to be granted the event pattern with the ":subscribe"
+// function, as done by uhttpd
+static bool ngx_http_ubus_events_allowed(ngx_http_request_t *r,
+                                         ngx_http_ubus_loc_conf_t *cglcf,
+                                         const char *sid,
+                                         const char *pattern) {
+  bool allow;
+  ubus_ctx_t ctx;
+  ubus_rule_t *rule;
+  request_ctx_t request;
+
+  rule = ubus_rule_match(cglcf->access_rules, pattern, ":subscribe");
+  if (rule)
+    return !(rule->flags & UBUS_RULE_DENY);
+
+  // Nothing but the ubus_allow rules is allowed once there are some
+  if (cglcf->access_rules && (cglcf->access_rules->flags & UBUS_RULE_ALLOW))
+    return false;
+
+  if (cglcf->noauth)
+    return true;
+
+  ngx_memzero(&request, sizeof(request_ctx_t));
+  ngx_memzero(&ctx, sizeof(ubus_ctx_t));
+
+  request.r = r;
+  request.conn = ubus_pool_get(cglcf->pool, true);
+  if (!request.conn)
+    return false;
+
+  ctx.pool = r->pool;
+  ctx.request = &request;
+  ctx.data.sid = sid;
+
+  allow = ubus_allowed(&ctx, sid, pattern, ":subscribe");
+
+  ubus_pool_release(request.conn);
+
+  return allow;
+}
+
+static ngx_int_t ngx_http_ubus_events_handler(ngx_http_request_t *r) {
+  ngx_int_t rc;
+  u_char *sid, *pattern;
+  ngx_pool_cleanup_t *cln;
+  ngx_http_ubus_events_t *ev;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  if (!(r->method & NGX_HTTP_GET))
+    return NGX_HTTP_NOT_ALLOWED;
+
+  if (!cglcf->pool)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK)
+    return rc;
+
+  sid = ngx_http_ubus_events_arg(r, "sid", UBUS_DEFAULT_SID);
+  pattern = ngx_http_ubus_events_arg(r, "pattern", "*");
+  if (!sid || !pattern)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  if (!ngx_http_ubus_events_allowed(r, cglcf, (char *)sid, (char *)pattern))
+    return NGX_HTTP_FORBIDDEN;
+
+  ev = ngx_pcalloc(r->pool, sizeof(ngx_http_ubus_events_t));
+  if (!ev)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (!cln)
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  ev->r = r;
+  ev->sub.pattern = (char *)pattern;
+  ev->sub.handler = ngx_http_ubus_events_handler_cb;
+  ev->sub.data = ev;
+
+  ev->ping.handler = ngx_http_ubus_events_ping;
+  ev->ping.data = ev;
+  ev->ping.log = r->connection->log;
+
+  ngx_http_set_ctx(r, ev, ngx_http_ubus_module);
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = -1;
+  ngx_str_set(&r->headers_out.content_type, "text/event-stream");
+
+  set_custom_headers_out(r, "Cache-Control", "no-cache");
+  set_custom_headers_out(r, "X-Accel-Buffering", "no");
+
+  if (cglcf->cors)
+    ubus_add_cors_headers(r);
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    return rc;
+
+  rc = ngx_http_send_special(r, NGX_HTTP_FLUSH);
+  if (rc == NGX_ERROR ||
+      ngx_handle_write_event(r->connection->write, 0) != NGX_OK)
+    return NGX_ERROR;
+
+  ubus_pool_subscribe(cglcf->pool, &ev->sub);
+
+  cln->handler = ngx_http_ubus_events_cleanup;
+  cln->data = ev;
+
+  // Alive until the client goes away, fed by the events of the pool
+  r->main->count++;
+  r->read_event_handler = ngx_http_test_reading;
+  r->write_event_handler = ngx_http_ubus_events_write_handler;
+
+  ngx_add_timer(&ev->ping, UBUS_EVENTS_PING);
+
+  return NGX_DONE;
+}
+
+static ngx_int_t ngx_http_ubus_handler(ngx_http_request_t *r) {
+  ngx_int_t rc;
+  char *sid, *object, *method;
+  ngx_http_ubus_loc_conf_t *cglcf;
+
+  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+
+  switch (r->method) {
+  case NGX_HTTP_OPTIONS:
+    r->header_only = 1;
+    ngx_http_ubus_send_header(r, cglcf, UBUS_FORMAT_JSON, NGX_HTTP_OK, 0);
+    ngx_http_finalize_request(r, NGX_HTTP_OK);
+    return NGX_DONE;
+
+  case NGX_HTTP_POST:
+
+    if (r->headers_in.content_length_n > (off_t)cglcf->max_body_size) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "Request body exceeds ubus_max_body_size %uz",
+                    cglcf->max_body_size);
+      return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_ubus_req_handler);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+      return rc;
+
+    return NGX_DONE;
+
+  case NGX_HTTP_GET:
+
+    if (!cglcf->get_rules)
+      return NGX_HTTP_NOT_ALLOWED;
 
-  sem_init(sem, 0, 1);
+    rc = ngx_http_ubus_get_call(r, &sid, &object, &method);
+    if (rc != NGX_OK)
+      return rc == NGX_DECLINED ? NGX_HTTP_NOT_FOUND
+                                : NGX_HTTP_INTERNAL_SERVER_ERROR;
 
-  request->sem = sem;
+    // Only methods safe to cache can be called this way
+    if (!ubus_rule_match(cglcf->get_rules, object, method))
+      return NGX_HTTP_FORBIDDEN;
 
-  threads =
-      ngx_pcalloc(request->r->pool, concurrent_thread * sizeof(pthread_t));
-  request->array_res = ngx_pcalloc(request->r->pool, len * sizeof(char *));
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK)
+      return rc;
 
-  while (obj_done < len) {
-    threads_spawned = 0;
+    r->main->count++;
+    ngx_http_ubus_req_handler(r);
 
-    for (concurrent = 0; concurrent < concurrent_thread; concurrent++) {
-      struct json_object *obj_tmp;
+    return NGX_DONE;
 
-      if (obj_done >= len)
-        break;
+  default:
+    return NGX_HTTP_BAD_REQUEST;
+  }
+}
 
-      obj_tmp = json_object_array_get_idx(obj, obj_done);
+static char *ngx_http_ubus(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-      ngx_log_debug2(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                     "Spawning thread %d to process request %d", concurrent,
-                     obj_done);
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_ubus_handler;
 
-      ctx = ngx_pcalloc(request->r->pool, sizeof(ubus_ctx_t));
+  cglcf->enable = 1;
 
-      setup_ubus_ctx_t(ctx, request, obj_tmp);
+  return NGX_CONF_OK;
+}
 
-      ctx->array = true;
-      ctx->index = obj_done;
+static char *ngx_http_ubus_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf) {
+  ssize_t size;
+  ngx_str_t *value;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-      pthread_create(&threads[concurrent], NULL, (void *)ubus_post_object, ctx);
-      threads_spawned++;
-      obj_done++;
-    }
+  if (cglcf->cache_zone != NGX_CONF_UNSET_PTR)
+    return "is duplicate";
 
-    for (concurrent = 0; concurrent < threads_spawned; concurrent++) {
-      ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                     "Waiting thread %d to finish", concurrent);
+  value = cf->args->elts;
 
-      pthread_join(threads[concurrent], NULL);
-    }
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR || size < (ssize_t)(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ubus cache size \"%V\"",
+                       &value[2]);
+    return NGX_CONF_ERROR;
   }
 
-  ngx_pfree(request->r->pool, threads);
+  cglcf->cache_zone =
+      ubus_cache_add_zone(cf, &value[1], size, &ngx_http_ubus_module);
+  if (cglcf->cache_zone == NULL)
+    return NGX_CONF_ERROR;
 
-  append_to_output_chain(request, "[");
+  return NGX_CONF_OK;
+}
 
-  for (concurrent = 0; concurrent < len; concurrent++) {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                   "Writing output of index %d to body", concurrent);
-    if (concurrent > 0)
-      append_to_output_chain(request, ",");
-    if (!request->array_res[concurrent])
-      request->array_res[concurrent] = ubus_gen_error(request, ERROR_INTERNAL);
-    append_to_output_chain(request, request->array_res[concurrent]);
-    free(request->array_res[concurrent]);
+// Results are kept per session unless the rule is "shared"
+static char *ngx_http_ubus_rule_scope(ngx_conf_t *cf, ngx_str_t *value,
+                                      ngx_uint_t *flags) {
+  if (ngx_strcmp(value->data, "shared") == 0) {
+    *flags |= UBUS_RULE_SHARED;
+    return NGX_CONF_OK;
   }
 
-  append_to_output_chain(request, "]");
+  if (ngx_strcmp(value->data, "session") == 0)
+    return NGX_CONF_OK;
 
-  ngx_pfree(request->r->pool, request->array_res);
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", value);
+  return NGX_CONF_ERROR;
+}
 
-  sem_destroy(sem);
-  ngx_pfree(request->r->pool, sem);
+static char *ngx_http_ubus_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf) {
+  ngx_int_t ttl;
+  ngx_str_t *value;
+  ngx_uint_t flags = 0;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                 "Request processed correctly");
+  value = cf->args->elts;
 
-  return rc;
-}
+  ttl = ngx_parse_time(&value[3], 0);
+  if (ttl == NGX_ERROR || ttl == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ubus cache ttl \"%V\"",
+                       &value[3]);
+    return NGX_CONF_ERROR;
+  }
 
-static ngx_int_t ubus_process_object(request_ctx_t *request,
-                                     struct json_object *obj) {
-  ubus_ctx_t *ctx;
-  enum rpc_status rc;
+  if (cf->args->nelts == 5 &&
+      ngx_http_ubus_rule_scope(cf, &value[4], &flags) != NGX_CONF_OK)
+    return NGX_CONF_ERROR;
 
-  ctx = ngx_pcalloc(request->r->pool, sizeof(ubus_ctx_t));
+  return ubus_rule_add(cf, &cglcf->cache_rules, &value[1], &value[2], ttl,
+                       flags);
+}
 
-  setup_ubus_ctx_t(ctx, request, obj);
+static char *ngx_http_ubus_coalesce(ngx_conf_t *cf, ngx_command_t *cmd,
+                                    void *conf) {
+  ngx_str_t *value;
+  ngx_uint_t flags = 0;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  rc = ubus_post_object(ctx);
+  value = cf->args->elts;
 
-  if (rc != REQUEST_OK) {
-    ubus_single_error(request, rc);
-    return NGX_ERROR;
-  }
+  if (cf->args->nelts == 4 &&
+      ngx_http_ubus_rule_scope(cf, &value[3], &flags) != NGX_CONF_OK)
+    return NGX_CONF_ERROR;
 
-  return NGX_OK;
+  return ubus_rule_add(cf, &cglcf->coalesce_rules, &value[1], &value[2], 0,
+                       flags);
 }
 
-static ngx_int_t ngx_http_ubus_elaborate_req(request_ctx_t *request,
-                                             struct json_object *obj) {
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                 "Analyzing json object");
+static char *ngx_http_ubus_get(ngx_conf_t *cf, ngx_command_t *cmd,
+                               void *conf) {
+  ngx_str_t *value;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  switch (obj ? json_object_get_type(obj) : json_type_null) {
-  case json_type_object:
+  value = cf->args->elts;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                   "Json object detected");
+  return ubus_rule_add(cf, &cglcf->get_rules, &value[1], &value[2], 0, 0);
+}
 
-    return ubus_process_object(request, obj);
-  case json_type_array:
+static char *ngx_http_ubus_timeout(ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf) {
+  ngx_int_t timeout;
+  ngx_str_t *value;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, request->r->connection->log, 0,
-                   "Json array detected");
+  value = cf->args->elts;
 
-    return ubus_process_array(request, obj);
-  default:
-    ubus_single_error(request, ERROR_PARSE);
-    return NGX_ERROR;
+  timeout = ngx_parse_time(&value[3], 0);
+  if (timeout == NGX_ERROR || timeout == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ubus timeout \"%V\"",
+                       &value[3]);
+    return NGX_CONF_ERROR;
   }
-}
 
-static void ngx_http_ubus_req_handler(ngx_http_request_t *r) {
-  off_t len;
-  char *buffer;
-  off_t pos = 0;
-  ngx_chain_t *in;
-  request_ctx_t *request;
-  ngx_int_t rc = NGX_HTTP_OK;
-  struct dispatch_ubus *ubus;
-  ngx_http_ubus_loc_conf_t *cglcf;
+  return ubus_rule_add(cf, &cglcf->timeout_rules, &value[1], &value[2],
+                       timeout, 0);
+}
 
-  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+static char *ngx_http_ubus_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf) {
+  ssize_t size;
+  ngx_str_t *value;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  request = ngx_pcalloc(r->pool, sizeof(request_ctx_t));
-  request->r = r;
+  if (cglcf->limit_zone != NGX_CONF_UNSET_PTR)
+    return "is duplicate";
 
-  request->ubus_ctx = ubus_connect(cglcf->socket_path.data);
+  value = cf->args->elts;
 
-  if (!request->ubus_ctx) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "Unable to connect to ubus socket: %s",
-                  cglcf->socket_path.data);
-    ubus_single_error(request, ERROR_INTERNAL);
-    goto finalize;
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR || size < (ssize_t)(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ubus limit size \"%V\"",
+                       &value[2]);
+    return NGX_CONF_ERROR;
   }
 
-  ubus = ngx_pcalloc(r->pool, sizeof(struct dispatch_ubus));
-  ubus->jsobj = NULL;
-  ubus->jstok = json_tokener_new();
-
-  if (ubus->jsobj || !ubus->jstok) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "Error ubus struct not ok");
-    ubus_single_error(request, ERROR_PARSE);
-    goto free_tok;
-  }
+  cglcf->limit_zone =
+      ubus_limit_add_zone(cf, &value[1], size, &ngx_http_ubus_module);
+  if (cglcf->limit_zone == NULL)
+    return NGX_CONF_ERROR;
 
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                 "Reading request body");
+  return NGX_CONF_OK;
+}
 
-  buffer = ngx_pcalloc(r->pool, r->headers_in.content_length_n + 1);
+static char *ngx_http_ubus_limit(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf) {
+  ngx_int_t n;
+  ngx_str_t *value;
+  ngx_uint_t *limit;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  for (in = r->request_body->bufs; in; in = in->next) {
-    len = ngx_buf_size(in->buf);
+  value = cf->args->elts;
 
-    if (!in->buf->pos) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Request too big for request buffer. "
-		    "Set client_body_buffer_size at least to %dk",
-		    (len / 1024) + 1);
-      ubus_single_error(request, ERROR_PARSE);
-      goto free_buf;
-    }
+  if (ngx_strcmp(value[1].data, "global") == 0) {
+    limit = &cglcf->limits.global;
+  } else if (ngx_strcmp(value[1].data, "session") == 0) {
+    limit = &cglcf->limits.session;
+  } else if (ngx_strcmp(value[1].data, "object") == 0) {
+    limit = &cglcf->limits.object;
+  } else {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[1]);
+    return NGX_CONF_ERROR;
+  }
 
-    ngx_memcpy(buffer + pos, in->buf->pos, len);
-    pos += len;
+  if (*limit != NGX_CONF_UNSET_UINT)
+    return "is duplicate";
 
-    if (pos > UBUS_MAX_POST_SIZE) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Error max post size for ubus socket");
-      ubus_single_error(request, ERROR_PARSE);
-      goto free_buf;
-    }
+  n = ngx_atoi(value[2].data, value[2].len);
+  if (n == NGX_ERROR || n == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ubus limit \"%V\"",
+                       &value[2]);
+    return NGX_CONF_ERROR;
   }
 
-  if (pos != r->headers_in.content_length_n) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "Readed buffer differ from header request len");
-    ubus_single_error(request, ERROR_PARSE);
-    goto free_buf;
-  }
+  *limit = n;
 
-  ubus->jsobj = json_tokener_parse_ex(ubus->jstok, buffer, pos);
-  ngx_pfree(r->pool, buffer);
+  return NGX_CONF_OK;
+}
 
-  rc = ngx_http_ubus_elaborate_req(request, ubus->jsobj);
+static char *ngx_http_ubus_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf) {
+  ssize_t size;
+  ngx_str_t *value;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  if (rc == NGX_ERROR) {
-    // With ngx_error we are sending json error
-    // and we say that the request is ok
-    rc = NGX_HTTP_OK;
-    goto free_obj;
+  if (cglcf->stats_zone != NGX_CONF_UNSET_PTR)
+    return "is duplicate";
+
+  value = cf->args->elts;
+
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR || size < (ssize_t)(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ubus stats size \"%V\"",
+                       &value[2]);
+    return NGX_CONF_ERROR;
   }
 
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Sending header");
+  cglcf->stats_zone =
+      ubus_stats_add_zone(cf, &value[1], size, &ngx_http_ubus_module);
+  if (cglcf->stats_zone == NULL)
+    return NGX_CONF_ERROR;
 
-  rc = ngx_http_ubus_send_header(r, cglcf, NGX_HTTP_OK, request->res_len);
-  if (rc == NGX_ERROR || rc > NGX_OK)
-    goto finalize;
+  return NGX_CONF_OK;
+}
 
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Sending body");
+static char *ngx_http_ubus_status(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf) {
+  ngx_str_t *value;
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  rc = ngx_http_ubus_send_body(request);
+  if (cglcf->status_zone)
+    return "is duplicate";
 
-  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "Request complete");
+  value = cf->args->elts;
 
-free_obj:
-  json_object_put(ubus->jsobj);
-free_buf:
-  if (buffer)
-    ngx_pfree(r->pool, buffer);
-free_tok:
-  json_tokener_free(ubus->jstok);
-  ngx_pfree(r->pool, ubus);
-  ubus_free(request->ubus_ctx);
-finalize:
-  ngx_pfree(r->pool, request);
-  ngx_http_finalize_request(r, rc);
+  // The size comes from the ubus_stats_zone defining it
+  cglcf->status_zone =
+      ubus_stats_add_zone(cf, &value[1], 0, &ngx_http_ubus_module);
+  if (cglcf->status_zone == NULL)
+    return NGX_CONF_ERROR;
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_ubus_status_handler;
+
+  return NGX_CONF_OK;
 }
 
-static ngx_int_t ngx_http_ubus_handler(ngx_http_request_t *r) {
-  ngx_int_t rc;
-  ngx_http_ubus_loc_conf_t *cglcf;
+static char *ngx_http_ubus_events(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf) {
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  cglcf = ngx_http_get_module_loc_conf(r, ngx_http_ubus_module);
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_ubus_events_handler;
 
-  switch (r->method) {
-  case NGX_HTTP_OPTIONS:
-    r->header_only = 1;
-    ngx_http_ubus_send_header(r, cglcf, NGX_HTTP_OK, 0);
-    ngx_http_finalize_request(r, NGX_HTTP_OK);
-    return NGX_DONE;
+  cglcf->events = 1;
 
-  case NGX_HTTP_POST:
+  return NGX_CONF_OK;
+}
 
-    rc = ngx_http_read_client_request_body(r, ngx_http_ubus_req_handler);
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
-      return rc;
+static char *ngx_http_ubus_access(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf) {
+  ngx_str_t *value;
+  ngx_str_t any = ngx_string("*");
+  ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-    return NGX_DONE;
+  value = cf->args->elts;
 
-  default:
-    return NGX_HTTP_BAD_REQUEST;
-  }
+  return ubus_rule_add(cf, &cglcf->access_rules, &value[1],
+                       cf->args->nelts == 3 ? &value[2] : &any, 0,
+                       (ngx_uint_t)cmd->post);
 }
 
-static char *ngx_http_ubus(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
-  ngx_http_core_loc_conf_t *clcf;
+#if (NGX_THREADS)
+static char *ngx_http_ubus_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+                                       void *conf) {
+  ngx_str_t *value;
   ngx_http_ubus_loc_conf_t *cglcf = conf;
 
-  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-  clcf->handler = ngx_http_ubus_handler;
+  if (cglcf->thread_pool != NGX_CONF_UNSET_PTR)
+    return "is duplicate";
 
-  cglcf->enable = 1;
+  value = cf->args->elts;
+
+  cglcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+  if (cglcf->thread_pool == NULL)
+    return NGX_CONF_ERROR;
 
   return NGX_CONF_OK;
 }
+#endif
+
+static void *ngx_http_ubus_create_main_conf(ngx_conf_t *cf) {
+  ngx_http_ubus_main_conf_t *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_ubus_main_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  if (ngx_array_init(&conf->pools, cf->pool, 1, sizeof(ubus_pool_t *)) !=
+      NGX_OK) {
+    return NULL;
+  }
+
+  return conf;
+}
 
 static void *ngx_http_ubus_create_loc_conf(ngx_conf_t *cf) {
   ngx_http_ubus_loc_conf_t *conf;
@@ -871,16 +3850,47 @@ static void *ngx_http_ubus_create_loc_conf(ngx_conf_t *cf) {
   conf->cors = NGX_CONF_UNSET;
   conf->noauth = NGX_CONF_UNSET;
   conf->script_timeout = NGX_CONF_UNSET_UINT;
+  conf->timeout_rules = NGX_CONF_UNSET_PTR;
+  conf->deadline = NGX_CONF_UNSET_MSEC;
   conf->parallel_req = NGX_CONF_UNSET_UINT;
+  conf->pool_size = NGX_CONF_UNSET_UINT;
+  conf->max_body_size = NGX_CONF_UNSET_SIZE;
+  conf->async = NGX_CONF_UNSET;
+  conf->stream = NGX_CONF_UNSET_UINT;
+  conf->max_inflight = NGX_CONF_UNSET_UINT;
+  conf->object_cache = NGX_CONF_UNSET;
+  conf->list_cache = NGX_CONF_UNSET;
+  conf->acl_cache = NGX_CONF_UNSET;
+  conf->acl_cache_ttl = NGX_CONF_UNSET_MSEC;
+  conf->cache_zone = NGX_CONF_UNSET_PTR;
+  conf->cache_rules = NGX_CONF_UNSET_PTR;
+  conf->access_rules = NGX_CONF_UNSET_PTR;
+  conf->coalesce_rules = NGX_CONF_UNSET_PTR;
+  conf->coalesce_shared = NGX_CONF_UNSET;
+  conf->get_rules = NGX_CONF_UNSET_PTR;
+  conf->limit_zone = NGX_CONF_UNSET_PTR;
+  conf->limits.global = NGX_CONF_UNSET_UINT;
+  conf->limits.session = NGX_CONF_UNSET_UINT;
+  conf->limits.object = NGX_CONF_UNSET_UINT;
+  conf->limit_queue = NGX_CONF_UNSET_UINT;
+  conf->limit_queue_timeout = NGX_CONF_UNSET_MSEC;
+  conf->stats_zone = NGX_CONF_UNSET_PTR;
+  conf->server_timing = NGX_CONF_UNSET;
+  conf->events = NGX_CONF_UNSET;
+  conf->binary = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+  conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
   conf->enable = NGX_CONF_UNSET;
   return conf;
 }
 
 static char *ngx_http_ubus_merge_loc_conf(ngx_conf_t *cf, void *parent,
                                           void *child) {
+  bool queue;
   ngx_http_ubus_loc_conf_t *prev = parent;
   ngx_http_ubus_loc_conf_t *conf = child;
-  struct ubus_context *test_ubus;
+  ngx_http_ubus_main_conf_t *cmcf;
 
   // Skip merge of other, if we don't have a socket to connect...
   // We don't init the module at all.
@@ -890,8 +3900,40 @@ static char *ngx_http_ubus_merge_loc_conf(ngx_conf_t *cf, void *parent,
   ngx_conf_merge_value(conf->cors, prev->cors, 0);
   ngx_conf_merge_value(conf->noauth, prev->noauth, 0);
   ngx_conf_merge_uint_value(conf->script_timeout, prev->script_timeout, 60);
+  ngx_conf_merge_ptr_value(conf->timeout_rules, prev->timeout_rules, NULL);
+  ngx_conf_merge_msec_value(conf->deadline, prev->deadline, 0);
   ngx_conf_merge_value(conf->enable, prev->enable, 0);
   ngx_conf_merge_uint_value(conf->parallel_req, prev->parallel_req, 1);
+  ngx_conf_merge_uint_value(conf->pool_size, prev->pool_size, 2);
+  ngx_conf_merge_size_value(conf->max_body_size, prev->max_body_size,
+                            UBUS_DEFAULT_MAX_BODY_SIZE);
+  ngx_conf_merge_value(conf->async, prev->async, 0);
+  ngx_conf_merge_uint_value(conf->stream, prev->stream, UBUS_STREAM_OFF);
+  ngx_conf_merge_uint_value(conf->max_inflight, prev->max_inflight, 0);
+  ngx_conf_merge_value(conf->object_cache, prev->object_cache, 0);
+  ngx_conf_merge_value(conf->list_cache, prev->list_cache, 0);
+  ngx_conf_merge_value(conf->acl_cache, prev->acl_cache, 0);
+  ngx_conf_merge_msec_value(conf->acl_cache_ttl, prev->acl_cache_ttl, 5000);
+  ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+  ngx_conf_merge_ptr_value(conf->cache_rules, prev->cache_rules, NULL);
+  ngx_conf_merge_ptr_value(conf->access_rules, prev->access_rules, NULL);
+  ngx_conf_merge_ptr_value(conf->coalesce_rules, prev->coalesce_rules, NULL);
+  ngx_conf_merge_value(conf->coalesce_shared, prev->coalesce_shared, 0);
+  ngx_conf_merge_ptr_value(conf->get_rules, prev->get_rules, NULL);
+  ngx_conf_merge_ptr_value(conf->limit_zone, prev->limit_zone, NULL);
+  ngx_conf_merge_uint_value(conf->limits.global, prev->limits.global, 0);
+  ngx_conf_merge_uint_value(conf->limits.session, prev->limits.session, 0);
+  ngx_conf_merge_uint_value(conf->limits.object, prev->limits.object, 0);
+  ngx_conf_merge_uint_value(conf->limit_queue, prev->limit_queue, 0);
+  ngx_conf_merge_msec_value(conf->limit_queue_timeout,
+                            prev->limit_queue_timeout, 1000);
+  ngx_conf_merge_ptr_value(conf->stats_zone, prev->stats_zone, NULL);
+  ngx_conf_merge_value(conf->server_timing, prev->server_timing, 0);
+  ngx_conf_merge_value(conf->events, prev->events, 0);
+  ngx_conf_merge_value(conf->binary, prev->binary, 0);
+#if (NGX_THREADS)
+  ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
 
   if (conf->script_timeout == 0) {
     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -905,5 +3947,164 @@ static char *ngx_http_ubus_merge_loc_conf(ngx_conf_t *cf, void *parent,
     return NGX_CONF_ERROR;
   }
 
+  if (conf->pool_size == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "ubus_pool_size must be greater than 0");
+    return NGX_CONF_ERROR;
+  }
+
+  if (conf->cache_rules && !conf->cache_zone) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "ubus_cache requires ubus_cache_zone");
+    return NGX_CONF_ERROR;
+  }
+
+  if (conf->coalesce_shared && !conf->cache_zone) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "ubus_coalesce_shared requires ubus_cache_zone");
+    return NGX_CONF_ERROR;
+  }
+
+  if ((conf->limits.global || conf->limits.session || conf->limits.object) &&
+      !conf->limit_zone) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "ubus_limit requires ubus_limit_zone");
+    return NGX_CONF_ERROR;
+  }
+
+  // Without limits the zone has nothing to count
+  if (!conf->limits.global && !conf->limits.session && !conf->limits.object)
+    conf->limit_zone = NULL;
+
+#if (NGX_THREADS)
+  if (conf->async && conf->thread_pool) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "ubus_async and ubus_thread_pool are mutually "
+                       "exclusive");
+    return NGX_CONF_ERROR;
+  }
+#endif
+
+  // Sync mode runs the calls on the event loop, it has no way to wait
+  queue = conf->async;
+#if (NGX_THREADS)
+  queue = queue || conf->thread_pool;
+#endif
+
+  if (conf->limit_zone && conf->limit_queue && !queue) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "ubus_limit_queue requires ubus_async or "
+                       "ubus_thread_pool");
+    return NGX_CONF_ERROR;
+  }
+
+  if (ubus_rules_init(cf, conf->timeout_rules) != NGX_CONF_OK ||
+      ubus_rules_init(cf, conf->cache_rules) != NGX_CONF_OK ||
+      ubus_rules_init(cf, conf->access_rules) != NGX_CONF_OK ||
+      ubus_rules_init(cf, conf->coalesce_rules) != NGX_CONF_OK ||
+      ubus_rules_init(cf, conf->get_rules) != NGX_CONF_OK)
+    return NGX_CONF_ERROR;
+
+  cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ubus_module);
+
+  conf->pool =
+      ubus_pool_add(cf, &cmcf->pools, &conf->socket_path, conf->pool_size);
+  if (conf->pool == NULL)
+    return NGX_CONF_ERROR;
+
+  // The pool is shared by every location using the socket, these only say
+  // what its event connection has to watch. Lookups, lists and session
+  // checks still go by the flags of their own location.
+  if (conf->object_cache)
+    conf->pool->cache_objects = 1;
+
+  if (conf->list_cache)
+    conf->pool->cache_lists = 1;
+
+  if (conf->acl_cache)
+    conf->pool->cache_acls = 1;
+
+  if (conf->events)
+    conf->pool->events = 1;
+
   return NGX_CONF_OK;
 }
+
+static ngx_int_t ngx_http_ubus_add_variables(ngx_conf_t *cf) {
+  ngx_http_variable_t *var, *v;
+
+  for (v = ngx_http_ubus_vars; v->name.len; v++) {
+    var = ngx_http_add_variable(cf, &v->name, v->flags);
+    if (var == NULL)
+      return NGX_ERROR;
+
+    var->get_handler = v->get_handler;
+    var->data = v->data;
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_http_ubus_variable(ngx_http_request_t *r,
+                                        ngx_http_variable_value_t *v,
+                                        uintptr_t data) {
+  ngx_str_t *s;
+  ngx_http_ubus_log_ctx_t *lctx;
+
+  lctx = ngx_http_get_module_ctx(r, ngx_http_ubus_module);
+  if (lctx == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  s = (ngx_str_t *)((u_char *)lctx + data);
+  if (!s->len) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  v->len = s->len;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+  v->data = s->data;
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_http_ubus_init_process(ngx_cycle_t *cycle) {
+  ngx_uint_t i;
+  ubus_pool_t **pool;
+  ngx_http_ubus_main_conf_t *cmcf;
+
+  if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+    return NGX_OK;
+
+  cmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ubus_module);
+  if (cmcf == NULL)
+    return NGX_OK;
+
+  pool = cmcf->pools.elts;
+
+  for (i = 0; i < cmcf->pools.nelts; i++) {
+    if (ubus_pool_init(pool[i], cycle) != NGX_OK)
+      return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+static void ngx_http_ubus_exit_process(ngx_cycle_t *cycle) {
+  ngx_uint_t i;
+  ubus_pool_t **pool;
+  ngx_http_ubus_main_conf_t *cmcf;
+
+  cmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ubus_module);
+  if (cmcf == NULL)
+    return;
+
+  pool = cmcf->pools.elts;
+
+  for (i = 0; i < cmcf->pools.nelts; i++)
+    ubus_pool_exit(pool[i]);
+}
@@ -0,0 +1,352 @@
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+#include <ubus_utility.h>
+
+static ngx_int_t ubus_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+  size_t len;
+  ubus_cache_t *ocache = data;
+  ubus_cache_t *cache = shm_zone->data;
+
+  if (ocache) {
+    cache->sh = ocache->sh;
+    cache->shpool = ocache->shpool;
+    return NGX_OK;
+  }
+
+  cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+  if (shm_zone->shm.exists) {
+    cache->sh = cache->shpool->data;
+    return NGX_OK;
+  }
+
+  cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ubus_cache_sh_t));
+  if (cache->sh == NULL)
+    return NGX_ERROR;
+
+  cache->shpool->data = cache->sh;
+
+  ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&cache->sh->lru);
+
+  len = sizeof(" in ubus cache zone \"\"") + shm_zone->shm.name.len;
+
+  cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+  if (cache->shpool->log_ctx == NULL)
+    return NGX_ERROR;
+
+  ngx_sprintf(cache->shpool->log_ctx, " in ubus cache zone \"%V\"%Z",
+              &shm_zone->shm.name);
+
+  // Running out of memory is expected, the oldest entries get evicted
+  cache->shpool->log_nomem = 0;
+
+  return NGX_OK;
+}
+
+ngx_shm_zone_t *ubus_cache_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                    size_t size, void *tag) {
+  ubus_cache_t *cache;
+  ngx_shm_zone_t *shm_zone;
+
+  shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+  if (shm_zone == NULL)
+    return NULL;
+
+  if (shm_zone->data)
+    return shm_zone;
+
+  cache = ngx_pcalloc(cf->pool, sizeof(ubus_cache_t));
+  if (cache == NULL)
+    return NULL;
+
+  shm_zone->init = ubus_cache_init_zone;
+  shm_zone->data = cache;
+
+  return shm_zone;
+}
+
+static int ubus_cache_attr_cmp(const void *a, const void *b) {
+  return strcmp(blobmsg_name(*(struct blob_attr *const *)a),
+                blobmsg_name(*(struct blob_attr *const *)b));
+}
+
+// Copy the members of a table or array with table keys sorted, so that
+// equal arguments in a different order produce the same key
+static bool ubus_cache_canonical(struct blob_buf *buf, struct blob_attr *attr) {
+  int rem;
+  void *c;
+  bool ret = true;
+  size_t i, n = 0;
+  struct blob_attr *cur, **sorted;
+
+  blobmsg_for_each_attr(cur, attr, rem) n++;
+
+  if (!n)
+    return true;
+
+  sorted = malloc(n * sizeof(*sorted));
+  if (!sorted)
+    return false;
+
+  i = 0;
+  blobmsg_for_each_attr(cur, attr, rem) sorted[i++] = cur;
+
+  if (blobmsg_type(attr) == BLOBMSG_TYPE_TABLE)
+    qsort(sorted, n, sizeof(*sorted), ubus_cache_attr_cmp);
+
+  for (i = 0; i < n && ret; i++) {
+    cur = sorted[i];
+
+    switch (blobmsg_type(cur)) {
+    case BLOBMSG_TYPE_TABLE:
+    case BLOBMSG_TYPE_ARRAY:
+      c = blobmsg_open_nested(buf, blobmsg_name(cur),
+                              blobmsg_type(cur) == BLOBMSG_TYPE_ARRAY);
+      ret = ubus_cache_canonical(buf, cur);
+      blobmsg_close_table(buf, c);
+      break;
+    default:
+      ret = !blobmsg_add_blob(buf, cur);
+      break;
+    }
+  }
+
+  free(sorted);
+
+  return ret;
+}
+
+ngx_int_t ubus_cache_key(ngx_pool_t *pool, ngx_str_t *key, const char *object,
+                         const char *method, const char *scope,
+                         struct blob_attr *args) {
+  u_char *p;
+  size_t object_len, method_len, scope_len;
+  struct blob_buf buf = {0};
+
+  blob_buf_init(&buf, 0);
+
+  if (args && !ubus_cache_canonical(&buf, args)) {
+    blob_buf_free(&buf);
+    return NGX_ERROR;
+  }
+
+  object_len = strlen(object) + 1;
+  method_len = strlen(method) + 1;
+  scope_len = strlen(scope) + 1;
+
+  key->len = object_len + method_len + scope_len + blob_len(buf.head);
+  key->data = ngx_pnalloc(pool, key->len);
+  if (key->data == NULL) {
+    blob_buf_free(&buf);
+    return NGX_ERROR;
+  }
+
+  p = ngx_cpymem(key->data, object, object_len);
+  p = ngx_cpymem(p, method, method_len);
+  p = ngx_cpymem(p, scope, scope_len);
+  ngx_memcpy(p, blob_data(buf.head), blob_len(buf.head));
+
+  blob_buf_free(&buf);
+
+  return NGX_OK;
+}
+
+static void ubus_cache_delete(ubus_cache_t *cache, ubus_cache_node_t *node) {
+  ngx_queue_remove(&node->queue);
+  ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+  ngx_slab_free_locked(cache->shpool, node);
+}
+
+// Drop up to two expired entries from the tail of the LRU list, or the
+// least recently used one unconditionally if memory has to be made
+static bool ubus_cache_expire(ubus_cache_t *cache, bool force) {
+  ngx_uint_t n;
+  ngx_queue_t *q;
+  bool freed = false;
+  ubus_cache_node_t *node;
+
+  for (n = 0; n < 2; n++) {
+    if (ngx_queue_empty(&cache->sh->lru))
+      break;
+
+    q = ngx_queue_last(&cache->sh->lru);
+    node = ngx_queue_data(q, ubus_cache_node_t, queue);
+
+    if (!force && (ngx_msec_int_t)(node->expire - ngx_current_msec) > 0)
+      break;
+
+    ubus_cache_delete(cache, node);
+    freed = true;
+
+    if (force)
+      break;
+  }
+
+  return freed;
+}
+
+ngx_int_t ubus_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key,
+                         struct blob_buf *buf) {
+  uint32_t hash;
+  ngx_int_t rc = NGX_DECLINED;
+  ngx_str_node_t *sn;
+  ubus_cache_node_t *node;
+  ubus_cache_t *cache = zone->data;
+
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  sn = ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+  if (sn == NULL)
+    goto out;
+
+  node = (ubus_cache_node_t *)sn;
+
+  if ((ngx_msec_int_t)(node->expire - ngx_current_msec) <= 0) {
+    ubus_cache_delete(cache, node);
+    goto out;
+  }
+
+  if (node->pending) {
+    rc = NGX_AGAIN;
+    goto out;
+  }
+
+  ngx_queue_remove(&node->queue);
+  ngx_queue_insert_head(&cache->sh->lru, &node->queue);
+
+  rc = blob_put_raw(buf, node->data + key->len, node->len) ? NGX_OK
+                                                           : NGX_ERROR;
+
+out:
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  return rc;
+}
+
+void ubus_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+                    struct blob_attr *data, ngx_msec_t ttl) {
+  size_t len;
+  uint32_t hash;
+  ngx_str_node_t *sn;
+  ubus_cache_node_t *node;
+  ubus_cache_t *cache = zone->data;
+
+  len = blob_len(data);
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  sn = ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+  if (sn)
+    ubus_cache_delete(cache, (ubus_cache_node_t *)sn);
+
+  ubus_cache_expire(cache, false);
+
+  for (;;) {
+    node = ngx_slab_alloc_locked(
+        cache->shpool, offsetof(ubus_cache_node_t, data) + key->len + len);
+    if (node || !ubus_cache_expire(cache, true))
+      break;
+  }
+
+  if (node == NULL)
+    goto out;
+
+  ngx_memcpy(node->data, key->data, key->len);
+  ngx_memcpy(node->data + key->len, blob_data(data), len);
+
+  node->sn.node.key = hash;
+  node->sn.str.data = node->data;
+  node->sn.str.len = key->len;
+  node->len = len;
+  node->pending = 0;
+  node->expire = ngx_current_msec + ttl;
+
+  ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+  ngx_queue_insert_head(&cache->sh->lru, &node->queue);
+
+out:
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+// Insert a placeholder telling the other workers the result is being
+// fetched, NGX_BUSY if there is one already or the result is there
+ngx_int_t ubus_cache_claim(ngx_shm_zone_t *zone, ngx_str_t *key,
+                           ngx_msec_t timeout) {
+  uint32_t hash;
+  ngx_int_t rc = NGX_OK;
+  ngx_str_node_t *sn;
+  ubus_cache_node_t *node;
+  ubus_cache_t *cache = zone->data;
+
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  sn = ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+  if (sn) {
+    node = (ubus_cache_node_t *)sn;
+
+    if ((ngx_msec_int_t)(node->expire - ngx_current_msec) > 0) {
+      rc = NGX_BUSY;
+      goto out;
+    }
+
+    ubus_cache_delete(cache, node);
+  }
+
+  for (;;) {
+    node = ngx_slab_alloc_locked(cache->shpool,
+                                 offsetof(ubus_cache_node_t, data) + key->len);
+    if (node || !ubus_cache_expire(cache, true))
+      break;
+  }
+
+  if (node == NULL) {
+    rc = NGX_ERROR;
+    goto out;
+  }
+
+  ngx_memcpy(node->data, key->data, key->len);
+
+  node->sn.node.key = hash;
+  node->sn.str.data = node->data;
+  node->sn.str.len = key->len;
+  node->len = 0;
+  node->pending = 1;
+  node->expire = ngx_current_msec + timeout;
+
+  ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+  ngx_queue_insert_head(&cache->sh->lru, &node->queue);
+
+out:
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  return rc;
+}
+
+// Drop the placeholder of a fetch that failed, waiters fetch themselves
+void ubus_cache_release(ngx_shm_zone_t *zone, ngx_str_t *key) {
+  uint32_t hash;
+  ngx_str_node_t *sn;
+  ubus_cache_t *cache = zone->data;
+
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  sn = ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+  if (sn && ((ubus_cache_node_t *)sn)->pending)
+    ubus_cache_delete(cache, (ubus_cache_node_t *)sn);
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
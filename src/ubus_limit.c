@@ -0,0 +1,223 @@
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+#include <ubus_utility.h>
+
+static ngx_int_t ubus_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+  size_t len;
+  ubus_limit_t *olimit = data;
+  ubus_limit_t *limit = shm_zone->data;
+
+  if (olimit) {
+    limit->sh = olimit->sh;
+    limit->shpool = olimit->shpool;
+    return NGX_OK;
+  }
+
+  limit->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+  if (shm_zone->shm.exists) {
+    limit->sh = limit->shpool->data;
+    return NGX_OK;
+  }
+
+  limit->sh = ngx_slab_calloc(limit->shpool, sizeof(ubus_limit_sh_t));
+  if (limit->sh == NULL)
+    return NGX_ERROR;
+
+  limit->shpool->data = limit->sh;
+
+  ngx_rbtree_init(&limit->sh->rbtree, &limit->sh->sentinel,
+                  ngx_str_rbtree_insert_value);
+
+  len = sizeof(" in ubus limit zone \"\"") + shm_zone->shm.name.len;
+
+  limit->shpool->log_ctx = ngx_slab_alloc(limit->shpool, len);
+  if (limit->shpool->log_ctx == NULL)
+    return NGX_ERROR;
+
+  ngx_sprintf(limit->shpool->log_ctx, " in ubus limit zone \"%V\"%Z",
+              &shm_zone->shm.name);
+
+  return NGX_OK;
+}
+
+ngx_shm_zone_t *ubus_limit_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                    size_t size, void *tag) {
+  ubus_limit_t *limit;
+  ngx_shm_zone_t *shm_zone;
+
+  shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+  if (shm_zone == NULL)
+    return NULL;
+
+  if (shm_zone->data)
+    return shm_zone;
+
+  limit = ngx_pcalloc(cf->pool, sizeof(ubus_limit_t));
+  if (limit == NULL)
+    return NULL;
+
+  shm_zone->init = ubus_limit_init_zone;
+  shm_zone->data = limit;
+
+  return shm_zone;
+}
+
+// Counter of a session ("s" prefix) or an object ("o" prefix), created
+// on first use
+static ubus_limit_node_t *ubus_limit_node(ubus_limit_t *limit, u_char type,
+                                          const char *name, bool create) {
+  uint32_t hash;
+  ngx_str_t key;
+  ngx_str_node_t *sn;
+  ubus_limit_node_t *node;
+  u_char buf[256];
+
+  key.len = ngx_min(strlen(name), sizeof(buf) - 1) + 1;
+  key.data = buf;
+  buf[0] = type;
+  ngx_memcpy(buf + 1, name, key.len - 1);
+
+  hash = ngx_crc32_short(key.data, key.len);
+
+  sn = ngx_str_rbtree_lookup(&limit->sh->rbtree, &key, hash);
+  if (sn || !create)
+    return (ubus_limit_node_t *)sn;
+
+  node = ngx_slab_alloc_locked(limit->shpool,
+                               offsetof(ubus_limit_node_t, data) + key.len);
+  if (node == NULL)
+    return NULL;
+
+  ngx_memcpy(node->data, key.data, key.len);
+
+  node->sn.node.key = hash;
+  node->sn.str.data = node->data;
+  node->sn.str.len = key.len;
+  node->inflight = 0;
+
+  ngx_rbtree_insert(&limit->sh->rbtree, &node->sn.node);
+
+  return node;
+}
+
+static void ubus_limit_delete(ubus_limit_t *limit, ubus_limit_node_t *node) {
+  ngx_rbtree_delete(&limit->sh->rbtree, &node->sn.node);
+  ngx_slab_free_locked(limit->shpool, node);
+}
+
+static void ubus_limit_put(ubus_limit_t *limit, ubus_limit_node_t *node) {
+  if (node && !--node->inflight)
+    ubus_limit_delete(limit, node);
+}
+
+// Count a call against every configured limit, NGX_BUSY if one of them
+// is reached. Counters that could not be allocated are not enforced,
+// held tells ubus_limit_release which ones were taken.
+ngx_int_t ubus_limit_acquire(ngx_shm_zone_t *zone, ubus_limits_t *limits,
+                             const char *sid, const char *object,
+                             ngx_uint_t *held) {
+  ngx_int_t rc = NGX_BUSY;
+  ubus_limit_t *limit = zone->data;
+  ubus_limit_node_t *session = NULL, *obj = NULL;
+
+  *held = 0;
+
+  ngx_shmtx_lock(&limit->shpool->mutex);
+
+  if (limits->global && limit->sh->inflight >= limits->global)
+    goto out;
+
+  if (limits->session) {
+    session = ubus_limit_node(limit, 's', sid, true);
+    if (session && session->inflight >= limits->session) {
+      session = NULL;
+      goto out;
+    }
+  }
+
+  if (limits->object) {
+    obj = ubus_limit_node(limit, 'o', object, true);
+    if (obj && obj->inflight >= limits->object) {
+      obj = NULL;
+      goto out;
+    }
+  }
+
+  limit->sh->inflight++;
+  *held |= UBUS_LIMIT_GLOBAL;
+
+  if (session) {
+    session->inflight++;
+    *held |= UBUS_LIMIT_SESSION;
+  }
+
+  if (obj) {
+    obj->inflight++;
+    *held |= UBUS_LIMIT_OBJECT;
+  }
+
+  rc = NGX_OK;
+
+out:
+  // A session counter just created for a call rejected by the object
+  // limit is dropped again
+  if (rc != NGX_OK && session && !session->inflight)
+    ubus_limit_delete(limit, session);
+
+  ngx_shmtx_unlock(&limit->shpool->mutex);
+
+  return rc;
+}
+
+void ubus_limit_release(ngx_shm_zone_t *zone, const char *sid,
+                        const char *object, ngx_uint_t held) {
+  ubus_limit_t *limit = zone->data;
+
+  if (!held)
+    return;
+
+  ngx_shmtx_lock(&limit->shpool->mutex);
+
+  limit->sh->inflight--;
+
+  if (held & UBUS_LIMIT_SESSION)
+    ubus_limit_put(limit, ubus_limit_node(limit, 's', sid, false));
+
+  if (held & UBUS_LIMIT_OBJECT)
+    ubus_limit_put(limit, ubus_limit_node(limit, 'o', object, false));
+
+  ngx_shmtx_unlock(&limit->shpool->mutex);
+}
+
+// Take one of the max places of the wait queue shared by all workers
+ngx_int_t ubus_limit_enqueue(ngx_shm_zone_t *zone, ngx_uint_t max) {
+  ngx_int_t rc = NGX_BUSY;
+  ubus_limit_t *limit = zone->data;
+
+  ngx_shmtx_lock(&limit->shpool->mutex);
+
+  if (limit->sh->waiting < max) {
+    limit->sh->waiting++;
+    rc = NGX_OK;
+  }
+
+  ngx_shmtx_unlock(&limit->shpool->mutex);
+
+  return rc;
+}
+
+void ubus_limit_dequeue(ngx_shm_zone_t *zone) {
+  ubus_limit_t *limit = zone->data;
+
+  ngx_shmtx_lock(&limit->shpool->mutex);
+
+  limit->sh->waiting--;
+
+  ngx_shmtx_unlock(&limit->shpool->mutex);
+}
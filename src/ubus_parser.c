@@ -0,0 +1,737 @@
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+#include <ubus_utility.h>
+
+#include <errno.h>
+
+static const char *ubus_parser_literals[] = {"true", "false", "null"};
+
+void ubus_parser_init(ubus_parser_t *p) {
+  ngx_memzero(p, sizeof(ubus_parser_t));
+  blob_buf_init(&p->buf, 0);
+}
+
+void ubus_parser_free(ubus_parser_t *p) {
+  blob_buf_free(&p->buf);
+  free(p->str);
+  free(p->key);
+  p->str = NULL;
+  p->key = NULL;
+}
+
+static bool ubus_parser_putc(ubus_parser_t *p, char c) {
+  char *str;
+  size_t size;
+
+  if (p->str_len == p->str_size) {
+    size = p->str_size ? p->str_size * 2 : 64;
+    str = realloc(p->str, size);
+    if (!str)
+      return false;
+
+    p->str = str;
+    p->str_size = size;
+  }
+
+  p->str[p->str_len++] = c;
+
+  return true;
+}
+
+static bool ubus_parser_put_utf8(ubus_parser_t *p, uint32_t cp) {
+  if (cp < 0x80)
+    return ubus_parser_putc(p, cp);
+
+  if (cp < 0x800)
+    return ubus_parser_putc(p, 0xc0 | (cp >> 6)) &&
+           ubus_parser_putc(p, 0x80 | (cp & 0x3f));
+
+  if (cp < 0x10000)
+    return ubus_parser_putc(p, 0xe0 | (cp >> 12)) &&
+           ubus_parser_putc(p, 0x80 | ((cp >> 6) & 0x3f)) &&
+           ubus_parser_putc(p, 0x80 | (cp & 0x3f));
+
+  return ubus_parser_putc(p, 0xf0 | (cp >> 18)) &&
+         ubus_parser_putc(p, 0x80 | ((cp >> 12) & 0x3f)) &&
+         ubus_parser_putc(p, 0x80 | ((cp >> 6) & 0x3f)) &&
+         ubus_parser_putc(p, 0x80 | (cp & 0x3f));
+}
+
+// A high surrogate not followed by a low one is replaced
+static bool ubus_parser_flush_surrogate(ubus_parser_t *p) {
+  if (!p->surrogate)
+    return true;
+
+  p->surrogate = 0;
+
+  return ubus_parser_put_utf8(p, 0xfffd);
+}
+
+static bool ubus_parser_unicode(ubus_parser_t *p, uint32_t cp) {
+  if (cp >= 0xd800 && cp <= 0xdbff) {
+    if (!ubus_parser_flush_surrogate(p))
+      return false;
+    p->surrogate = cp;
+    return true;
+  }
+
+  if (cp >= 0xdc00 && cp <= 0xdfff) {
+    if (!p->surrogate)
+      return ubus_parser_put_utf8(p, 0xfffd);
+
+    cp = 0x10000 + ((p->surrogate - 0xd800) << 10) + (cp - 0xdc00);
+    p->surrogate = 0;
+    return ubus_parser_put_utf8(p, cp);
+  }
+
+  return ubus_parser_flush_surrogate(p) && ubus_parser_put_utf8(p, cp);
+}
+
+static const char *ubus_parser_name(ubus_parser_t *p) {
+  if (p->depth && !p->stack[p->depth - 1].array)
+    return p->key;
+
+  return "";
+}
+
+static void ubus_parser_value_done(ubus_parser_t *p) {
+  p->state = p->depth ? UBUS_PARSER_NEXT : UBUS_PARSER_DONE;
+}
+
+static bool ubus_parser_open(ubus_parser_t *p, bool array) {
+  void *cookie;
+
+  if (p->depth == UBUS_PARSER_MAX_DEPTH)
+    return false;
+
+  cookie = blobmsg_open_nested(&p->buf, ubus_parser_name(p), array);
+  if (!cookie)
+    return false;
+
+  p->stack[p->depth].cookie = cookie;
+  p->stack[p->depth].array = array;
+  p->depth++;
+
+  p->state = array ? UBUS_PARSER_ARRAY_START : UBUS_PARSER_OBJECT_START;
+
+  return true;
+}
+
+static bool ubus_parser_close(ubus_parser_t *p, bool array) {
+  if (!p->depth || p->stack[p->depth - 1].array != array)
+    return false;
+
+  p->depth--;
+  blobmsg_close_table(&p->buf, p->stack[p->depth].cookie);
+
+  ubus_parser_value_done(p);
+
+  return true;
+}
+
+static bool ubus_parser_string_done(ubus_parser_t *p) {
+  char *key;
+
+  if (!ubus_parser_flush_surrogate(p) || !ubus_parser_putc(p, '\0'))
+    return false;
+
+  if (p->is_key) {
+    // Member names are kept aside until the value is known
+    if (p->key_size < p->str_len) {
+      key = realloc(p->key, p->str_len);
+      if (!key)
+        return false;
+
+      p->key = key;
+      p->key_size = p->str_len;
+    }
+
+    ngx_memcpy(p->key, p->str, p->str_len);
+    p->state = UBUS_PARSER_COLON;
+    return true;
+  }
+
+  if (blobmsg_add_field(&p->buf, BLOBMSG_TYPE_STRING, ubus_parser_name(p),
+                        p->str, p->str_len))
+    return false;
+
+  ubus_parser_value_done(p);
+
+  return true;
+}
+
+static bool ubus_parser_number_done(ubus_parser_t *p) {
+  char *end;
+  double d;
+  long long ll;
+  const char *name = ubus_parser_name(p);
+
+  if (!ubus_parser_putc(p, '\0'))
+    return false;
+
+  if (!strpbrk(p->str, ".eE")) {
+    errno = 0;
+    ll = strtoll(p->str, &end, 10);
+
+    if (*end || end == p->str)
+      return false;
+
+    if (!errno) {
+      if (ll >= INT32_MIN && ll <= INT32_MAX) {
+        if (blobmsg_add_u32(&p->buf, name, (uint32_t)ll))
+          return false;
+      } else if (blobmsg_add_u64(&p->buf, name, (uint64_t)ll)) {
+        return false;
+      }
+
+      ubus_parser_value_done(p);
+      return true;
+    }
+  }
+
+  // Fractions, exponents and integers out of range end up as double
+  d = strtod(p->str, &end);
+  if (*end || end == p->str)
+    return false;
+
+  if (blobmsg_add_double(&p->buf, name, d))
+    return false;
+
+  ubus_parser_value_done(p);
+
+  return true;
+}
+
+static bool ubus_parser_literal_done(ubus_parser_t *p) {
+  int ret;
+  const char *name = ubus_parser_name(p);
+
+  switch (p->literal) {
+  case 0:
+    ret = blobmsg_add_u8(&p->buf, name, 1);
+    break;
+  case 1:
+    ret = blobmsg_add_u8(&p->buf, name, 0);
+    break;
+  default:
+    ret = blobmsg_add_field(&p->buf, BLOBMSG_TYPE_UNSPEC, name, NULL, 0);
+    break;
+  }
+
+  if (ret)
+    return false;
+
+  ubus_parser_value_done(p);
+
+  return true;
+}
+
+static bool ubus_parser_value(ubus_parser_t *p, u_char ch) {
+  p->str_len = 0;
+
+  switch (ch) {
+  case '{':
+    return ubus_parser_open(p, false);
+  case '[':
+    return ubus_parser_open(p, true);
+  case '"':
+    p->is_key = false;
+    p->state = UBUS_PARSER_STRING;
+    return true;
+  case 't':
+  case 'f':
+  case 'n':
+    p->literal = ch == 't' ? 0 : ch == 'f' ? 1 : 2;
+    p->literal_pos = 1;
+    p->state = UBUS_PARSER_LITERAL;
+    return true;
+  default:
+    if (ch != '-' && (ch < '0' || ch > '9'))
+      return false;
+    p->state = UBUS_PARSER_NUMBER;
+    return ubus_parser_putc(p, ch);
+  }
+}
+
+static int ubus_parser_hex(u_char ch) {
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+
+  ch |= 0x20;
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+
+  return -1;
+}
+
+// Binary bodies are only decoded once complete, they are kept in str
+static ngx_int_t ubus_parser_collect(ubus_parser_t *p, const u_char *data,
+                                     size_t len) {
+  char *str;
+  size_t size;
+
+  if (p->str_len + len > p->str_size) {
+    size = p->str_size ? p->str_size : 64;
+    while (size < p->str_len + len)
+      size *= 2;
+
+    str = realloc(p->str, size);
+    if (!str) {
+      p->state = UBUS_PARSER_ERROR;
+      return NGX_ERROR;
+    }
+
+    p->str = str;
+    p->str_size = size;
+  }
+
+  ngx_memcpy(p->str + p->str_len, data, len);
+  p->str_len += len;
+
+  return NGX_AGAIN;
+}
+
+ngx_int_t ubus_parser_feed(ubus_parser_t *p, const u_char *data, size_t len) {
+  int hex;
+  u_char ch;
+  const u_char *end = data + len;
+
+  if (p->state == UBUS_PARSER_ERROR)
+    return NGX_ERROR;
+
+  if (p->format != UBUS_FORMAT_JSON)
+    return ubus_parser_collect(p, data, len);
+
+  while (data < end) {
+    ch = *data;
+
+    switch (p->state) {
+    case UBUS_PARSER_STRING:
+      if (ch == '"') {
+        if (!ubus_parser_string_done(p))
+          goto error;
+      } else if (ch == '\\') {
+        p->state = UBUS_PARSER_ESCAPE;
+      } else if (ch < ' ') {
+        goto error;
+      } else if (!ubus_parser_flush_surrogate(p) || !ubus_parser_putc(p, ch)) {
+        goto error;
+      }
+      data++;
+      continue;
+
+    case UBUS_PARSER_ESCAPE:
+      p->state = UBUS_PARSER_STRING;
+
+      switch (ch) {
+      case 'u':
+        p->unicode = 0;
+        p->unicode_len = 0;
+        p->state = UBUS_PARSER_UNICODE;
+        break;
+      case 'b':
+        ch = '\b';
+        break;
+      case 'f':
+        ch = '\f';
+        break;
+      case 'n':
+        ch = '\n';
+        break;
+      case 'r':
+        ch = '\r';
+        break;
+      case 't':
+        ch = '\t';
+        break;
+      case '"':
+      case '\\':
+      case '/':
+        break;
+      default:
+        goto error;
+      }
+
+      if (p->state == UBUS_PARSER_STRING &&
+          (!ubus_parser_flush_surrogate(p) || !ubus_parser_putc(p, ch)))
+        goto error;
+      data++;
+      continue;
+
+    case UBUS_PARSER_UNICODE:
+      hex = ubus_parser_hex(ch);
+      if (hex < 0)
+        goto error;
+
+      p->unicode = (p->unicode << 4) | hex;
+
+      if (++p->unicode_len == 4) {
+        if (!ubus_parser_unicode(p, p->unicode))
+          goto error;
+        p->state = UBUS_PARSER_STRING;
+      }
+      data++;
+      continue;
+
+    case UBUS_PARSER_NUMBER:
+      if ((ch >= '0' && ch <= '9') || ch == '-' || ch == '+' || ch == '.' ||
+          ch == 'e' || ch == 'E') {
+        if (!ubus_parser_putc(p, ch))
+          goto error;
+        data++;
+        continue;
+      }
+
+      // The delimiter is handled again in the next state
+      if (!ubus_parser_number_done(p))
+        goto error;
+      continue;
+
+    case UBUS_PARSER_LITERAL:
+      if (ch != ubus_parser_literals[p->literal][p->literal_pos])
+        goto error;
+
+      data++;
+
+      if (!ubus_parser_literals[p->literal][++p->literal_pos] &&
+          !ubus_parser_literal_done(p))
+        goto error;
+      continue;
+
+    default:
+      break;
+    }
+
+    data++;
+
+    if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+      continue;
+
+    switch (p->state) {
+    case UBUS_PARSER_VALUE:
+      if (!ubus_parser_value(p, ch))
+        goto error;
+      break;
+
+    case UBUS_PARSER_ARRAY_START:
+      if (ch == ']') {
+        if (!ubus_parser_close(p, true))
+          goto error;
+      } else if (!ubus_parser_value(p, ch)) {
+        goto error;
+      }
+      break;
+
+    case UBUS_PARSER_OBJECT_START:
+    case UBUS_PARSER_KEY:
+      if (ch == '}' && p->state == UBUS_PARSER_OBJECT_START) {
+        if (!ubus_parser_close(p, false))
+          goto error;
+      } else if (ch == '"') {
+        p->str_len = 0;
+        p->is_key = true;
+        p->state = UBUS_PARSER_STRING;
+      } else {
+        goto error;
+      }
+      break;
+
+    case UBUS_PARSER_COLON:
+      if (ch != ':')
+        goto error;
+      p->state = UBUS_PARSER_VALUE;
+      break;
+
+    case UBUS_PARSER_NEXT:
+      if (ch == ',') {
+        p->state = p->stack[p->depth - 1].array ? UBUS_PARSER_VALUE
+                                                : UBUS_PARSER_KEY;
+      } else if (ch == ']' || ch == '}') {
+        if (!ubus_parser_close(p, ch == ']'))
+          goto error;
+      } else {
+        goto error;
+      }
+      break;
+
+    default:
+      goto error;
+    }
+  }
+
+  return p->state == UBUS_PARSER_DONE ? NGX_OK : NGX_AGAIN;
+
+error:
+  p->state = UBUS_PARSER_ERROR;
+  return NGX_ERROR;
+}
+
+// blobmsg bodies are used in place, every attribute has to lie within
+// its parent as the blobmsg iterators do not check the names or the data
+static bool ubus_parser_check(struct blob_attr *attr, size_t len, int depth) {
+  size_t rem;
+  struct blob_attr *cur;
+  size_t min = sizeof(struct blob_attr) + sizeof(struct blobmsg_hdr);
+
+  if (len < min || blob_raw_len(attr) > len || blob_raw_len(attr) < min ||
+      !blob_is_extended(attr))
+    return false;
+
+  if (blob_len(attr) <
+      (size_t)blobmsg_hdrlen(blobmsg_namelen(blob_data(attr))))
+    return false;
+
+  if (!blobmsg_check_attr(attr, false))
+    return false;
+
+  if (blobmsg_type(attr) != BLOBMSG_TYPE_TABLE &&
+      blobmsg_type(attr) != BLOBMSG_TYPE_ARRAY)
+    return true;
+
+  if (depth == UBUS_PARSER_MAX_DEPTH)
+    return false;
+
+  cur = blobmsg_data(attr);
+  rem = blobmsg_data_len(attr);
+
+  while (rem) {
+    if (!ubus_parser_check(cur, rem, depth + 1) || blob_pad_len(cur) > rem)
+      return false;
+
+    rem -= blob_pad_len(cur);
+    cur = blob_next(cur);
+  }
+
+  return true;
+}
+
+static struct blob_attr *ubus_parser_blobmsg(ubus_parser_t *p) {
+  struct blob_attr *attr = (struct blob_attr *)p->str;
+
+  if (!attr || !ubus_parser_check(attr, p->str_len, 0) ||
+      p->str_len > blob_pad_len(attr))
+    return NULL;
+
+  return attr;
+}
+
+static bool ubus_parser_take(const u_char **pos, const u_char *end, size_t n,
+                             uint64_t *val) {
+  if ((size_t)(end - *pos) < n)
+    return false;
+
+  for (*val = 0; n; n--)
+    *val = *val << 8 | *(*pos)++;
+
+  return true;
+}
+
+// Integers are stored as the JSON parser does, 32 bit when they fit
+static bool ubus_parser_msgpack_int(ubus_parser_t *p, const char *name,
+                                    int64_t val) {
+  if (val >= INT32_MIN && val <= INT32_MAX)
+    return !blobmsg_add_u32(&p->buf, name, (uint32_t)val);
+
+  return !blobmsg_add_u64(&p->buf, name, (uint64_t)val);
+}
+
+static bool ubus_parser_msgpack_str(ubus_parser_t *p, const char *name,
+                                    const u_char **pos, const u_char *end,
+                                    uint64_t len) {
+  char *str;
+
+  if ((uint64_t)(end - *pos) < len || memchr(*pos, '\0', len))
+    return false;
+
+  str = blobmsg_alloc_string_buffer(&p->buf, name, len + 1);
+  if (!str)
+    return false;
+
+  ngx_memcpy(str, *pos, len);
+  str[len] = '\0';
+  blobmsg_add_string_buffer(&p->buf);
+
+  *pos += len;
+
+  return true;
+}
+
+// Map keys have to be strings, they are kept in key until the value is
+// added
+static bool ubus_parser_msgpack_key(ubus_parser_t *p, const u_char **pos,
+                                    const u_char *end) {
+  char *key;
+  u_char c;
+  uint64_t len;
+
+  if (*pos == end)
+    return false;
+
+  c = *(*pos)++;
+
+  if ((c & 0xe0) == 0xa0)
+    len = c & 0x1f;
+  else if (c < 0xd9 || c > 0xdb ||
+           !ubus_parser_take(pos, end, 1 << (c - 0xd9), &len))
+    return false;
+
+  if ((uint64_t)(end - *pos) < len || memchr(*pos, '\0', len))
+    return false;
+
+  if (p->key_size < len + 1) {
+    key = realloc(p->key, len + 1);
+    if (!key)
+      return false;
+
+    p->key = key;
+    p->key_size = len + 1;
+  }
+
+  ngx_memcpy(p->key, *pos, len);
+  p->key[len] = '\0';
+  *pos += len;
+
+  return true;
+}
+
+static bool ubus_parser_msgpack(ubus_parser_t *p, const char *name,
+                                const u_char **pos, const u_char *end,
+                                int depth) {
+  u_char c;
+  void *cookie;
+  uint64_t n, i;
+  uint32_t f32;
+  float f;
+  double d;
+  bool map;
+
+  if (*pos == end)
+    return false;
+
+  c = *(*pos)++;
+
+  // Positive and negative fixint
+  if (c <= 0x7f || c >= 0xe0)
+    return ubus_parser_msgpack_int(p, name, (int8_t)c);
+
+  if ((c & 0xe0) == 0xa0)
+    return ubus_parser_msgpack_str(p, name, pos, end, c & 0x1f);
+
+  if ((c & 0xe0) == 0x80) {
+    map = !(c & 0x10);
+    n = c & 0x0f;
+    goto nested;
+  }
+
+  switch (c) {
+  case 0xc0:
+    return !blobmsg_add_field(&p->buf, BLOBMSG_TYPE_UNSPEC, name, NULL, 0);
+  case 0xc2:
+  case 0xc3:
+    return !blobmsg_add_u8(&p->buf, name, c == 0xc3);
+  case 0xca:
+    if (!ubus_parser_take(pos, end, 4, &n))
+      return false;
+
+    f32 = n;
+    ngx_memcpy(&f, &f32, 4);
+    return !blobmsg_add_double(&p->buf, name, f);
+  case 0xcb:
+    if (!ubus_parser_take(pos, end, 8, &n))
+      return false;
+
+    ngx_memcpy(&d, &n, 8);
+    return !blobmsg_add_double(&p->buf, name, d);
+  case 0xcc:
+  case 0xcd:
+  case 0xce:
+  case 0xcf:
+    if (!ubus_parser_take(pos, end, 1 << (c - 0xcc), &n))
+      return false;
+
+    // As for JSON, integers out of range end up as double
+    if (n > INT64_MAX)
+      return !blobmsg_add_double(&p->buf, name, n);
+
+    return ubus_parser_msgpack_int(p, name, n);
+  case 0xd0:
+    return ubus_parser_take(pos, end, 1, &n) &&
+           ubus_parser_msgpack_int(p, name, (int8_t)n);
+  case 0xd1:
+    return ubus_parser_take(pos, end, 2, &n) &&
+           ubus_parser_msgpack_int(p, name, (int16_t)n);
+  case 0xd2:
+    return ubus_parser_take(pos, end, 4, &n) &&
+           ubus_parser_msgpack_int(p, name, (int32_t)n);
+  case 0xd3:
+    return ubus_parser_take(pos, end, 8, &n) &&
+           ubus_parser_msgpack_int(p, name, (int64_t)n);
+  case 0xd9:
+  case 0xda:
+  case 0xdb:
+    return ubus_parser_take(pos, end, 1 << (c - 0xd9), &n) &&
+           ubus_parser_msgpack_str(p, name, pos, end, n);
+  case 0xdc:
+  case 0xdd:
+  case 0xde:
+  case 0xdf:
+    map = c >= 0xde;
+    if (!ubus_parser_take(pos, end, c & 1 ? 4 : 2, &n))
+      return false;
+    goto nested;
+  default:
+    // bin and ext have no blobmsg counterpart
+    return false;
+  }
+
+nested:
+  if (depth == UBUS_PARSER_MAX_DEPTH)
+    return false;
+
+  cookie = blobmsg_open_nested(&p->buf, name, !map);
+  if (!cookie)
+    return false;
+
+  for (i = 0; i < n; i++) {
+    if (map && !ubus_parser_msgpack_key(p, pos, end))
+      return false;
+
+    if (!ubus_parser_msgpack(p, map ? p->key : "", pos, end, depth + 1))
+      return false;
+  }
+
+  blobmsg_close_table(&p->buf, cookie);
+
+  return true;
+}
+
+struct blob_attr *ubus_parser_finish(ubus_parser_t *p) {
+  const u_char *pos, *end;
+
+  if (p->format == UBUS_FORMAT_BLOBMSG)
+    return ubus_parser_blobmsg(p);
+
+  if (p->format == UBUS_FORMAT_MSGPACK) {
+    pos = (u_char *)p->str;
+    end = pos + p->str_len;
+
+    if (!p->str || !ubus_parser_msgpack(p, "", &pos, end, 0) || pos != end)
+      return NULL;
+
+    return blob_data(p->buf.head);
+  }
+
+  // A number at the top level is only terminated by the end of input
+  if (p->state == UBUS_PARSER_NUMBER && !ubus_parser_number_done(p))
+    p->state = UBUS_PARSER_ERROR;
+
+  if (p->state != UBUS_PARSER_DONE)
+    return NULL;
+
+  return blob_data(p->buf.head);
+}
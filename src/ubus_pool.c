@@ -0,0 +1,887 @@
+
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+#include <ubus_utility.h>
+
+#include <fnmatch.h>
+
+enum {
+  OBJECT_EVENT_PATH,
+  __OBJECT_EVENT_MAX,
+};
+
+static const struct blobmsg_policy object_event_policy[__OBJECT_EVENT_MAX] = {
+    [OBJECT_EVENT_PATH] = {.name = "path", .type = BLOBMSG_TYPE_STRING},
+};
+
+enum {
+  SESSION_SID,
+  SESSION_EXPIRES,
+  SESSION_ACLS,
+  __SESSION_MAX,
+};
+
+static const struct blobmsg_policy session_policy[__SESSION_MAX] = {
+    [SESSION_SID] = {.name = "ubus_rpc_session", .type = BLOBMSG_TYPE_STRING},
+    [SESSION_EXPIRES] = {.name = "expires", .type = BLOBMSG_TYPE_INT32},
+    [SESSION_ACLS] = {.name = "acls", .type = BLOBMSG_TYPE_TABLE},
+};
+
+static ngx_int_t ubus_pool_connect(ubus_conn_t *conn);
+static void ubus_pool_detach(ubus_conn_t *conn);
+static void ubus_pool_close(ubus_conn_t *conn);
+
+static void ubus_pool_dummy_handler(ngx_event_t *ev) {}
+
+static void ubus_pool_read_handler(ngx_event_t *ev) {
+  ngx_connection_t *c = ev->data;
+  ubus_conn_t *conn = c->data;
+
+  // Request callbacks may release the connection while libubus is
+  // still walking its receive buffer, temporary ones are closed here
+  conn->dispatching = 1;
+  ubus_handle_event(&conn->ctx);
+  conn->dispatching = 0;
+
+  if (conn->temporary && !conn->busy)
+    ubus_pool_close(conn);
+}
+
+static void ubus_pool_schedule_reconnect(ubus_pool_t *pool) {
+  if (pool->reconnect.timer_set || ngx_exiting)
+    return;
+
+  ngx_add_timer(&pool->reconnect, UBUS_RECONNECT_INTERVAL);
+}
+
+static void ubus_pool_flush_objects(ubus_pool_t *pool) {
+  ubus_object_entry_t *entry, *tmp;
+
+  pthread_mutex_lock(&pool->lock);
+
+  avl_remove_all_elements(&pool->objects, entry, avl, tmp) ngx_free(entry);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void ubus_pool_flush_lists(ubus_pool_t *pool) {
+  ubus_list_entry_t *entry, *tmp;
+
+  pthread_mutex_lock(&pool->lock);
+
+  avl_remove_all_elements(&pool->lists, entry, avl, tmp) {
+    free(entry->json);
+    ngx_free(entry);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void ubus_pool_flush_acls(ubus_pool_t *pool) {
+  ubus_acl_entry_t *entry, *tmp;
+
+  pthread_mutex_lock(&pool->lock);
+
+  avl_remove_all_elements(&pool->acls, entry, avl, tmp) ngx_free(entry);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void ubus_pool_remove_object(ubus_pool_t *pool, const char *path) {
+  ubus_object_entry_t *entry;
+
+  pthread_mutex_lock(&pool->lock);
+
+  entry = avl_find_element(&pool->objects, path, entry, avl);
+  if (entry) {
+    avl_delete(&pool->objects, &entry->avl);
+    ngx_free(entry);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void ubus_pool_object_event(struct ubus_context *ctx,
+                                   struct ubus_event_handler *ev,
+                                   const char *type, struct blob_attr *msg) {
+  struct blob_attr *tb[__OBJECT_EVENT_MAX];
+  ubus_pool_t *pool = container_of(ev, ubus_pool_t, object_event);
+
+  blobmsg_parse(object_event_policy, __OBJECT_EVENT_MAX, tb, blob_data(msg),
+                blob_len(msg));
+
+  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pool->log, 0, "ubus event %s for %s",
+                 type,
+                 tb[OBJECT_EVENT_PATH] ? blobmsg_get_string(tb[OBJECT_EVENT_PATH])
+                                       : "unknown object");
+
+  ubus_pool_flush_lists(pool);
+
+  // An object registered again gets a new id as well
+  if (tb[OBJECT_EVENT_PATH])
+    ubus_pool_remove_object(pool, blobmsg_get_string(tb[OBJECT_EVENT_PATH]));
+  else
+    ubus_pool_flush_objects(pool);
+}
+
+// rpcd announces created and destroyed (also expired) sessions
+static void ubus_pool_session_event(struct ubus_context *ctx,
+                                    struct ubus_event_handler *ev,
+                                    const char *type, struct blob_attr *msg) {
+  ubus_acl_entry_t *entry;
+  struct blob_attr *tb[__SESSION_MAX];
+  ubus_pool_t *pool = container_of(ev, ubus_pool_t, session_event);
+
+  blobmsg_parse(session_policy, __SESSION_MAX, tb, blob_data(msg),
+                blob_len(msg));
+
+  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pool->log, 0, "ubus event %s for %s",
+                 type,
+                 tb[SESSION_SID] ? blobmsg_get_string(tb[SESSION_SID])
+                                 : "unknown session");
+
+  if (!tb[SESSION_SID]) {
+    ubus_pool_flush_acls(pool);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+
+  entry = avl_find_element(&pool->acls, blobmsg_get_string(tb[SESSION_SID]),
+                           entry, avl);
+  if (entry) {
+    avl_delete(&pool->acls, &entry->avl);
+    ngx_free(entry);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void ubus_pool_any_event(struct ubus_context *ctx,
+                                struct ubus_event_handler *ev,
+                                const char *type, struct blob_attr *msg) {
+  ngx_queue_t *q, *next;
+  ubus_subscriber_t *s;
+  ubus_pool_t *pool = container_of(ev, ubus_pool_t, any_event);
+
+  // Handlers may drop their own subscriber
+  for (q = ngx_queue_head(&pool->subscribers);
+       q != ngx_queue_sentinel(&pool->subscribers); q = next) {
+    next = ngx_queue_next(q);
+    s = ngx_queue_data(q, ubus_subscriber_t, queue);
+
+    if (!fnmatch(s->pattern, type, 0))
+      s->handler(s, type, msg);
+  }
+}
+
+static void ubus_pool_connection_lost(struct ubus_context *ctx) {
+  ubus_conn_t *conn = container_of(ctx, ubus_conn_t, ctx);
+
+  // Seen from a thread working on the connection, the event loop handles
+  // it once the connection is resumed
+  if (conn->suspended) {
+    conn->lost = 1;
+    return;
+  }
+
+  ngx_log_error(NGX_LOG_WARN, conn->pool->log, 0,
+                "Lost connection to ubus socket: %V",
+                &conn->pool->socket_path);
+
+  ubus_pool_detach(conn);
+
+  // Registry events may be missed from now on, stop trusting the cache
+  if (conn->watch) {
+    conn->pool->watching = 0;
+    ubus_pool_flush_objects(conn->pool);
+    ubus_pool_flush_lists(conn->pool);
+    ubus_pool_flush_acls(conn->pool);
+  }
+
+  if (!conn->temporary)
+    ubus_pool_schedule_reconnect(conn->pool);
+}
+
+static bool ubus_pool_alive(ubus_conn_t *conn) {
+  u_char c;
+  ssize_t n;
+  int fd = conn->ctx.sock.fd;
+
+  if (!conn->initialized || !conn->c || fd < 0 || conn->ctx.sock.eof ||
+      conn->ctx.sock.error)
+    return false;
+
+  // ubusd closing the socket (restart) is only visible as EOF
+  n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n == 0)
+    return false;
+
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    return false;
+
+  return true;
+}
+
+static ngx_int_t ubus_pool_attach(ubus_conn_t *conn) {
+  ngx_connection_t *c;
+
+  c = ngx_get_connection(conn->ctx.sock.fd, conn->pool->log);
+  if (!c)
+    return NGX_ERROR;
+
+  c->data = conn;
+  c->read->handler = ubus_pool_read_handler;
+  c->write->handler = ubus_pool_dummy_handler;
+  c->read->log = conn->pool->log;
+  c->write->log = conn->pool->log;
+
+  conn->c = c;
+
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    ubus_pool_detach(conn);
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+static void ubus_pool_detach(ubus_conn_t *conn) {
+  ngx_connection_t *c = conn->c;
+
+  if (!c)
+    return;
+
+  // The socket is owned by libubus, only drop the event registration
+  if (c->read->timer_set)
+    ngx_del_timer(c->read);
+
+  if (c->read->active)
+    ngx_del_event(c->read, NGX_READ_EVENT, 0);
+
+  if (c->read->posted)
+    ngx_delete_posted_event(c->read);
+
+  ngx_free_connection(c);
+  c->fd = (ngx_socket_t)-1;
+  conn->c = NULL;
+}
+
+static ngx_int_t ubus_pool_connect(ubus_conn_t *conn) {
+  int ret;
+  ubus_pool_t *pool = conn->pool;
+  const char *path = (const char *)pool->socket_path.data;
+
+  ubus_pool_detach(conn);
+
+  // Objects registered on the old socket are gone, start from scratch
+  if (conn->watch && conn->initialized) {
+    ubus_shutdown(&conn->ctx);
+    conn->initialized = 0;
+  }
+
+  if (conn->initialized) {
+    ret = ubus_reconnect(&conn->ctx, path);
+  } else {
+    ret = ubus_connect_ctx(&conn->ctx, path);
+    if (!ret)
+      conn->initialized = 1;
+  }
+
+  if (ret) {
+    if (!pool->down)
+      ngx_log_error(NGX_LOG_ERR, pool->log, 0,
+                    "Unable to connect to ubus socket: %V", &pool->socket_path);
+    pool->down = 1;
+    return NGX_ERROR;
+  }
+
+  conn->ctx.connection_lost = ubus_pool_connection_lost;
+
+  if (ubus_pool_attach(conn) != NGX_OK)
+    return NGX_ERROR;
+
+  if (pool->down)
+    ngx_log_error(NGX_LOG_NOTICE, pool->log, 0,
+                  "Reconnected to ubus socket: %V", &pool->socket_path);
+  pool->down = 0;
+
+  return NGX_OK;
+}
+
+static ngx_int_t ubus_pool_watch(ubus_pool_t *pool) {
+  int ret;
+  ubus_conn_t *conn = pool->watch;
+
+  pool->watching = 0;
+
+  if (ubus_pool_connect(conn) != NGX_OK)
+    return NGX_ERROR;
+
+  ubus_pool_flush_objects(pool);
+  ubus_pool_flush_lists(pool);
+  ubus_pool_flush_acls(pool);
+
+  ngx_memzero(&pool->object_event, sizeof(struct ubus_event_handler));
+  pool->object_event.cb = ubus_pool_object_event;
+
+  ret = ubus_register_event_handler(&conn->ctx, &pool->object_event,
+                                    "ubus.object.*");
+  if (ret) {
+    ngx_log_error(NGX_LOG_ERR, pool->log, 0,
+                  "Unable to listen for ubus object events on %V: %s",
+                  &pool->socket_path, ubus_strerror(ret));
+    return NGX_ERROR;
+  }
+
+  if (pool->cache_acls) {
+    ngx_memzero(&pool->session_event, sizeof(struct ubus_event_handler));
+    pool->session_event.cb = ubus_pool_session_event;
+
+    ret = ubus_register_event_handler(&conn->ctx, &pool->session_event,
+                                      "session.*");
+    if (ret) {
+      ngx_log_error(NGX_LOG_ERR, pool->log, 0,
+                    "Unable to listen for ubus session events on %V: %s",
+                    &pool->socket_path, ubus_strerror(ret));
+      return NGX_ERROR;
+    }
+  }
+
+  // Subscribers filter on their own, ubusd sends every event once
+  if (pool->events) {
+    ngx_memzero(&pool->any_event, sizeof(struct ubus_event_handler));
+    pool->any_event.cb = ubus_pool_any_event;
+
+    ret = ubus_register_event_handler(&conn->ctx, &pool->any_event, "*");
+    if (ret) {
+      ngx_log_error(NGX_LOG_ERR, pool->log, 0,
+                    "Unable to listen for ubus events on %V: %s",
+                    &pool->socket_path, ubus_strerror(ret));
+      return NGX_ERROR;
+    }
+  }
+
+  pool->watching = 1;
+
+  return NGX_OK;
+}
+
+static void ubus_pool_reconnect_handler(ngx_event_t *ev) {
+  ngx_uint_t i;
+  ubus_conn_t *conn;
+  bool failed = false;
+  ubus_pool_t *pool = ev->data;
+
+  for (i = 0; i < pool->size; i++) {
+    conn = &pool->conns[i];
+
+    if (conn->busy || ubus_pool_alive(conn))
+      continue;
+
+    if (ubus_pool_connect(conn) != NGX_OK)
+      failed = true;
+  }
+
+  if (pool->watch && (!pool->watching || !ubus_pool_alive(pool->watch)) &&
+      ubus_pool_watch(pool) != NGX_OK)
+    failed = true;
+
+  if (failed)
+    ubus_pool_schedule_reconnect(pool);
+}
+
+ubus_pool_t *ubus_pool_add(ngx_conf_t *cf, ngx_array_t *pools,
+                           ngx_str_t *socket_path, ngx_uint_t size) {
+  ngx_uint_t i;
+  ubus_pool_t **pool, *p;
+
+  pool = pools->elts;
+
+  for (i = 0; i < pools->nelts; i++) {
+    p = pool[i];
+
+    if (p->socket_path.len == socket_path->len &&
+        !ngx_strncmp(p->socket_path.data, socket_path->data,
+                     socket_path->len)) {
+      p->size = ngx_max(p->size, size);
+      return p;
+    }
+  }
+
+  p = ngx_pcalloc(cf->pool, sizeof(ubus_pool_t));
+  if (!p)
+    return NULL;
+
+  pool = ngx_array_push(pools);
+  if (!pool)
+    return NULL;
+
+  p->socket_path = *socket_path;
+  p->size = size;
+  *pool = p;
+
+  return p;
+}
+
+ngx_int_t ubus_pool_init(ubus_pool_t *pool, ngx_cycle_t *cycle) {
+  ngx_uint_t i;
+  ubus_conn_t *conn;
+
+  pool->log = cycle->log;
+  pool->conns = ngx_pcalloc(cycle->pool, pool->size * sizeof(ubus_conn_t));
+  if (!pool->conns)
+    return NGX_ERROR;
+
+  ngx_queue_init(&pool->free);
+  ngx_queue_init(&pool->subscribers);
+  avl_init(&pool->objects, avl_strcmp, false, NULL);
+  avl_init(&pool->lists, avl_strcmp, false, NULL);
+  avl_init(&pool->acls, avl_strcmp, false, NULL);
+  ngx_rbtree_init(&pool->flights, &pool->flights_sentinel,
+                  ngx_str_rbtree_insert_value);
+  pthread_mutex_init(&pool->lock, NULL);
+
+  pool->reconnect.handler = ubus_pool_reconnect_handler;
+  pool->reconnect.data = pool;
+  pool->reconnect.log = cycle->log;
+  pool->reconnect.cancelable = 1;
+
+  for (i = 0; i < pool->size; i++) {
+    conn = &pool->conns[i];
+    conn->pool = pool;
+    conn->ctx.sock.fd = -1;
+
+    ngx_queue_insert_tail(&pool->free, &conn->queue);
+
+    // ubusd may not be up yet, keep retrying in background
+    if (ubus_pool_connect(conn) != NGX_OK)
+      ubus_pool_schedule_reconnect(pool);
+  }
+
+  if (!pool->cache_objects && !pool->cache_lists && !pool->cache_acls &&
+      !pool->events)
+    return NGX_OK;
+
+  pool->watch = ngx_pcalloc(cycle->pool, sizeof(ubus_conn_t));
+  if (!pool->watch)
+    return NGX_ERROR;
+
+  pool->watch->pool = pool;
+  pool->watch->watch = 1;
+  pool->watch->ctx.sock.fd = -1;
+
+  if (ubus_pool_watch(pool) != NGX_OK)
+    ubus_pool_schedule_reconnect(pool);
+
+  return NGX_OK;
+}
+
+void ubus_pool_exit(ubus_pool_t *pool) {
+  ngx_uint_t i;
+  ubus_conn_t *conn;
+
+  if (pool->reconnect.timer_set)
+    ngx_del_timer(&pool->reconnect);
+
+  for (i = 0; pool->conns && i < pool->size; i++) {
+    conn = &pool->conns[i];
+
+    if (!conn->initialized)
+      continue;
+
+    ubus_pool_detach(conn);
+    ubus_shutdown(&conn->ctx);
+    conn->initialized = 0;
+  }
+
+  if (pool->watch && pool->watch->initialized) {
+    ubus_pool_detach(pool->watch);
+    ubus_shutdown(&pool->watch->ctx);
+    pool->watch->initialized = 0;
+  }
+
+  if (pool->lookup) {
+    ubus_pool_close(pool->lookup);
+    pool->lookup = NULL;
+  }
+
+  if (pool->conns) {
+    ubus_pool_flush_objects(pool);
+    ubus_pool_flush_lists(pool);
+    ubus_pool_flush_acls(pool);
+  }
+}
+
+ubus_conn_t *ubus_pool_get(ubus_pool_t *pool, bool fallback) {
+  ngx_uint_t i;
+  ngx_queue_t *q;
+  ubus_conn_t *conn;
+
+  if (!pool || !pool->conns)
+    return NULL;
+
+  for (i = 0; i < pool->size && !ngx_queue_empty(&pool->free); i++) {
+    q = ngx_queue_head(&pool->free);
+    conn = ngx_queue_data(q, ubus_conn_t, queue);
+    ngx_queue_remove(q);
+
+    if (ubus_pool_alive(conn) || ubus_pool_connect(conn) == NGX_OK) {
+      conn->busy = 1;
+      return conn;
+    }
+
+    ngx_queue_insert_tail(&pool->free, q);
+    ubus_pool_schedule_reconnect(pool);
+  }
+
+  if (!fallback || !ngx_queue_empty(&pool->free))
+    return NULL;
+
+  // Every pooled connection is in use, fall back to a private one
+  conn = ngx_calloc(sizeof(ubus_conn_t), pool->log);
+  if (!conn)
+    return NULL;
+
+  conn->pool = pool;
+  conn->temporary = 1;
+  conn->busy = 1;
+  conn->ctx.sock.fd = -1;
+
+  if (ubus_pool_connect(conn) != NGX_OK) {
+    ubus_pool_close(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+// Connection never carrying asynchronous requests. A blocking lookup on one
+// that does would run their callbacks from inside the lookup.
+ubus_conn_t *ubus_pool_lookup_conn(ubus_pool_t *pool) {
+  ubus_conn_t *conn = pool->lookup;
+
+  if (!conn) {
+    conn = ngx_calloc(sizeof(ubus_conn_t), pool->log);
+    if (!conn)
+      return NULL;
+
+    conn->pool = pool;
+    conn->busy = 1;
+    conn->ctx.sock.fd = -1;
+    pool->lookup = conn;
+  }
+
+  if (!ubus_pool_alive(conn) && ubus_pool_connect(conn) != NGX_OK)
+    return NULL;
+
+  return conn;
+}
+
+static void ubus_pool_close(ubus_conn_t *conn) {
+  ubus_pool_detach(conn);
+
+  if (conn->initialized)
+    ubus_shutdown(&conn->ctx);
+
+  ngx_free(conn);
+}
+
+void ubus_pool_release(ubus_conn_t *conn) {
+  conn->busy = 0;
+
+  if (conn->temporary) {
+    if (!conn->dispatching)
+      ubus_pool_close(conn);
+    return;
+  }
+
+  ngx_queue_insert_head(&conn->pool->free, &conn->queue);
+
+  if (!ubus_pool_alive(conn))
+    ubus_pool_schedule_reconnect(conn->pool);
+}
+
+// Stop dispatching the socket from the event loop while another thread
+// runs blocking calls on it
+void ubus_pool_suspend(ubus_conn_t *conn) {
+  ngx_connection_t *c = conn->c;
+
+  conn->suspended = 1;
+
+  if (!c)
+    return;
+
+  if (c->read->active)
+    ngx_del_event(c->read, NGX_READ_EVENT, 0);
+
+  if (c->read->posted)
+    ngx_delete_posted_event(c->read);
+}
+
+void ubus_pool_resume(ubus_conn_t *conn) {
+  conn->suspended = 0;
+
+  if (conn->lost) {
+    conn->lost = 0;
+    ubus_pool_connection_lost(&conn->ctx);
+    return;
+  }
+
+  if (conn->c && ngx_handle_read_event(conn->c->read, 0) != NGX_OK)
+    ubus_pool_detach(conn);
+}
+
+// cache is the ubus_object_cache setting of the location, the pool only
+// keeps the entries for the locations asking for them
+int ubus_pool_lookup_id(ubus_pool_t *pool, struct ubus_context *ctx,
+                        const char *path, uint32_t *id, bool cache) {
+  int ret;
+  size_t len;
+  ubus_object_entry_t *entry;
+
+  if (!cache || !pool->watching)
+    return ubus_lookup_id(ctx, path, id);
+
+  pthread_mutex_lock(&pool->lock);
+
+  entry = avl_find_element(&pool->objects, path, entry, avl);
+  if (entry)
+    *id = entry->id;
+
+  pthread_mutex_unlock(&pool->lock);
+
+  if (entry)
+    return 0;
+
+  ret = ubus_lookup_id(ctx, path, id);
+  if (ret)
+    return ret;
+
+  len = strlen(path) + 1;
+
+  entry = ngx_alloc(sizeof(ubus_object_entry_t) + len, pool->log);
+  if (!entry)
+    return 0;
+
+  ngx_memcpy(entry->path, path, len);
+  entry->id = *id;
+  entry->avl.key = entry->path;
+
+  pthread_mutex_lock(&pool->lock);
+
+  if (avl_insert(&pool->objects, &entry->avl))
+    ngx_free(entry);
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+bool ubus_pool_list_get(ubus_pool_t *pool, const char *key,
+                        struct blob_attr *head, ubus_writer_t *w) {
+  ubus_list_entry_t *entry;
+
+  if (!pool->cache_lists || !pool->watching)
+    return false;
+
+  pthread_mutex_lock(&pool->lock);
+
+  entry = avl_find_element(&pool->lists, key, entry, avl);
+  if (entry) {
+    ubus_writer_open(w, head);
+    ubus_writer_raw(w, "result", entry->json, entry->len);
+    ubus_writer_close(w);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return entry != NULL;
+}
+
+void ubus_pool_list_set(ubus_pool_t *pool, const char *key, const char *json) {
+  size_t len;
+  ubus_list_entry_t *entry;
+
+  if (!pool->cache_lists || !pool->watching)
+    return;
+
+  len = strlen(key) + 1;
+
+  entry = ngx_alloc(sizeof(ubus_list_entry_t) + len, pool->log);
+  if (!entry)
+    return;
+
+  entry->json = strdup(json);
+  if (!entry->json) {
+    ngx_free(entry);
+    return;
+  }
+
+  entry->len = strlen(json);
+  ngx_memcpy(entry->key, key, len);
+  entry->avl.key = entry->key;
+
+  pthread_mutex_lock(&pool->lock);
+
+  if (avl_insert(&pool->lists, &entry->avl)) {
+    free(entry->json);
+    ngx_free(entry);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+ngx_int_t ubus_pool_acl_check(ubus_pool_t *pool, const char *sid,
+                              const char *object, const char *function) {
+  ngx_uint_t i;
+  ngx_int_t rc = NGX_AGAIN;
+  ubus_acl_entry_t *entry;
+
+  if (!pool->cache_acls || !pool->watching)
+    return NGX_ERROR;
+
+  pthread_mutex_lock(&pool->lock);
+
+  entry = avl_find_element(&pool->acls, sid, entry, avl);
+  if (!entry)
+    goto out;
+
+  if ((ngx_msec_int_t)(entry->expire - ngx_current_msec) <= 0) {
+    avl_delete(&pool->acls, &entry->avl);
+    ngx_free(entry);
+    goto out;
+  }
+
+  // Halfway through its lifetime the next check fetches the grants again,
+  // keeping the session alive in rpcd. Everybody else uses the entry
+  // meanwhile, and keeps doing so if fetching fails.
+  if ((ngx_msec_int_t)(entry->refresh - ngx_current_msec) <= 0) {
+    entry->refresh = entry->expire;
+    goto out;
+  }
+
+  // Same matching as rpcd does for "session access"
+  rc = NGX_DECLINED;
+  for (i = 0; i < entry->ngrants; i++) {
+    if (!fnmatch(entry->grants[2 * i], object, FNM_NOESCAPE) &&
+        !fnmatch(entry->grants[2 * i + 1], function, FNM_NOESCAPE)) {
+      rc = NGX_OK;
+      break;
+    }
+  }
+
+out:
+  pthread_mutex_unlock(&pool->lock);
+
+  return rc;
+}
+
+void ubus_pool_acl_set(ubus_pool_t *pool, const char *sid,
+                       struct blob_attr *session, ngx_msec_t ttl) {
+  char *p;
+  int rem, rem2;
+  size_t len, sid_len;
+  ngx_uint_t n = 0;
+  ubus_acl_entry_t *entry, *old;
+  struct blob_attr *tb[__SESSION_MAX];
+  struct blob_attr *scope = NULL, *obj, *fun, *cur;
+
+  if (!pool->cache_acls || !pool->watching)
+    return;
+
+  // A session unknown to rpcd is cached without grants
+  if (session) {
+    blobmsg_parse(session_policy, __SESSION_MAX, tb, blob_data(session),
+                  blob_len(session));
+
+    if (tb[SESSION_EXPIRES] &&
+        (int32_t)blobmsg_get_u32(tb[SESSION_EXPIRES]) > 0)
+      ttl = ngx_min(ttl, blobmsg_get_u32(tb[SESSION_EXPIRES]) * 1000);
+
+    if (tb[SESSION_ACLS])
+      blobmsg_for_each_attr(cur, tb[SESSION_ACLS], rem) {
+        if (!strcmp(blobmsg_name(cur), "ubus") &&
+            blobmsg_type(cur) == BLOBMSG_TYPE_TABLE)
+          scope = cur;
+      }
+  }
+
+  sid_len = strlen(sid) + 1;
+  len = sid_len;
+
+  if (scope)
+    blobmsg_for_each_attr(obj, scope, rem) {
+      if (blobmsg_type(obj) != BLOBMSG_TYPE_ARRAY)
+        continue;
+
+      blobmsg_for_each_attr(fun, obj, rem2) {
+        if (blobmsg_type(fun) != BLOBMSG_TYPE_STRING)
+          continue;
+
+        len += strlen(blobmsg_name(obj)) + strlen(blobmsg_get_string(fun)) + 2;
+        n++;
+      }
+    }
+
+  // Patterns are packed in one block behind the pointer pairs
+  entry = ngx_alloc(sizeof(ubus_acl_entry_t) + 2 * n * sizeof(char *) + len,
+                    pool->log);
+  if (!entry)
+    return;
+
+  entry->grants = (const char **)((u_char *)entry + sizeof(ubus_acl_entry_t));
+  p = (char *)(entry->grants + 2 * n);
+
+  ngx_memcpy(p, sid, sid_len);
+  entry->avl.key = p;
+  p += sid_len;
+
+  entry->ngrants = 0;
+  entry->expire = ngx_current_msec + ttl;
+  entry->refresh = ngx_current_msec + ttl / 2;
+
+  if (scope)
+    blobmsg_for_each_attr(obj, scope, rem) {
+      if (blobmsg_type(obj) != BLOBMSG_TYPE_ARRAY)
+        continue;
+
+      blobmsg_for_each_attr(fun, obj, rem2) {
+        if (blobmsg_type(fun) != BLOBMSG_TYPE_STRING)
+          continue;
+
+        entry->grants[2 * entry->ngrants] = p;
+        p = stpcpy(p, blobmsg_name(obj)) + 1;
+
+        entry->grants[2 * entry->ngrants + 1] = p;
+        p = stpcpy(p, blobmsg_get_string(fun)) + 1;
+
+        entry->ngrants++;
+      }
+    }
+
+  pthread_mutex_lock(&pool->lock);
+
+  old = avl_find_element(&pool->acls, entry->avl.key, old, avl);
+  if (old) {
+    avl_delete(&pool->acls, &old->avl);
+    ngx_free(old);
+  }
+
+  avl_insert(&pool->acls, &entry->avl);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void ubus_pool_subscribe(ubus_pool_t *pool, ubus_subscriber_t *s) {
+  ngx_queue_insert_tail(&pool->subscribers, &s->queue);
+}
+
+void ubus_pool_unsubscribe(ubus_subscriber_t *s) {
+  ngx_queue_remove(&s->queue);
+}
@@ -0,0 +1,411 @@
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+#include <ubus_utility.h>
+
+#include <inttypes.h>
+#include <time.h>
+
+// Upper bounds in microseconds, the last bucket takes everything else
+static const uint64_t ubus_stats_latency_le[UBUS_STATS_LATENCY_BUCKETS - 1] = {
+    1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+    5000000};
+
+static const ngx_uint_t ubus_stats_batch_le[UBUS_STATS_BATCH_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100};
+
+static const char *ubus_stats_status[__ERROR_MAX] = {
+    [REQUEST_OK] = "ok",           [ERROR_PARSE] = "parse",
+    [ERROR_REQUEST] = "request",   [ERROR_METHOD] = "method",
+    [ERROR_PARAMS] = "params",     [ERROR_INTERNAL] = "internal",
+    [ERROR_OBJECT] = "object",     [ERROR_SESSION] = "session",
+    [ERROR_ACCESS] = "access",     [ERROR_TIMEOUT] = "timeout",
+    [ERROR_BUSY] = "busy",
+};
+
+static ngx_int_t ubus_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+  size_t len;
+  ubus_stats_t *ostats = data;
+  ubus_stats_t *stats = shm_zone->data;
+
+  if (ostats) {
+    stats->sh = ostats->sh;
+    stats->shpool = ostats->shpool;
+    return NGX_OK;
+  }
+
+  stats->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+  if (shm_zone->shm.exists) {
+    stats->sh = stats->shpool->data;
+    return NGX_OK;
+  }
+
+  stats->sh = ngx_slab_calloc(stats->shpool, sizeof(ubus_stats_sh_t));
+  if (stats->sh == NULL)
+    return NGX_ERROR;
+
+  stats->shpool->data = stats->sh;
+
+  ngx_rbtree_init(&stats->sh->rbtree, &stats->sh->sentinel,
+                  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&stats->sh->nodes);
+
+  len = sizeof(" in ubus stats zone \"\"") + shm_zone->shm.name.len;
+
+  stats->shpool->log_ctx = ngx_slab_alloc(stats->shpool, len);
+  if (stats->shpool->log_ctx == NULL)
+    return NGX_ERROR;
+
+  ngx_sprintf(stats->shpool->log_ctx, " in ubus stats zone \"%V\"%Z",
+              &shm_zone->shm.name);
+
+  // Methods not fitting anymore are only counted as dropped
+  stats->shpool->log_nomem = 0;
+
+  return NGX_OK;
+}
+
+ngx_shm_zone_t *ubus_stats_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                    size_t size, void *tag) {
+  ubus_stats_t *stats;
+  ngx_shm_zone_t *shm_zone;
+
+  shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+  if (shm_zone == NULL)
+    return NULL;
+
+  if (shm_zone->data)
+    return shm_zone;
+
+  stats = ngx_pcalloc(cf->pool, sizeof(ubus_stats_t));
+  if (stats == NULL)
+    return NULL;
+
+  shm_zone->init = ubus_stats_init_zone;
+  shm_zone->data = stats;
+
+  return shm_zone;
+}
+
+uint64_t ubus_stats_now(void) {
+  struct timespec ts;
+
+  // The cached nginx time doesn't move while a worker blocks on ubus
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static ubus_stats_node_t *ubus_stats_node(ubus_stats_t *stats,
+                                          const char *object,
+                                          const char *method) {
+  ngx_str_t key;
+  uint32_t hash;
+  u_char buf[256];
+  size_t object_len, method_len;
+  ubus_stats_node_t *node;
+
+  object_len = strlen(object) + 1;
+  method_len = strlen(method) + 1;
+
+  if (object_len + method_len > sizeof(buf))
+    return NULL;
+
+  ngx_memcpy(buf, object, object_len);
+  ngx_memcpy(buf + object_len, method, method_len);
+
+  key.data = buf;
+  key.len = object_len + method_len;
+
+  hash = ngx_crc32_short(key.data, key.len);
+
+  node = (ubus_stats_node_t *)ngx_str_rbtree_lookup(&stats->sh->rbtree, &key,
+                                                    hash);
+  if (node)
+    return node;
+
+  node = ngx_slab_calloc_locked(stats->shpool,
+                                offsetof(ubus_stats_node_t, data) + key.len);
+  if (node == NULL)
+    return NULL;
+
+  ngx_memcpy(node->data, key.data, key.len);
+
+  node->sn.node.key = hash;
+  node->sn.str.data = node->data;
+  node->sn.str.len = key.len;
+  node->object_len = object_len - 1;
+
+  ngx_rbtree_insert(&stats->sh->rbtree, &node->sn.node);
+  ngx_queue_insert_tail(&stats->sh->nodes, &node->queue);
+
+  return node;
+}
+
+void ubus_stats_call(ngx_shm_zone_t *zone, const char *object,
+                     const char *method, enum rpc_status rc, int ret,
+                     uint64_t usec) {
+  ngx_uint_t i;
+  ubus_stats_node_t *node;
+  ubus_stats_t *stats = zone->data;
+
+  ngx_shmtx_lock(&stats->shpool->mutex);
+
+  stats->sh->status[rc]++;
+
+  // Only calls that made it to an object are tracked per method
+  if (!object || !method)
+    goto out;
+
+  node = ubus_stats_node(stats, object, method);
+  if (node == NULL) {
+    stats->sh->dropped++;
+    goto out;
+  }
+
+  for (i = 0; i < UBUS_STATS_LATENCY_BUCKETS - 1; i++)
+    if (usec <= ubus_stats_latency_le[i])
+      break;
+
+  node->calls++;
+  node->latency[i]++;
+  node->latency_sum += usec;
+
+  if (rc != REQUEST_OK || ret != 0)
+    node->errors++;
+
+  if (rc == ERROR_TIMEOUT || ret == UBUS_STATUS_TIMEOUT)
+    node->timeouts++;
+
+out:
+  ngx_shmtx_unlock(&stats->shpool->mutex);
+}
+
+void ubus_stats_batch(ngx_shm_zone_t *zone, ngx_uint_t len) {
+  ngx_uint_t i;
+  ubus_stats_t *stats = zone->data;
+
+  for (i = 0; i < UBUS_STATS_BATCH_BUCKETS - 1; i++)
+    if (len <= ubus_stats_batch_le[i])
+      break;
+
+  ngx_shmtx_lock(&stats->shpool->mutex);
+
+  stats->sh->batch[i]++;
+  stats->sh->batch_sum += len;
+
+  ngx_shmtx_unlock(&stats->shpool->mutex);
+}
+
+void ubus_stats_connect_failure(ngx_shm_zone_t *zone) {
+  ubus_stats_t *stats = zone->data;
+
+  ngx_shmtx_lock(&stats->shpool->mutex);
+  stats->sh->connect_failures++;
+  ngx_shmtx_unlock(&stats->shpool->mutex);
+}
+
+#define ubus_stats_str(w, s) ubus_writer_write(w, s, sizeof(s) - 1)
+
+static void ubus_stats_printf(ubus_writer_t *w, const char *fmt, ...) {
+  int len;
+  char line[256];
+  va_list args;
+
+  va_start(args, fmt);
+  len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+
+  if (len > 0)
+    ubus_writer_write(w, line, ngx_min((size_t)len, sizeof(line) - 1));
+}
+
+// Object names are plain ubus paths, only quotes, backslashes and new
+// lines need escaping in label values
+static void ubus_stats_label(ubus_writer_t *w, const char *name,
+                             const char *value) {
+  const char *run;
+
+  ubus_stats_printf(w, "%s=\"", name);
+
+  for (run = value; *value; value++) {
+    if (*value != '"' && *value != '\\' && *value != '\n')
+      continue;
+
+    ubus_writer_write(w, run, value - run);
+
+    if (*value == '\n') {
+      ubus_stats_str(w, "\\n");
+      run = value + 1;
+    } else {
+      ubus_stats_str(w, "\\");
+      run = value;
+    }
+  }
+
+  ubus_writer_write(w, run, value - run);
+  ubus_stats_str(w, "\"");
+}
+
+static void ubus_stats_node_labels(ubus_writer_t *w, ubus_stats_node_t *node) {
+  ubus_stats_label(w, "object", (char *)node->data);
+  ubus_stats_str(w, ",");
+  ubus_stats_label(w, "method", (char *)node->data + node->object_len + 1);
+}
+
+static void ubus_stats_prometheus(ubus_stats_sh_t *sh, ubus_writer_t *w) {
+  ngx_uint_t i;
+  uint64_t count;
+  ngx_queue_t *q;
+  ubus_stats_node_t *node;
+
+  ubus_stats_printf(w, "# TYPE nginx_ubus_requests_total counter\n");
+  for (i = 0; i < __ERROR_MAX; i++)
+    ubus_stats_printf(w,
+                      "nginx_ubus_requests_total{status=\"%s\"} %" PRIu64
+                      "\n",
+                      ubus_stats_status[i], sh->status[i]);
+
+  ubus_stats_printf(w, "# TYPE nginx_ubus_connect_failures_total counter\n");
+  ubus_stats_printf(w, "nginx_ubus_connect_failures_total %" PRIu64 "\n",
+                    sh->connect_failures);
+
+  ubus_stats_printf(w, "# TYPE nginx_ubus_stats_dropped_total counter\n");
+  ubus_stats_printf(w, "nginx_ubus_stats_dropped_total %" PRIu64 "\n",
+                    sh->dropped);
+
+  ubus_stats_printf(w, "# TYPE nginx_ubus_batch_size histogram\n");
+  for (i = 0, count = 0; i < UBUS_STATS_BATCH_BUCKETS; i++) {
+    count += sh->batch[i];
+    if (i < UBUS_STATS_BATCH_BUCKETS - 1)
+      ubus_stats_printf(w, "nginx_ubus_batch_size_bucket{le=\"%lu\"} %" PRIu64
+                           "\n",
+                        (unsigned long)ubus_stats_batch_le[i], count);
+    else
+      ubus_stats_printf(w, "nginx_ubus_batch_size_bucket{le=\"+Inf\"} %" PRIu64
+                           "\n",
+                        count);
+  }
+  ubus_stats_printf(w, "nginx_ubus_batch_size_sum %" PRIu64 "\n",
+                    sh->batch_sum);
+  ubus_stats_printf(w, "nginx_ubus_batch_size_count %" PRIu64 "\n", count);
+
+  ubus_stats_printf(w, "# TYPE nginx_ubus_calls_total counter\n");
+  ubus_stats_printf(w, "# TYPE nginx_ubus_call_errors_total counter\n");
+  ubus_stats_printf(w, "# TYPE nginx_ubus_call_timeouts_total counter\n");
+  ubus_stats_printf(w, "# TYPE nginx_ubus_call_duration_seconds histogram\n");
+
+  for (q = ngx_queue_head(&sh->nodes); q != ngx_queue_sentinel(&sh->nodes);
+       q = ngx_queue_next(q)) {
+    node = ngx_queue_data(q, ubus_stats_node_t, queue);
+
+    ubus_stats_str(w, "nginx_ubus_calls_total{");
+    ubus_stats_node_labels(w, node);
+    ubus_stats_printf(w, "} %" PRIu64 "\n", node->calls);
+
+    ubus_stats_str(w, "nginx_ubus_call_errors_total{");
+    ubus_stats_node_labels(w, node);
+    ubus_stats_printf(w, "} %" PRIu64 "\n", node->errors);
+
+    ubus_stats_str(w, "nginx_ubus_call_timeouts_total{");
+    ubus_stats_node_labels(w, node);
+    ubus_stats_printf(w, "} %" PRIu64 "\n", node->timeouts);
+
+    for (i = 0, count = 0; i < UBUS_STATS_LATENCY_BUCKETS; i++) {
+      count += node->latency[i];
+
+      ubus_stats_str(w, "nginx_ubus_call_duration_seconds_bucket{");
+      ubus_stats_node_labels(w, node);
+
+      if (i < UBUS_STATS_LATENCY_BUCKETS - 1)
+        ubus_stats_printf(w, ",le=\"%g\"} %" PRIu64 "\n",
+                          ubus_stats_latency_le[i] / 1e6, count);
+      else
+        ubus_stats_printf(w, ",le=\"+Inf\"} %" PRIu64 "\n", count);
+    }
+
+    ubus_stats_str(w, "nginx_ubus_call_duration_seconds_sum{");
+    ubus_stats_node_labels(w, node);
+    ubus_stats_printf(w, "} %.6f\n", node->latency_sum / 1e6);
+
+    ubus_stats_str(w, "nginx_ubus_call_duration_seconds_count{");
+    ubus_stats_node_labels(w, node);
+    ubus_stats_printf(w, "} %" PRIu64 "\n", node->calls);
+  }
+}
+
+static void ubus_stats_json(ubus_stats_sh_t *sh, ubus_writer_t *w) {
+  ngx_uint_t i;
+  ngx_queue_t *q;
+  ubus_stats_node_t *node;
+
+  ubus_stats_printf(w, "{\"connect_failures\":%" PRIu64 ",\"dropped\":%" PRIu64
+                       ",\"requests\":{",
+                    sh->connect_failures, sh->dropped);
+
+  for (i = 0; i < __ERROR_MAX; i++)
+    ubus_stats_printf(w, "%s\"%s\":%" PRIu64, i ? "," : "",
+                      ubus_stats_status[i], sh->status[i]);
+
+  ubus_stats_str(w, "},\"batch_size\":{\"le\":[");
+  for (i = 0; i < UBUS_STATS_BATCH_BUCKETS - 1; i++)
+    ubus_stats_printf(w, "%s%lu", i ? "," : "",
+                      (unsigned long)ubus_stats_batch_le[i]);
+
+  ubus_stats_str(w, "],\"counts\":[");
+  for (i = 0; i < UBUS_STATS_BATCH_BUCKETS; i++)
+    ubus_stats_printf(w, "%s%" PRIu64, i ? "," : "", sh->batch[i]);
+
+  ubus_stats_printf(w, "],\"sum\":%" PRIu64 "},\"latency_le_us\":[",
+                    sh->batch_sum);
+  for (i = 0; i < UBUS_STATS_LATENCY_BUCKETS - 1; i++)
+    ubus_stats_printf(w, "%s%" PRIu64, i ? "," : "", ubus_stats_latency_le[i]);
+
+  ubus_stats_str(w, "],\"calls\":[");
+
+  for (q = ngx_queue_head(&sh->nodes); q != ngx_queue_sentinel(&sh->nodes);
+       q = ngx_queue_next(q)) {
+    node = ngx_queue_data(q, ubus_stats_node_t, queue);
+
+    if (q != ngx_queue_head(&sh->nodes))
+      ubus_stats_str(w, ",");
+
+    ubus_stats_str(w, "{\"object\":");
+    ubus_writer_string(w, (char *)node->data);
+    ubus_stats_str(w, ",\"method\":");
+    ubus_writer_string(w, (char *)node->data + node->object_len + 1);
+
+    ubus_stats_printf(w,
+                      ",\"calls\":%" PRIu64 ",\"errors\":%" PRIu64
+                      ",\"timeouts\":%" PRIu64 ",\"latency_sum_us\":%" PRIu64
+                      ",\"latency\":[",
+                      node->calls, node->errors, node->timeouts,
+                      node->latency_sum);
+
+    for (i = 0; i < UBUS_STATS_LATENCY_BUCKETS; i++)
+      ubus_stats_printf(w, "%s%" PRIu64, i ? "," : "", node->latency[i]);
+
+    ubus_stats_str(w, "]}");
+  }
+
+  ubus_stats_str(w, "]}\n");
+}
+
+void ubus_stats_write(ngx_shm_zone_t *zone, ubus_writer_t *w,
+                      bool prometheus) {
+  ubus_stats_t *stats = zone->data;
+
+  ngx_shmtx_lock(&stats->shpool->mutex);
+
+  if (prometheus)
+    ubus_stats_prometheus(stats->sh, w);
+  else
+    ubus_stats_json(stats->sh, w);
+
+  ngx_shmtx_unlock(&stats->shpool->mutex);
+}
@@ -8,6 +8,8 @@
 
 #include <ubus_utility.h>
 
+#include <fnmatch.h>
+
 bool parse_json_rpc(struct rpc_data *d, struct blob_attr *data) {
   const struct blobmsg_policy data_policy[] = {
       {.type = BLOBMSG_TYPE_STRING},
@@ -19,7 +21,8 @@ bool parse_json_rpc(struct rpc_data *d, struct blob_attr *data) {
   struct blob_attr *tb2[4];
   struct blob_attr *cur;
 
-  blobmsg_parse(rpc_policy, __RPC_MAX, tb, blob_data(data), blob_len(data));
+  blobmsg_parse(rpc_policy, __RPC_MAX, tb, blobmsg_data(data),
+                blobmsg_data_len(data));
 
   cur = tb[RPC_JSONRPC];
   if (!cur || strcmp(blobmsg_data(cur), "2.0") != 0)
@@ -36,9 +39,7 @@ bool parse_json_rpc(struct rpc_data *d, struct blob_attr *data) {
   if (!cur)
     return true;
 
-  d->params = blob_memdup(cur);
-  if (!d->params)
-    return false;
+  d->params = cur;
 
   blobmsg_parse_array(data_policy, ARRAY_SIZE(data_policy), tb2,
                       blobmsg_data(d->params), blobmsg_data_len(d->params));
@@ -60,33 +61,33 @@ bool parse_json_rpc(struct rpc_data *d, struct blob_attr *data) {
   return true;
 }
 
-void ubus_init_response(struct blob_buf *buf, struct dispatch_ubus *du) {
-  struct json_object *obj = du->jsobj_cur, *obj2 = NULL;
-
+void ubus_init_response(struct blob_buf *buf, struct blob_attr *id) {
   blob_buf_init(buf, 0);
   blobmsg_add_string(buf, "jsonrpc", "2.0");
 
-  if (obj)
-    json_object_object_get_ex(obj, "id", &obj2);
-
-  if (obj2)
-    blobmsg_add_json_element(buf, "id", obj2);
+  if (id)
+    blobmsg_add_field(buf, blobmsg_type(id), "id", blobmsg_data(id),
+                      blobmsg_data_len(id));
   else
     blobmsg_add_field(buf, BLOBMSG_TYPE_UNSPEC, "id", NULL, 0);
 }
 
+bool ubus_parse_allowed(struct blob_attr *msg) {
+  struct blob_attr *tb[__SES_MAX];
+
+  blobmsg_parse(ses_policy, __SES_MAX, tb, blob_data(msg), blob_len(msg));
+
+  return tb[SES_ACCESS] && blobmsg_get_bool(tb[SES_ACCESS]);
+}
+
 void ubus_allowed_cb(struct ubus_request *req, int type,
                      struct blob_attr *msg) {
-  struct blob_attr *tb[__SES_MAX];
   bool *allow = (bool *)req->priv;
 
   if (!msg)
     return;
 
-  blobmsg_parse(ses_policy, __SES_MAX, tb, blob_data(msg), blob_len(msg));
-
-  if (tb[SES_ACCESS])
-    *allow = blobmsg_get_bool(tb[SES_ACCESS]);
+  *allow = ubus_parse_allowed(msg);
 }
 
 void ubus_request_cb(struct ubus_request *req, int type,
@@ -154,3 +155,186 @@ void ubus_close_fds(struct ubus_context *ctx) {
   close(ctx->sock.fd);
   ctx->sock.fd = -1;
 }
+
+static ngx_uint_t ubus_rule_pattern(ngx_str_t *pattern, ngx_uint_t exact,
+                                    ngx_uint_t any) {
+  if (pattern->len == 1 && pattern->data[0] == '*')
+    return any;
+
+  if (!strpbrk((char *)pattern->data, "*?[\\"))
+    return exact;
+
+  return 0;
+}
+
+char *ubus_rule_add(ngx_conf_t *cf, ubus_rules_t **rules, ngx_str_t *object,
+                    ngx_str_t *method, ngx_uint_t value, ngx_uint_t flags) {
+  ubus_rule_t *rule;
+
+  if (*rules == NULL || *rules == NGX_CONF_UNSET_PTR) {
+    *rules = ngx_pcalloc(cf->pool, sizeof(ubus_rules_t));
+    if (*rules == NULL)
+      return NGX_CONF_ERROR;
+
+    if (ngx_array_init(&(*rules)->rules, cf->pool, 4, sizeof(ubus_rule_t)) !=
+        NGX_OK)
+      return NGX_CONF_ERROR;
+  }
+
+  rule = ngx_array_push(&(*rules)->rules);
+  if (rule == NULL)
+    return NGX_CONF_ERROR;
+
+  rule->object = *object;
+  rule->method = *method;
+  rule->value = value;
+  rule->flags = flags;
+  rule->next = NULL;
+
+  // Most patterns are plain names or "*", keep fnmatch for the others
+  rule->flags |= ubus_rule_pattern(object, UBUS_RULE_OBJECT_EXACT,
+                                   UBUS_RULE_OBJECT_ANY);
+  rule->flags |= ubus_rule_pattern(method, UBUS_RULE_METHOD_EXACT,
+                                   UBUS_RULE_METHOD_ANY);
+
+  (*rules)->flags |= flags;
+
+  return NGX_CONF_OK;
+}
+
+static bool ubus_rule_hashed(ubus_rule_t *rule) {
+  return (rule->flags & UBUS_RULE_OBJECT_EXACT) &&
+         (rule->flags & (UBUS_RULE_METHOD_EXACT | UBUS_RULE_METHOD_ANY));
+}
+
+static ngx_uint_t ubus_rule_hash(ubus_rules_t *rules, const char *object,
+                                 const char *method) {
+  ngx_uint_t key = 0;
+
+  while (*object)
+    key = ngx_hash(key, (u_char)*object++);
+
+  key = ngx_hash(key, '\n');
+
+  while (*method)
+    key = ngx_hash(key, (u_char)*method++);
+
+  return key % rules->nbuckets;
+}
+
+// Called once the location is merged, rules inherited from the enclosing
+// location are already set up
+char *ubus_rules_init(ngx_conf_t *cf, ubus_rules_t *rules) {
+  ngx_uint_t i, n = 0;
+  const char *method;
+  ubus_rule_t *rule, **slot;
+
+  if (rules == NULL || rules->ready)
+    return NGX_CONF_OK;
+
+  rules->ready = 1;
+
+  if (ngx_array_init(&rules->wildcards, cf->pool, 4, sizeof(ubus_rule_t *)) !=
+      NGX_OK)
+    return NGX_CONF_ERROR;
+
+  rule = rules->rules.elts;
+  for (i = 0; i < rules->rules.nelts; i++) {
+    if (ubus_rule_hashed(&rule[i]))
+      n++;
+  }
+
+  rules->nbuckets = ngx_max(n, 1);
+  rules->buckets =
+      ngx_pcalloc(cf->pool, rules->nbuckets * sizeof(ubus_rule_t *));
+  if (rules->buckets == NULL)
+    return NGX_CONF_ERROR;
+
+  for (i = 0; i < rules->rules.nelts; i++) {
+    if (!ubus_rule_hashed(&rule[i])) {
+      slot = ngx_array_push(&rules->wildcards);
+      if (slot == NULL)
+        return NGX_CONF_ERROR;
+
+      *slot = &rule[i];
+      continue;
+    }
+
+    method = (rule[i].flags & UBUS_RULE_METHOD_ANY)
+                 ? "*"
+                 : (char *)rule[i].method.data;
+
+    // Appended so that the first of rules with the same names is found
+    slot = &rules->buckets[ubus_rule_hash(rules, (char *)rule[i].object.data,
+                                          method)];
+    while (*slot)
+      slot = &(*slot)->next;
+
+    *slot = &rule[i];
+  }
+
+  return NGX_CONF_OK;
+}
+
+static ubus_rule_t *ubus_rule_find(ubus_rules_t *rules, const char *object,
+                                   const char *method, ngx_uint_t any) {
+  ubus_rule_t *rule;
+
+  rule = rules->buckets[ubus_rule_hash(rules, object, any ? "*" : method)];
+
+  for (; rule; rule = rule->next) {
+    if (strcmp((char *)rule->object.data, object))
+      continue;
+
+    if (any) {
+      if (rule->flags & UBUS_RULE_METHOD_ANY)
+        return rule;
+    } else if ((rule->flags & UBUS_RULE_METHOD_EXACT) &&
+               !strcmp((char *)rule->method.data, method)) {
+      return rule;
+    }
+  }
+
+  return NULL;
+}
+
+static bool ubus_rule_test(ngx_str_t *pattern, const char *str,
+                           ngx_uint_t flags, ngx_uint_t exact, ngx_uint_t any) {
+  if (flags & any)
+    return true;
+
+  if (flags & exact)
+    return !strcmp((char *)pattern->data, str);
+
+  return !fnmatch((char *)pattern->data, str, 0);
+}
+
+ubus_rule_t *ubus_rule_match(ubus_rules_t *rules, const char *object,
+                             const char *method) {
+  ngx_uint_t i;
+  ubus_rule_t *rule, *any, **wildcard;
+
+  if (rules == NULL || rules == NGX_CONF_UNSET_PTR)
+    return NULL;
+
+  // Rules are checked in configuration order and the first match wins,
+  // patterns only matter when written before the hashed match
+  rule = ubus_rule_find(rules, object, method, 0);
+  any = ubus_rule_find(rules, object, method, 1);
+  if (any && (!rule || any < rule))
+    rule = any;
+
+  wildcard = rules->wildcards.elts;
+  for (i = 0; i < rules->wildcards.nelts; i++) {
+    if (rule && wildcard[i] > rule)
+      break;
+
+    if (ubus_rule_test(&wildcard[i]->object, object, wildcard[i]->flags,
+                       UBUS_RULE_OBJECT_EXACT, UBUS_RULE_OBJECT_ANY) &&
+        ubus_rule_test(&wildcard[i]->method, method, wildcard[i]->flags,
+                       UBUS_RULE_METHOD_EXACT, UBUS_RULE_METHOD_ANY))
+      return wildcard[i];
+  }
+
+  return rule;
+}
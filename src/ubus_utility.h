@@ -22,41 +22,427 @@
 #include <semaphore.h>
 
 #include <libubus.h>
-#include <json-c/json.h>
 
-#define UBUS_MAX_POST_SIZE 65536
+#define UBUS_DEFAULT_MAX_BODY_SIZE 65536
 #define UBUS_DEFAULT_SID "00000000000000000000000000000000"
+#define UBUS_RECONNECT_INTERVAL 1000
+#define UBUS_OUTPUT_BLOCK_SIZE 4096
+#define UBUS_BODY_BLOCK_SIZE 8192
+#define UBUS_PARSER_MAX_DEPTH 32
+#define UBUS_COALESCE_POLL 5
+#define UBUS_COALESCE_LINGER 100
+#define UBUS_EVENTS_PING 30000
+#define UBUS_EVENTS_BACKLOG 65536
+#define UBUS_LIMIT_POLL 10
+#define UBUS_WRITER_MAX_DEPTH 4
+
+enum {
+  UBUS_STREAM_OFF,
+  UBUS_STREAM_ORDERED,
+  UBUS_STREAM_UNORDERED,
+};
+
+// Encodings of request and response bodies
+enum {
+  UBUS_FORMAT_JSON,
+  UBUS_FORMAT_BLOBMSG,
+  UBUS_FORMAT_MSGPACK,
+};
+
+// Phases of a request reported with Server-Timing
+enum {
+  UBUS_TIMING_READ,
+  UBUS_TIMING_PARSE,
+  UBUS_TIMING_CONNECT,
+  UBUS_TIMING_LOOKUP,
+  UBUS_TIMING_ACL,
+  UBUS_TIMING_INVOKE,
+  UBUS_TIMING_SERIALIZE,
+  UBUS_TIMING_OUTPUT,
+  __UBUS_TIMING_MAX
+};
+
+typedef struct ubus_pool_s ubus_pool_t;
+
+typedef struct {
+  struct ubus_context ctx;
+  ubus_pool_t *pool;
+  ngx_connection_t *c;
+  ngx_queue_t queue;
+  unsigned initialized : 1;
+  unsigned busy : 1;
+  unsigned temporary : 1;
+  unsigned dispatching : 1;
+  unsigned watch : 1;
+  unsigned suspended : 1;
+  unsigned lost : 1;
+} ubus_conn_t;
+
+typedef struct {
+  ubus_conn_t *conn;
+  sem_t sem;
+  ngx_uint_t inflight;
+} ubus_shard_t;
+
+typedef struct {
+  struct avl_node avl;
+  uint32_t id;
+  char path[];
+} ubus_object_entry_t;
+
+typedef struct ubus_subscriber_s ubus_subscriber_t;
+
+typedef void (*ubus_subscriber_handler_t)(ubus_subscriber_t *s,
+                                          const char *type,
+                                          struct blob_attr *msg);
+
+// Gets the ubus events with a type matching pattern, all of them are fed
+// from the single event handler of the pool
+struct ubus_subscriber_s {
+  ngx_queue_t queue;
+  const char *pattern;
+  ubus_subscriber_handler_t handler;
+  void *data;
+};
+
+typedef struct {
+  struct avl_node avl;
+  char *json;
+  size_t len;
+  char key[];
+} ubus_list_entry_t;
+
+// Object and function patterns granted to a session in the "ubus" scope,
+// as pairs in grants
+typedef struct {
+  struct avl_node avl;
+  ngx_msec_t expire;
+  ngx_msec_t refresh;
+  ngx_uint_t ngrants;
+  const char **grants;
+  char sid[];
+} ubus_acl_entry_t;
+
+// Container left open by the writer, its header is completed on close
+// when the encoding needs the length or the member count up front
+typedef struct {
+  u_char *hdr;
+  size_t start;
+  ngx_uint_t count;
+  bool table;
+} ubus_writer_level_t;
+
+typedef struct {
+  ngx_pool_t *pool;
+  ngx_chain_t *first;
+  ngx_chain_t **last;
+  ngx_buf_t *buf;
+  ngx_chain_t **free;
+  size_t len;
+  ngx_uint_t format;
+  int depth;
+  ubus_writer_level_t stack[UBUS_WRITER_MAX_DEPTH];
+  unsigned error : 1;
+} ubus_writer_t;
+
+enum ubus_parser_state {
+  UBUS_PARSER_VALUE,
+  UBUS_PARSER_ARRAY_START,
+  UBUS_PARSER_OBJECT_START,
+  UBUS_PARSER_KEY,
+  UBUS_PARSER_COLON,
+  UBUS_PARSER_NEXT,
+  UBUS_PARSER_STRING,
+  UBUS_PARSER_ESCAPE,
+  UBUS_PARSER_UNICODE,
+  UBUS_PARSER_NUMBER,
+  UBUS_PARSER_LITERAL,
+  UBUS_PARSER_DONE,
+  UBUS_PARSER_ERROR,
+};
+
+typedef struct {
+  struct blob_buf buf;
+  ngx_uint_t format;
+  enum ubus_parser_state state;
+  int depth;
+  struct {
+    void *cookie;
+    bool array;
+  } stack[UBUS_PARSER_MAX_DEPTH];
+  char *str;
+  size_t str_len;
+  size_t str_size;
+  char *key;
+  size_t key_size;
+  bool is_key;
+  uint32_t unicode;
+  int unicode_len;
+  uint32_t surrogate;
+  int literal;
+  int literal_pos;
+} ubus_parser_t;
+
+#define UBUS_RULE_SHARED 0x01
+#define UBUS_RULE_DENY 0x02
+#define UBUS_RULE_ALLOW 0x04
+
+// Set by ubus_rule_add for patterns without wildcards or matching anything
+#define UBUS_RULE_OBJECT_EXACT 0x10
+#define UBUS_RULE_OBJECT_ANY 0x20
+#define UBUS_RULE_METHOD_EXACT 0x40
+#define UBUS_RULE_METHOD_ANY 0x80
+
+typedef struct ubus_rule_s ubus_rule_t;
+
+struct ubus_rule_s {
+  ngx_str_t object;
+  ngx_str_t method;
+  ngx_uint_t value;
+  ngx_uint_t flags;
+  ubus_rule_t *next;
+};
+
+// Rules in configuration order. ubus_rules_init puts the ones with a plain
+// object and a plain method or "*" in hash buckets, the others are matched
+// with fnmatch from wildcards.
+typedef struct {
+  ngx_array_t rules;
+  ngx_array_t wildcards;
+  ubus_rule_t **buckets;
+  ngx_uint_t nbuckets;
+  ngx_uint_t flags;
+  unsigned ready : 1;
+} ubus_rules_t;
+
+typedef struct {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t lru;
+} ubus_cache_sh_t;
+
+typedef struct {
+  ubus_cache_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ubus_cache_t;
+
+typedef struct {
+  ngx_str_node_t sn;
+  ngx_queue_t queue;
+  ngx_msec_t expire;
+  size_t len;
+  unsigned pending : 1;
+  u_char data[];
+} ubus_cache_node_t;
+
+// Call in flight in the worker, identical calls wait in waiters for its
+// result instead of being sent
+typedef struct {
+  ngx_str_node_t sn;
+  ngx_queue_t waiters;
+  u_char key[];
+} ubus_flight_t;
+
+#define UBUS_LIMIT_GLOBAL 0x01
+#define UBUS_LIMIT_SESSION 0x02
+#define UBUS_LIMIT_OBJECT 0x04
+
+// Calls in flight allowed at once, 0 for no limit
+typedef struct {
+  ngx_uint_t global;
+  ngx_uint_t session;
+  ngx_uint_t object;
+} ubus_limits_t;
+
+typedef struct {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_uint_t inflight;
+  ngx_uint_t waiting;
+} ubus_limit_sh_t;
+
+typedef struct {
+  ubus_limit_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ubus_limit_t;
+
+typedef struct {
+  ngx_str_node_t sn;
+  ngx_uint_t inflight;
+  u_char data[];
+} ubus_limit_node_t;
+
+#define UBUS_STATS_LATENCY_BUCKETS 12
+#define UBUS_STATS_BATCH_BUCKETS 8
+
+typedef struct {
+  ngx_str_node_t sn;
+  ngx_queue_t queue;
+  size_t object_len;
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t timeouts;
+  uint64_t latency_sum;
+  uint64_t latency[UBUS_STATS_LATENCY_BUCKETS];
+  u_char data[];
+} ubus_stats_node_t;
+
+typedef struct ubus_stats_sh_s ubus_stats_sh_t;
+
+typedef struct {
+  ubus_stats_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ubus_stats_t;
+
+struct ubus_pool_s {
+  ngx_str_t socket_path;
+  ngx_uint_t size;
+  ubus_conn_t *conns;
+  ngx_queue_t free;
+  ngx_event_t reconnect;
+  ngx_log_t *log;
+
+  // Dedicated connection receiving ubusd object registry events
+  ubus_conn_t *watch;
+
+  // Dedicated connection for blocking lookups in async mode
+  ubus_conn_t *lookup;
+  struct ubus_event_handler object_event;
+  struct ubus_event_handler session_event;
+  struct ubus_event_handler any_event;
+  ngx_queue_t subscribers;
+
+  struct avl_tree objects;
+  struct avl_tree lists;
+  struct avl_tree acls;
+  pthread_mutex_t lock;
+
+  ngx_rbtree_t flights;
+  ngx_rbtree_node_t flights_sentinel;
+
+  unsigned down : 1;
+  unsigned watching : 1;
+  unsigned cache_objects : 1;
+  unsigned cache_lists : 1;
+  unsigned cache_acls : 1;
+  unsigned events : 1;
+};
 
 struct dispatch_ubus {
   struct ubus_request req;
 
-  struct json_tokener *jstok;
-  struct json_object *jsobj;
-  struct json_object *jsobj_cur;
-
   uint32_t obj;
   const char *func;
 
   struct blob_buf *buf;
+  struct blob_buf *req_buf;
 };
 
+struct rpc_data {
+  struct blob_attr *id;
+  const char *sid;
+  const char *method;
+  const char *object;
+  const char *function;
+  struct blob_attr *data;
+  struct blob_attr *params;
+};
+
+enum rpc_status {
+  REQUEST_OK,
+  ERROR_PARSE,
+  ERROR_REQUEST,
+  ERROR_METHOD,
+  ERROR_PARAMS,
+  ERROR_INTERNAL,
+  ERROR_OBJECT,
+  ERROR_SESSION,
+  ERROR_ACCESS,
+  ERROR_TIMEOUT,
+  ERROR_BUSY,
+  __ERROR_MAX
+};
+
+struct ubus_stats_sh_s {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t nodes;
+  uint64_t status[__ERROR_MAX];
+  uint64_t batch[UBUS_STATS_BATCH_BUCKETS];
+  uint64_t batch_sum;
+  uint64_t connect_failures;
+  uint64_t dropped;
+};
+
+// What a call of the request did, kept for the log variables
+typedef struct {
+  const char *method;
+  const char *object;
+  const char *function;
+  enum rpc_status status;
+  uint64_t usec;
+  uint64_t timing[__UBUS_TIMING_MAX];
+  bool done;
+} ubus_call_log_t;
+
 typedef struct {
   ngx_http_request_t *r;
-  int res_len;
-  ngx_chain_t *out_chain;
-  ngx_chain_t *out_chain_start;
-  struct ubus_context *ubus_ctx;
-  char **array_res;
+  ngx_uint_t format;
+  ubus_writer_t out;
+  ubus_conn_t *conn;
+  ubus_shard_t *shards;
+  ngx_uint_t nshards;
+  ubus_parser_t parser;
+  struct blob_attr *body;
+  struct blob_attr *array_cur;
+  int array_rem;
+  ubus_writer_t *array_res;
+  int array_flushed;
+  ngx_chain_t *free;
+  ngx_chain_t *busy;
+  ngx_int_t stream_rc;
   sem_t *sem;
+  bool array;
+  int array_len;
+  int array_next;
+  ngx_int_t pending;
+  ngx_int_t running;
+  enum rpc_status status;
+  ubus_call_log_t *calls;
+  ubus_call_log_t call;
+  uint64_t timing[__UBUS_TIMING_MAX];
+  uint64_t deadline;
+  unsigned waiting : 1;
+  unsigned timed : 1;
+  unsigned streaming : 1;
 } request_ctx_t;
 
 typedef struct {
+  ngx_pool_t *pool;
   struct blob_buf *buf;
   struct dispatch_ubus *ubus;
-  struct json_object *obj;
+  struct blob_attr *obj;
   bool array;
   int index;
   request_ctx_t *request;
+  ubus_shard_t *shard;
+  struct rpc_data data;
+  bool allow;
+  ngx_event_t timeout;
+  ngx_str_t cache_key;
+  ngx_msec_t cache_ttl;
+  ubus_flight_t *flight;
+  ngx_queue_t flight_queue;
+  ngx_str_t flight_key;
+  ngx_msec_t flight_deadline;
+  bool flight_claimed;
+  ngx_uint_t limit_held;
+  ngx_msec_t limit_deadline;
+  bool limit_queued;
+  uint64_t start;
+  uint64_t mark;
+  uint64_t timing[__UBUS_TIMING_MAX];
+  int ret;
 } ubus_ctx_t;
 
 enum {
@@ -83,35 +469,11 @@ static const struct blobmsg_policy ses_policy[__SES_MAX] = {
     [SES_ACCESS] = {.name = "access", .type = BLOBMSG_TYPE_BOOL},
 };
 
-struct rpc_data {
-  struct blob_attr *id;
-  const char *sid;
-  const char *method;
-  const char *object;
-  const char *function;
-  struct blob_attr *data;
-  struct blob_attr *params;
-};
-
 struct list_data {
   bool verbose;
   struct blob_buf *buf;
 };
 
-enum rpc_status {
-  REQUEST_OK,
-  ERROR_PARSE,
-  ERROR_REQUEST,
-  ERROR_METHOD,
-  ERROR_PARAMS,
-  ERROR_INTERNAL,
-  ERROR_OBJECT,
-  ERROR_SESSION,
-  ERROR_ACCESS,
-  ERROR_TIMEOUT,
-  __ERROR_MAX
-};
-
 static const struct {
   int code;
   const char *msg;
@@ -126,14 +488,97 @@ static const struct {
     [ERROR_SESSION] = {-32001, "Session not found"},
     [ERROR_ACCESS] = {-32002, "Access denied"},
     [ERROR_TIMEOUT] = {-32003, "ubus request timed out"},
+    [ERROR_BUSY] = {-32004, "Server busy"},
 };
 
 bool parse_json_rpc(struct rpc_data *d, struct blob_attr *data);
-void ubus_init_response(struct blob_buf *buf, struct dispatch_ubus *du);
+void ubus_init_response(struct blob_buf *buf, struct blob_attr *id);
+bool ubus_parse_allowed(struct blob_attr *msg);
 void ubus_allowed_cb(struct ubus_request *req, int type, struct blob_attr *msg);
 void ubus_request_cb(struct ubus_request *req, int type, struct blob_attr *msg);
 void ubus_list_cb(struct ubus_context *ctx, struct ubus_object_data *obj,
                   void *priv);
 void ubus_close_fds(struct ubus_context *ctx);
+char *ubus_rule_add(ngx_conf_t *cf, ubus_rules_t **rules, ngx_str_t *object,
+                    ngx_str_t *method, ngx_uint_t value, ngx_uint_t flags);
+char *ubus_rules_init(ngx_conf_t *cf, ubus_rules_t *rules);
+ubus_rule_t *ubus_rule_match(ubus_rules_t *rules, const char *object,
+                             const char *method);
+
+void ubus_parser_init(ubus_parser_t *p);
+void ubus_parser_free(ubus_parser_t *p);
+ngx_int_t ubus_parser_feed(ubus_parser_t *p, const u_char *data, size_t len);
+struct blob_attr *ubus_parser_finish(ubus_parser_t *p);
+
+void ubus_writer_init(ubus_writer_t *w, ngx_pool_t *pool);
+void ubus_writer_reset(ubus_writer_t *w);
+void ubus_writer_write(ubus_writer_t *w, const void *data, size_t len);
+void ubus_writer_append(ubus_writer_t *w, ubus_writer_t *tail);
+void ubus_writer_string(ubus_writer_t *w, const char *str);
+void ubus_writer_value(ubus_writer_t *w, const char *name,
+                       struct blob_attr *attr);
+void ubus_writer_int(ubus_writer_t *w, const char *name, int32_t val);
+void ubus_writer_raw(ubus_writer_t *w, const char *name, const void *data,
+                     size_t len);
+void ubus_writer_array(ubus_writer_t *w, const char *name, ngx_int_t count);
+void ubus_writer_open(ubus_writer_t *w, struct blob_attr *head);
+void ubus_writer_close(ubus_writer_t *w);
+void ubus_writer_object(ubus_writer_t *w, struct blob_attr *head);
+
+ngx_shm_zone_t *ubus_cache_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                    size_t size, void *tag);
+ngx_int_t ubus_cache_key(ngx_pool_t *pool, ngx_str_t *key, const char *object,
+                         const char *method, const char *scope,
+                         struct blob_attr *args);
+ngx_int_t ubus_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key,
+                         struct blob_buf *buf);
+void ubus_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+                    struct blob_attr *data, ngx_msec_t ttl);
+ngx_int_t ubus_cache_claim(ngx_shm_zone_t *zone, ngx_str_t *key,
+                           ngx_msec_t timeout);
+void ubus_cache_release(ngx_shm_zone_t *zone, ngx_str_t *key);
+
+ngx_shm_zone_t *ubus_limit_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                    size_t size, void *tag);
+ngx_int_t ubus_limit_acquire(ngx_shm_zone_t *zone, ubus_limits_t *limits,
+                             const char *sid, const char *object,
+                             ngx_uint_t *held);
+void ubus_limit_release(ngx_shm_zone_t *zone, const char *sid,
+                        const char *object, ngx_uint_t held);
+ngx_int_t ubus_limit_enqueue(ngx_shm_zone_t *zone, ngx_uint_t max);
+void ubus_limit_dequeue(ngx_shm_zone_t *zone);
+
+ngx_shm_zone_t *ubus_stats_add_zone(ngx_conf_t *cf, ngx_str_t *name,
+                                    size_t size, void *tag);
+uint64_t ubus_stats_now(void);
+void ubus_stats_call(ngx_shm_zone_t *zone, const char *object,
+                     const char *method, enum rpc_status rc, int ret,
+                     uint64_t usec);
+void ubus_stats_batch(ngx_shm_zone_t *zone, ngx_uint_t len);
+void ubus_stats_connect_failure(ngx_shm_zone_t *zone);
+void ubus_stats_write(ngx_shm_zone_t *zone, ubus_writer_t *w, bool prometheus);
+
+ubus_pool_t *ubus_pool_add(ngx_conf_t *cf, ngx_array_t *pools,
+                           ngx_str_t *socket_path, ngx_uint_t size);
+ngx_int_t ubus_pool_init(ubus_pool_t *pool, ngx_cycle_t *cycle);
+void ubus_pool_exit(ubus_pool_t *pool);
+ubus_conn_t *ubus_pool_get(ubus_pool_t *pool, bool fallback);
+ubus_conn_t *ubus_pool_lookup_conn(ubus_pool_t *pool);
+void ubus_pool_release(ubus_conn_t *conn);
+void ubus_pool_suspend(ubus_conn_t *conn);
+void ubus_pool_resume(ubus_conn_t *conn);
+int ubus_pool_lookup_id(ubus_pool_t *pool, struct ubus_context *ctx,
+                        const char *path, uint32_t *id, bool cache);
+bool ubus_pool_list_get(ubus_pool_t *pool, const char *key,
+                        struct blob_attr *head, ubus_writer_t *w);
+void ubus_pool_list_set(ubus_pool_t *pool, const char *key, const char *json);
+ngx_int_t ubus_pool_acl_check(ubus_pool_t *pool, const char *sid,
+                              const char *object, const char *function);
+void ubus_pool_acl_set(ubus_pool_t *pool, const char *sid,
+                       struct blob_attr *session, ngx_msec_t ttl);
+void ubus_pool_subscribe(ubus_pool_t *pool, ubus_subscriber_t *s);
+void ubus_pool_unsubscribe(ubus_subscriber_t *s);
+
+extern ngx_module_t ngx_http_ubus_module;
 
 #endif /* NGINX_NGX_HTTP_UBUS_UTILITY_HEADERS_H */
@@ -0,0 +1,610 @@
+/*
+ *	BSD 3-Clause License
+ *
+ *	Copyright (c) 2019, Christian Marangi
+ * 	All rights reserved.
+ */
+
+#include <ubus_utility.h>
+
+#include <inttypes.h>
+
+void ubus_writer_init(ubus_writer_t *w, ngx_pool_t *pool) {
+  w->pool = pool;
+  w->first = NULL;
+  w->last = &w->first;
+  w->buf = NULL;
+  w->free = NULL;
+  w->len = 0;
+  w->format = UBUS_FORMAT_JSON;
+  w->depth = 0;
+  w->error = 0;
+}
+
+// The blocks were handed to the output chain, the next writes go to new
+// ones and the open containers are kept
+void ubus_writer_reset(ubus_writer_t *w) {
+  w->first = NULL;
+  w->last = &w->first;
+  w->buf = NULL;
+}
+
+static ngx_int_t ubus_writer_block(ubus_writer_t *w) {
+  ngx_buf_t *b;
+  ngx_chain_t *cl;
+
+  if (w->free && *w->free) {
+    cl = *w->free;
+    *w->free = cl->next;
+
+    b = cl->buf;
+    b->pos = b->start;
+    b->last = b->start;
+    b->flush = 0;
+    b->last_buf = 0;
+  } else {
+    b = ngx_create_temp_buf(w->pool, UBUS_OUTPUT_BLOCK_SIZE);
+    if (b == NULL)
+      goto error;
+
+    b->tag = (ngx_buf_tag_t)&ngx_http_ubus_module;
+
+    cl = ngx_alloc_chain_link(w->pool);
+    if (cl == NULL)
+      goto error;
+
+    cl->buf = b;
+  }
+
+  cl->next = NULL;
+
+  *w->last = cl;
+  w->last = &cl->next;
+  w->buf = b;
+
+  return NGX_OK;
+
+error:
+  w->error = 1;
+  return NGX_ERROR;
+}
+
+void ubus_writer_write(ubus_writer_t *w, const void *data, size_t len) {
+  size_t n;
+  const u_char *p = data;
+
+  while (len) {
+    if (!w->buf || w->buf->last == w->buf->end)
+      if (ubus_writer_block(w) != NGX_OK)
+        return;
+
+    n = ngx_min(len, (size_t)(w->buf->end - w->buf->last));
+
+    w->buf->last = ngx_cpymem(w->buf->last, p, n);
+    w->len += n;
+    p += n;
+    len -= n;
+  }
+}
+
+// Contiguous room for a header completed later, a new block is started
+// when the current one is too short
+static u_char *ubus_writer_alloc(ubus_writer_t *w, size_t len) {
+  u_char *p;
+
+  if (!w->buf || (size_t)(w->buf->end - w->buf->last) < len)
+    if (ubus_writer_block(w) != NGX_OK)
+      return NULL;
+
+  p = w->buf->last;
+  w->buf->last += len;
+  w->len += len;
+
+  return p;
+}
+
+static const char *ubus_writer_next(ubus_writer_t *w, const char *name);
+
+void ubus_writer_append(ubus_writer_t *w, ubus_writer_t *tail) {
+  if (!tail->first)
+    return;
+
+  // tail holds a whole element of the container open in w
+  ubus_writer_next(w, NULL);
+
+  // The blocks of tail are linked as they are, further writes go to the
+  // free space left in its last block
+  *w->last = tail->first;
+  w->last = tail->last;
+  w->buf = tail->buf;
+  w->len += tail->len;
+  w->error |= tail->error;
+
+  tail->first = NULL;
+  tail->last = &tail->first;
+  tail->buf = NULL;
+  tail->len = 0;
+}
+
+void ubus_writer_string(ubus_writer_t *w, const char *str) {
+  u_char esc[7];
+  const char *run;
+  unsigned char c;
+
+  ubus_writer_write(w, "\"", 1);
+
+  for (run = str; (c = *str); str++) {
+    if (c >= ' ' && c != '"' && c != '\\')
+      continue;
+
+    ubus_writer_write(w, run, str - run);
+    run = str + 1;
+
+    switch (c) {
+    case '"':
+      ubus_writer_write(w, "\\\"", 2);
+      break;
+    case '\\':
+      ubus_writer_write(w, "\\\\", 2);
+      break;
+    case '\b':
+      ubus_writer_write(w, "\\b", 2);
+      break;
+    case '\n':
+      ubus_writer_write(w, "\\n", 2);
+      break;
+    case '\r':
+      ubus_writer_write(w, "\\r", 2);
+      break;
+    case '\t':
+      ubus_writer_write(w, "\\t", 2);
+      break;
+    default:
+      ubus_writer_write(w, esc, ngx_sprintf(esc, "\\u%04xd", c) - esc);
+      break;
+    }
+  }
+
+  ubus_writer_write(w, run, str - run);
+  ubus_writer_write(w, "\"", 1);
+}
+
+static void ubus_writer_json(ubus_writer_t *w, struct blob_attr *attr);
+
+static void ubus_writer_json_members(ubus_writer_t *w, struct blob_attr *attr,
+                                     bool table) {
+  int rem;
+  bool first = true;
+  struct blob_attr *cur;
+
+  blobmsg_for_each_attr(cur, attr, rem) {
+    if (!first)
+      ubus_writer_write(w, ",", 1);
+    first = false;
+
+    if (table) {
+      ubus_writer_string(w, blobmsg_name(cur));
+      ubus_writer_write(w, ":", 1);
+    }
+
+    ubus_writer_json(w, cur);
+  }
+}
+
+static void ubus_writer_json(ubus_writer_t *w, struct blob_attr *attr) {
+  int len;
+  // Room for -DBL_MAX printed with %lf: 309 digits, sign, point, 6 decimals
+  char num[320];
+
+  switch (blobmsg_type(attr)) {
+  case BLOBMSG_TYPE_TABLE:
+    ubus_writer_write(w, "{", 1);
+    ubus_writer_json_members(w, attr, true);
+    ubus_writer_write(w, "}", 1);
+    return;
+  case BLOBMSG_TYPE_ARRAY:
+    ubus_writer_write(w, "[", 1);
+    ubus_writer_json_members(w, attr, false);
+    ubus_writer_write(w, "]", 1);
+    return;
+  case BLOBMSG_TYPE_STRING:
+    ubus_writer_string(w, blobmsg_get_string(attr));
+    return;
+  case BLOBMSG_TYPE_BOOL:
+    if (blobmsg_get_bool(attr))
+      ubus_writer_write(w, "true", 4);
+    else
+      ubus_writer_write(w, "false", 5);
+    return;
+  case BLOBMSG_TYPE_INT16:
+    len = snprintf(num, sizeof(num), "%d", (int16_t)blobmsg_get_u16(attr));
+    break;
+  case BLOBMSG_TYPE_INT32:
+    len = snprintf(num, sizeof(num), "%d", (int32_t)blobmsg_get_u32(attr));
+    break;
+  case BLOBMSG_TYPE_INT64:
+    len = snprintf(num, sizeof(num), "%" PRId64,
+                   (int64_t)blobmsg_get_u64(attr));
+    break;
+  case BLOBMSG_TYPE_DOUBLE:
+    len = snprintf(num, sizeof(num), "%lf", blobmsg_get_double(attr));
+    break;
+  default:
+    ubus_writer_write(w, "null", 4);
+    return;
+  }
+
+  if (len < 0)
+    len = 0;
+  else if ((size_t)len >= sizeof(num))
+    len = sizeof(num) - 1;
+
+  ubus_writer_write(w, num, len);
+}
+
+// MessagePack header of a string, an array or a map, with the shortest
+// encoding of n
+static void ubus_writer_msgpack_hdr(ubus_writer_t *w, u_char fix,
+                                    u_char base, size_t fixmax, size_t n) {
+  u_char hdr[5];
+  uint16_t n16;
+  uint32_t n32;
+
+  if (n <= fixmax) {
+    hdr[0] = fix | n;
+    ubus_writer_write(w, hdr, 1);
+  } else if (base == 0xd9 && n <= 0xff) {
+    // Only strings have an 8 bit length
+    hdr[0] = base;
+    hdr[1] = n;
+    ubus_writer_write(w, hdr, 2);
+  } else if (n <= 0xffff) {
+    hdr[0] = base == 0xd9 ? 0xda : base;
+    n16 = cpu_to_be16(n);
+    ngx_memcpy(hdr + 1, &n16, 2);
+    ubus_writer_write(w, hdr, 3);
+  } else {
+    hdr[0] = (base == 0xd9 ? 0xda : base) + 1;
+    n32 = cpu_to_be32(n);
+    ngx_memcpy(hdr + 1, &n32, 4);
+    ubus_writer_write(w, hdr, 5);
+  }
+}
+
+static void ubus_writer_msgpack_str(ubus_writer_t *w, const char *str) {
+  size_t len = strlen(str);
+
+  ubus_writer_msgpack_hdr(w, 0xa0, 0xd9, 31, len);
+  ubus_writer_write(w, str, len);
+}
+
+static void ubus_writer_msgpack_int(ubus_writer_t *w, int64_t val) {
+  u_char buf[9];
+  uint16_t v16;
+  uint32_t v32;
+  uint64_t v64;
+
+  if (val >= -32 && val <= 127) {
+    buf[0] = (u_char)val;
+    ubus_writer_write(w, buf, 1);
+  } else if (val >= INT8_MIN && val <= UINT8_MAX) {
+    buf[0] = val < 0 ? 0xd0 : 0xcc;
+    buf[1] = (u_char)val;
+    ubus_writer_write(w, buf, 2);
+  } else if (val >= INT16_MIN && val <= UINT16_MAX) {
+    buf[0] = val < 0 ? 0xd1 : 0xcd;
+    v16 = cpu_to_be16((uint16_t)val);
+    ngx_memcpy(buf + 1, &v16, 2);
+    ubus_writer_write(w, buf, 3);
+  } else if (val >= INT32_MIN && val <= UINT32_MAX) {
+    buf[0] = val < 0 ? 0xd2 : 0xce;
+    v32 = cpu_to_be32((uint32_t)val);
+    ngx_memcpy(buf + 1, &v32, 4);
+    ubus_writer_write(w, buf, 5);
+  } else {
+    buf[0] = 0xd3;
+    v64 = cpu_to_be64((uint64_t)val);
+    ngx_memcpy(buf + 1, &v64, 8);
+    ubus_writer_write(w, buf, 9);
+  }
+}
+
+static void ubus_writer_msgpack(ubus_writer_t *w, struct blob_attr *attr) {
+  int rem;
+  size_t n = 0;
+  u_char buf[9];
+  double d;
+  uint64_t v64;
+  struct blob_attr *cur;
+
+  switch (blobmsg_type(attr)) {
+  case BLOBMSG_TYPE_TABLE:
+  case BLOBMSG_TYPE_ARRAY:
+    blobmsg_for_each_attr(cur, attr, rem) n++;
+
+    if (blobmsg_type(attr) == BLOBMSG_TYPE_TABLE)
+      ubus_writer_msgpack_hdr(w, 0x80, 0xde, 15, n);
+    else
+      ubus_writer_msgpack_hdr(w, 0x90, 0xdc, 15, n);
+
+    blobmsg_for_each_attr(cur, attr, rem) {
+      if (blobmsg_type(attr) == BLOBMSG_TYPE_TABLE)
+        ubus_writer_msgpack_str(w, blobmsg_name(cur));
+      ubus_writer_msgpack(w, cur);
+    }
+    return;
+  case BLOBMSG_TYPE_STRING:
+    ubus_writer_msgpack_str(w, blobmsg_get_string(attr));
+    return;
+  case BLOBMSG_TYPE_BOOL:
+    buf[0] = blobmsg_get_bool(attr) ? 0xc3 : 0xc2;
+    break;
+  case BLOBMSG_TYPE_INT16:
+    ubus_writer_msgpack_int(w, (int16_t)blobmsg_get_u16(attr));
+    return;
+  case BLOBMSG_TYPE_INT32:
+    ubus_writer_msgpack_int(w, (int32_t)blobmsg_get_u32(attr));
+    return;
+  case BLOBMSG_TYPE_INT64:
+    ubus_writer_msgpack_int(w, (int64_t)blobmsg_get_u64(attr));
+    return;
+  case BLOBMSG_TYPE_DOUBLE:
+    d = blobmsg_get_double(attr);
+    ngx_memcpy(&v64, &d, 8);
+    v64 = cpu_to_be64(v64);
+    buf[0] = 0xcb;
+    ngx_memcpy(buf + 1, &v64, 8);
+    ubus_writer_write(w, buf, 9);
+    return;
+  default:
+    buf[0] = 0xc0;
+    break;
+  }
+
+  ubus_writer_write(w, buf, 1);
+}
+
+// blob_attr and blobmsg_hdr of a member, len is the length of its data
+static size_t ubus_writer_blobmsg_hdr(u_char *p, int type, const char *name,
+                                      size_t len) {
+  uint16_t namelen = strlen(name);
+  size_t hdrlen = sizeof(struct blob_attr) + blobmsg_hdrlen(namelen);
+  uint32_t id_len = cpu_to_be32(BLOB_ATTR_EXTENDED |
+                                (type << BLOB_ATTR_ID_SHIFT) | (hdrlen + len));
+  uint16_t nl = cpu_to_be16(namelen);
+
+  if (!p)
+    return hdrlen;
+
+  ngx_memzero(p, hdrlen);
+  ngx_memcpy(p, &id_len, sizeof(id_len));
+  ngx_memcpy(p + sizeof(id_len), &nl, sizeof(nl));
+  ngx_memcpy(p + sizeof(id_len) + sizeof(nl), name, namelen);
+
+  return hdrlen;
+}
+
+static void ubus_writer_blobmsg(ubus_writer_t *w, const char *name,
+                                struct blob_attr *attr) {
+  u_char *hdr;
+  size_t len, hdrlen;
+  static const u_char pad[BLOB_ATTR_ALIGN];
+
+  // Attributes keeping their name are copied as they are
+  if (!strcmp(name, blobmsg_name(attr))) {
+    len = blob_raw_len(attr);
+    ubus_writer_write(w, attr, len);
+  } else {
+    len = blobmsg_data_len(attr);
+    hdrlen = ubus_writer_blobmsg_hdr(NULL, blobmsg_type(attr), name, len);
+
+    hdr = ubus_writer_alloc(w, hdrlen);
+    if (!hdr)
+      return;
+
+    ubus_writer_blobmsg_hdr(hdr, blobmsg_type(attr), name, len);
+    ubus_writer_write(w, blobmsg_data(attr), len);
+    len += hdrlen;
+  }
+
+  if (len > BLOB_ATTR_LEN_MASK)
+    w->error = 1;
+
+  ubus_writer_write(w, pad, (BLOB_ATTR_ALIGN - len % BLOB_ATTR_ALIGN) %
+                               BLOB_ATTR_ALIGN);
+}
+
+// Separator and name ahead of an element of the open container. With
+// blobmsg the name goes in the header of the element, it is returned.
+static const char *ubus_writer_next(ubus_writer_t *w, const char *name) {
+  ubus_writer_level_t *l;
+
+  if (!w->depth)
+    return "";
+
+  l = &w->stack[w->depth - 1];
+
+  if (w->format == UBUS_FORMAT_JSON && l->count)
+    ubus_writer_write(w, ",", 1);
+
+  l->count++;
+
+  if (!l->table)
+    return "";
+
+  if (w->format == UBUS_FORMAT_JSON) {
+    ubus_writer_string(w, name);
+    ubus_writer_write(w, ":", 1);
+  } else if (w->format == UBUS_FORMAT_MSGPACK) {
+    ubus_writer_msgpack_str(w, name);
+  }
+
+  return name;
+}
+
+void ubus_writer_value(ubus_writer_t *w, const char *name,
+                       struct blob_attr *attr) {
+  name = ubus_writer_next(w, name);
+
+  switch (w->format) {
+  case UBUS_FORMAT_BLOBMSG:
+    ubus_writer_blobmsg(w, name, attr);
+    break;
+  case UBUS_FORMAT_MSGPACK:
+    ubus_writer_msgpack(w, attr);
+    break;
+  default:
+    ubus_writer_json(w, attr);
+    break;
+  }
+}
+
+void ubus_writer_int(ubus_writer_t *w, const char *name, int32_t val) {
+  u_char *p;
+  uint32_t v;
+  size_t hdrlen;
+  u_char num[NGX_INT32_LEN];
+
+  name = ubus_writer_next(w, name);
+
+  switch (w->format) {
+  case UBUS_FORMAT_BLOBMSG:
+    hdrlen = ubus_writer_blobmsg_hdr(NULL, BLOBMSG_TYPE_INT32, name, 4);
+
+    p = ubus_writer_alloc(w, hdrlen + 4);
+    if (!p)
+      return;
+
+    ubus_writer_blobmsg_hdr(p, BLOBMSG_TYPE_INT32, name, 4);
+    v = cpu_to_be32((uint32_t)val);
+    ngx_memcpy(p + hdrlen, &v, 4);
+    break;
+  case UBUS_FORMAT_MSGPACK:
+    ubus_writer_msgpack_int(w, val);
+    break;
+  default:
+    ubus_writer_write(w, num, ngx_sprintf(num, "%D", val) - num);
+    break;
+  }
+}
+
+// A value the caller already has in the encoding of the writer
+void ubus_writer_raw(ubus_writer_t *w, const char *name, const void *data,
+                     size_t len) {
+  ubus_writer_next(w, name);
+  ubus_writer_write(w, data, len);
+}
+
+// count is the number of elements when known up front, -1 otherwise and
+// the header is completed by ubus_writer_close
+static void ubus_writer_begin(ubus_writer_t *w, const char *name, bool table,
+                              ngx_int_t count) {
+  u_char *hdr = NULL;
+  size_t start, hdrlen;
+  ubus_writer_level_t *l;
+
+  name = ubus_writer_next(w, name);
+  start = w->len;
+
+  if (w->depth == UBUS_WRITER_MAX_DEPTH) {
+    w->error = 1;
+    return;
+  }
+
+  switch (w->format) {
+  case UBUS_FORMAT_BLOBMSG:
+    hdrlen = ubus_writer_blobmsg_hdr(
+        NULL, table ? BLOBMSG_TYPE_TABLE : BLOBMSG_TYPE_ARRAY, name, 0);
+
+    hdr = ubus_writer_alloc(w, hdrlen);
+    if (!hdr)
+      return;
+
+    start = w->len - hdrlen;
+    ubus_writer_blobmsg_hdr(
+        hdr, table ? BLOBMSG_TYPE_TABLE : BLOBMSG_TYPE_ARRAY, name, 0);
+    break;
+  case UBUS_FORMAT_MSGPACK:
+    if (count >= 0) {
+      if (table)
+        ubus_writer_msgpack_hdr(w, 0x80, 0xde, 15, count);
+      else
+        ubus_writer_msgpack_hdr(w, 0x90, 0xdc, 15, count);
+      break;
+    }
+
+    // Always the 32 bit form, the count is only known on close
+    hdr = ubus_writer_alloc(w, 5);
+    if (!hdr)
+      return;
+
+    hdr[0] = table ? 0xdf : 0xdd;
+    break;
+  default:
+    ubus_writer_write(w, table ? "{" : "[", 1);
+    break;
+  }
+
+  l = &w->stack[w->depth++];
+  l->hdr = hdr;
+  l->start = start;
+  l->count = 0;
+  l->table = table;
+}
+
+void ubus_writer_array(ubus_writer_t *w, const char *name, ngx_int_t count) {
+  ubus_writer_begin(w, name, false, count);
+}
+
+void ubus_writer_open(ubus_writer_t *w, struct blob_attr *head) {
+  int rem;
+  struct blob_attr *cur;
+
+  ubus_writer_begin(w, NULL, true, -1);
+
+  blob_for_each_attr(cur, head, rem)
+      ubus_writer_value(w, blobmsg_name(cur), cur);
+}
+
+void ubus_writer_close(ubus_writer_t *w) {
+  uint32_t v;
+  size_t len;
+  ubus_writer_level_t *l;
+
+  if (!w->depth)
+    return;
+
+  l = &w->stack[--w->depth];
+
+  switch (w->format) {
+  case UBUS_FORMAT_BLOBMSG:
+    // Members are padded, so is the container
+    len = w->len - l->start;
+    if (len > BLOB_ATTR_LEN_MASK) {
+      w->error = 1;
+      return;
+    }
+
+    v = cpu_to_be32(BLOB_ATTR_EXTENDED |
+                    ((l->table ? BLOBMSG_TYPE_TABLE : BLOBMSG_TYPE_ARRAY)
+                     << BLOB_ATTR_ID_SHIFT) |
+                    len);
+    ngx_memcpy(l->hdr, &v, sizeof(v));
+    break;
+  case UBUS_FORMAT_MSGPACK:
+    if (!l->hdr)
+      break;
+
+    v = cpu_to_be32(l->count);
+    ngx_memcpy(l->hdr + 1, &v, sizeof(v));
+    break;
+  default:
+    ubus_writer_write(w, l->table ? "}" : "]", 1);
+    break;
+  }
+}
+
+void ubus_writer_object(ubus_writer_t *w, struct blob_attr *head) {
+  ubus_writer_open(w, head);
+  ubus_writer_close(w);
+}